@@ -1,7 +1,7 @@
 EXE="review"
 INCLUDES="-I./include"
 SRC_FILES="./src/*.c ./src/*.cpp"
-LIBS="`pkg-config --static --libs glfw3`"
+LIBS="`pkg-config --static --libs glfw3` -lEGL -pthread"
 
 MAIN_CPP="main.cpp"
 
@@ -0,0 +1,185 @@
+#ifndef CAMERAPATH_HEADER_GUARD
+#define CAMERAPATH_HEADER_GUARD
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <files.hpp>
+
+
+/*
+ Scripted camera flythroughs, so benchmark runs see exactly the same views.
+
+ A path is a list of keyframes, each a time, a camera position and an
+ orientation quaternion. The position between keyframes follows a
+ Catmull-Rom spline (tangents scaled for uneven keyframe spacing) and the
+ orientation is slerped, so the camera moves smoothly through every
+ keyframe. The frame times are gathered per segment (between two
+ keyframes) so a slow part of the flythrough shows up on its own.
+*/
+namespace camerapath {
+
+    struct Keyframe {
+        double time;
+        glm::vec3 position;
+        glm::quat orientation;   // Rotates the camera's -z (forward) and +y (up) into the world
+    };
+
+    class Path {
+        public:
+            std::vector<Keyframe> keys;
+
+            /*
+             Will read a path from an array file, one keyframe per row:
+                time x y z qw qx qy qz
+             with the times in seconds and increasing.
+
+             Inputs:
+                * filepath <std::string> => The path file.
+            */
+            void load(const std::string &filepath) {
+                IO::FloatArrayFile file;
+                file.read(filepath);
+                if (file.num_arr_elem != 8 || file.num_vertices < 2) {
+                    std::cerr << "A camera path needs at least 2 rows of 'time x y z qw qx qy qz', '";
+                    std::cerr << filepath << "' has " << file.num_vertices << " rows of ";
+                    std::cerr << file.num_arr_elem << std::endl;
+                    throw "CameraPathError";
+                }
+
+                keys.resize(file.num_vertices);
+                for (unsigned int k=0; k<file.num_vertices; k++) {
+                    const float *row = file.data + k * 8;
+                    keys[k].time = row[0];
+                    keys[k].position = glm::vec3(row[1], row[2], row[3]);
+                    keys[k].orientation = glm::normalize(glm::quat(row[4], row[5], row[6], row[7]));
+
+                    if (k > 0 && keys[k].time <= keys[k - 1].time) {
+                        std::cerr << "Camera path keyframe " << k << " in '" << filepath;
+                        std::cerr << "' isn't after the one before it" << std::endl;
+                        throw "CameraPathError";
+                    }
+                    // q and -q are the same rotation, keep neighbours on the same side so slerp takes the short way
+                    if (k > 0 && glm::dot(keys[k].orientation, keys[k - 1].orientation) < 0.0f)
+                        keys[k].orientation = -keys[k].orientation;
+                }
+            }
+
+            double duration() const {
+                return keys.empty() ? 0.0 : keys.back().time;
+            }
+
+            unsigned int numSegments() const {
+                return keys.size() < 2 ? 0 : keys.size() - 1;
+            }
+
+            /*
+             The segment a time falls in (the last one past the end).
+            */
+            unsigned int segmentAt(double t) const {
+                unsigned int s = std::upper_bound(keys.begin(), keys.end(), t,
+                    [](double time, const Keyframe &k) { return time < k.time; }) - keys.begin();
+                if (s > 0) s--;
+                return std::min(s, numSegments() - 1);
+            }
+
+            /*
+             Will give the camera's position and orientation at a time (held at the ends).
+            */
+            void sample(double t, glm::vec3 &position, glm::quat &orientation) const {
+                if (t <= keys.front().time) {
+                    position = keys.front().position;
+                    orientation = keys.front().orientation;
+                    return;
+                }
+                if (t >= keys.back().time) {
+                    position = keys.back().position;
+                    orientation = keys.back().orientation;
+                    return;
+                }
+
+                unsigned int s = segmentAt(t);
+                const Keyframe &k1 = keys[s], &k2 = keys[s + 1];
+                const Keyframe &k0 = keys[s > 0 ? s - 1 : s];
+                const Keyframe &k3 = keys[s + 2 < keys.size() ? s + 2 : s + 1];
+                float dt = (float) (k2.time - k1.time);
+                float u = (float) ((t - k1.time) / dt);
+
+                // Hermite with the Catmull-Rom tangents in units of this segment
+                glm::vec3 m1 = (k2.position - k0.position) * (dt / (float) (k2.time - k0.time));
+                glm::vec3 m2 = (k3.position - k1.position) * (dt / (float) (k3.time - k1.time));
+                float u2 = u * u, u3 = u2 * u;
+                position = (2*u3 - 3*u2 + 1) * k1.position + (u3 - 2*u2 + u) * m1 +
+                           (-2*u3 + 3*u2) * k2.position + (u3 - u2) * m2;
+                orientation = glm::slerp(k1.orientation, k2.orientation, u);
+            }
+
+            /*
+             The view matrix at a time.
+            */
+            glm::mat4 view(double t) const {
+                glm::vec3 position;
+                glm::quat orientation;
+                sample(t, position, orientation);
+                return glm::mat4_cast(glm::conjugate(orientation)) * glm::translate(glm::mat4(1.0f), -position);
+            }
+    };
+
+    /*
+     Frame times gathered per path segment.
+    */
+    class SegmentStats {
+        private:
+            struct Segment {
+                unsigned long num_frames = 0;
+                double total_seconds = 0.0;
+                double total_cpu_seconds = 0.0;
+                double max_seconds = 0.0;
+            };
+            std::vector<Segment> segments;
+
+        public:
+            /*
+             Will add a frame to the segment its simulation time falls in.
+
+             Inputs:
+                * path <const Path &> => The path being played.
+                * t <double> => The simulation time the frame was drawn at.
+                * frame_seconds <double> => How long the whole frame took.
+                * cpu_seconds <double> => How long the CPU took to build and submit it.
+            */
+            void add(const Path &path, double t, double frame_seconds, double cpu_seconds) {
+                segments.resize(path.numSegments());
+                Segment &s = segments[path.segmentAt(t)];
+                s.num_frames++;
+                s.total_seconds += frame_seconds;
+                s.total_cpu_seconds += cpu_seconds;
+                s.max_seconds = std::max(s.max_seconds, frame_seconds);
+            }
+
+            void print(const Path &path) const {
+                if (segments.empty()) return;
+                std::cout << "camera path (ms):" << std::endl;
+                std::cout << "  segment            frames  frame avg  frame max    cpu avg" << std::endl;
+                for (size_t i=0; i<segments.size(); i++) {
+                    const Segment &s = segments[i];
+                    if (s.num_frames == 0) continue;
+                    char line[128];
+                    snprintf(line, sizeof(line), "  %2zu %6.2f-%6.2f s %8lu %10.3f %10.3f %10.3f", i,
+                             path.keys[i].time, path.keys[i + 1].time, s.num_frames,
+                             1000.0 * s.total_seconds / s.num_frames, 1000.0 * s.max_seconds,
+                             1000.0 * s.total_cpu_seconds / s.num_frames);
+                    std::cout << line << std::endl;
+                }
+            }
+    };
+}
+
+#endif
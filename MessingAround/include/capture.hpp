@@ -0,0 +1,514 @@
+#ifndef CAPTURE_HEADER_GUARD
+#define CAPTURE_HEADER_GUARD
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <timing.hpp>
+#include <trace.hpp>
+
+
+/*
+ Writing out every frame without stalling the renderer.
+
+ glReadPixels into client memory waits for the GPU to finish the frame.
+ Instead each frame is read into the next of a ring of pixel pack buffers
+ with a fence after it, and a buffer is only mapped when the ring comes
+ back round to it a few frames later, by which time the GPU has long
+ finished with it. The mapped pixels are copied out and handed to encoder
+ threads, which flip, convert and write them (a PPM or PNG per frame, or
+ one uncompressed Y4M video stream) while the next frames are drawn.
+
+ When the window is resized the buffers are remade at the new size. Every
+ image file has the size its frame was drawn at, the Y4M stream keeps the
+ size it started with and crops or pads the frames to it.
+*/
+namespace capture {
+
+    enum Format {
+        PPM,
+        PNG,
+        Y4M
+    };
+
+    /*
+     The format for a name given on the command line (ppm, png or y4m).
+    */
+    Format formatFromName(const std::string &name) {
+        if (name == "ppm") return PPM;
+        if (name == "png") return PNG;
+        if (name == "y4m") return Y4M;
+        std::cerr << "Unknown capture format '" << name << "'" << std::endl;
+        throw "CaptureError";
+    }
+
+    /*
+     The CRC-32 PNG chunks end with.
+    */
+    uint32_t crc32(const unsigned char *data, size_t size, uint32_t crc=0) {
+        // A static initialised once, thread safely, the encoder threads all call this
+        static const std::array<uint32_t, 256> table = [] {
+            std::array<uint32_t, 256> t;
+            for (uint32_t n=0; n<256; n++) {
+                uint32_t c = n;
+                for (int k=0; k<8; k++)
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+        crc = ~crc;
+        for (size_t i=0; i<size; i++)
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    /*
+     Will write an RGB image as a PNG. The pixels are stored in zlib's
+     uncompressed blocks, so the files are big but cost almost nothing to write.
+
+     Inputs:
+        * file <FILE *> => Where to write it.
+        * rgb <const unsigned char *> => The pixels, top row first, 3 bytes each.
+        * width, height <unsigned int> => The size of the image.
+    */
+    void writePNG(FILE *file, const unsigned char *rgb, unsigned int width, unsigned int height) {
+        auto put32 = [](std::vector<unsigned char> &out, uint32_t v) {
+            out.push_back(v >> 24); out.push_back(v >> 16); out.push_back(v >> 8); out.push_back(v);
+        };
+        auto writeChunk = [&](const char *type, const std::vector<unsigned char> &data) {
+            std::vector<unsigned char> chunk;
+            put32(chunk, data.size());
+            chunk.insert(chunk.end(), type, type + 4);
+            chunk.insert(chunk.end(), data.begin(), data.end());
+            put32(chunk, crc32(&chunk[4], chunk.size() - 4));
+            fwrite(chunk.data(), 1, chunk.size(), file);
+        };
+
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        fwrite(signature, 1, 8, file);
+
+        std::vector<unsigned char> header;
+        put32(header, width);
+        put32(header, height);
+        header.push_back(8);    // Bits per channel
+        header.push_back(2);    // RGB
+        header.push_back(0); header.push_back(0); header.push_back(0);
+        writeChunk("IHDR", header);
+
+        // Every row starts with its filter type (0, none)
+        size_t row_bytes = (size_t) width * 3;
+        std::vector<unsigned char> raw;
+        raw.reserve((row_bytes + 1) * height);
+        for (unsigned int y=0; y<height; y++) {
+            raw.push_back(0);
+            raw.insert(raw.end(), rgb + y * row_bytes, rgb + (y + 1) * row_bytes);
+        }
+
+        // A zlib stream of stored blocks (at most 65535 bytes each) and an Adler-32
+        std::vector<unsigned char> z;
+        z.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+        z.push_back(0x78); z.push_back(0x01);
+        size_t pos = 0;
+        do {
+            size_t n = raw.size() - pos < 65535 ? raw.size() - pos : 65535;
+            z.push_back(pos + n == raw.size() ? 1 : 0);
+            z.push_back(n & 0xFF); z.push_back(n >> 8);
+            z.push_back(~n & 0xFF); z.push_back((~n >> 8) & 0xFF);
+            z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + n);
+            pos += n;
+        } while (pos < raw.size());
+        uint32_t a = 1, b = 0;
+        for (size_t i=0; i<raw.size(); i++) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        put32(z, (b << 16) | a);
+        writeChunk("IDAT", z);
+        writeChunk("IEND", std::vector<unsigned char>());
+    }
+
+    /*
+     Numbers for the whole capture, printed when it finishes.
+    */
+    struct Stats {
+        unsigned long num_frames = 0;
+        unsigned long gpu_stalls = 0;       // A buffer was needed again before the GPU had filled it
+        unsigned long encoder_stalls = 0;   // The encoders were too far behind to take another frame
+        double render_seconds = 0.0;        // Spent in capture calls on the render thread
+    };
+
+    class Capturer {
+        private:
+            /*
+             A pixel pack buffer and the fence after the read into it.
+            */
+            struct Slot {
+                unsigned int handle = 0;
+                GLsync fence = 0;
+                bool pending = false;
+            };
+
+            /*
+             A frame waiting for the encoders, RGBA with the bottom row first.
+            */
+            struct Job {
+                unsigned long sequence;
+                unsigned int width, height;
+                std::vector<unsigned char> pixels;
+            };
+
+            std::vector<Slot> slots;
+            unsigned int next_slot = 0;
+
+            std::vector<std::thread> encoders;
+            std::deque<Job> jobs;
+            std::vector<std::vector<unsigned char>> spare_buffers;
+            std::mutex jobs_mutex;
+            std::condition_variable jobs_cv, space_cv, written_cv;
+            unsigned int num_in_flight = 0;     // Queued or being encoded
+            unsigned long next_sequence = 0;
+            unsigned long next_to_write = 0;    // For the in order Y4M stream
+            bool stopping = false;
+            FILE *stream = NULL;
+            unsigned int stream_width = 0, stream_height = 0;
+
+            size_t frameBytes() const {
+                return (size_t) width * height * 4;
+            }
+
+            /*
+             A buffer to copy a frame into, reused once the encoders are done with it.
+            */
+            std::vector<unsigned char> takeBuffer() {
+                std::lock_guard<std::mutex> lock(jobs_mutex);
+                if (spare_buffers.empty()) return std::vector<unsigned char>(frameBytes());
+                std::vector<unsigned char> buffer = std::move(spare_buffers.back());
+                spare_buffers.pop_back();
+                buffer.resize(frameBytes());    // It may be from before a resize
+                return buffer;
+            }
+
+            /*
+             Will hand a frame to the encoders, waiting if too many are already queued.
+            */
+            void queue(std::vector<unsigned char> &&pixels) {
+                std::unique_lock<std::mutex> lock(jobs_mutex);
+                if (num_in_flight >= max_in_flight) {
+                    stats.encoder_stalls++;
+                    space_cv.wait(lock, [this] { return num_in_flight < max_in_flight; });
+                }
+                Job job;
+                job.sequence = next_sequence++;
+                job.width = width;
+                job.height = height;
+                job.pixels = std::move(pixels);
+                jobs.push_back(std::move(job));
+                num_in_flight++;
+                stats.num_frames++;
+                lock.unlock();
+                jobs_cv.notify_one();
+            }
+
+            /*
+             Will map a slot's buffer once the GPU has filled it and queue the frame.
+            */
+            void collect(Slot &slot) {
+                GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+                if (status == GL_TIMEOUT_EXPIRED) {
+                    TRACE_SCOPE("capture::Capturer wait for GPU");
+                    stats.gpu_stalls++;
+                    while (status == GL_TIMEOUT_EXPIRED)
+                        status = glClientWaitSync(slot.fence, 0, 1000000000);
+                }
+                glDeleteSync(slot.fence);
+                slot.pending = false;
+
+                std::vector<unsigned char> pixels = takeBuffer();
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.handle);
+                void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameBytes(), GL_MAP_READ_BIT);
+                memcpy(pixels.data(), data, frameBytes());
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                queue(std::move(pixels));
+            }
+
+            /*
+             Will write one frame out, on an encoder thread.
+            */
+            void encode(Job &job) {
+                TRACE_SCOPE("capture::Capturer encode");
+                const unsigned char *pixels = job.pixels.data();
+                unsigned int width = job.width, height = job.height;
+                if (format == Y4M) {
+                    // The pixel at (x, y) from the top, black outside a frame smaller than the stream
+                    static const unsigned char black[4] = {0, 0, 0, 255};
+                    auto at = [&](unsigned int x, unsigned int y) -> const unsigned char * {
+                        if (x >= width || y >= height) return black;
+                        return pixels + ((size_t) (height - 1 - y) * width + x) * 4;
+                    };
+
+                    // Full range BT.601 (as JPEG), chroma averaged over 2x2 blocks
+                    unsigned int sw = stream_width, sh = stream_height;
+                    unsigned int cw = (sw + 1) / 2, ch = (sh + 1) / 2;
+                    std::vector<unsigned char> yuv((size_t) sw * sh + 2 * (size_t) cw * ch);
+                    unsigned char *Y = yuv.data(), *U = Y + (size_t) sw * sh, *V = U + (size_t) cw * ch;
+                    for (unsigned int y=0; y<sh; y++) {
+                        for (unsigned int x=0; x<sw; x++) {
+                            const unsigned char *src = at(x, y);
+                            Y[(size_t) y * sw + x] = (unsigned char)
+                                (0.299f * src[0] + 0.587f * src[1] + 0.114f * src[2] + 0.5f);
+                        }
+                    }
+                    for (unsigned int cy=0; cy<ch; cy++) {
+                        for (unsigned int cx=0; cx<cw; cx++) {
+                            float r = 0.0f, g = 0.0f, b = 0.0f, n = 0.0f;
+                            for (unsigned int y=2*cy; y<2*cy + 2 && y<sh; y++) {
+                                for (unsigned int x=2*cx; x<2*cx + 2 && x<sw; x++) {
+                                    const unsigned char *src = at(x, y);
+                                    r += src[0]; g += src[1]; b += src[2]; n += 1.0f;
+                                }
+                            }
+                            r /= n; g /= n; b /= n;
+                            U[(size_t) cy * cw + cx] = (unsigned char) (128.5f - 0.168736f * r - 0.331264f * g + 0.5f * b);
+                            V[(size_t) cy * cw + cx] = (unsigned char) (128.5f + 0.5f * r - 0.418688f * g - 0.081312f * b);
+                        }
+                    }
+
+                    // Frames can be converted in any order but have to be written in order
+                    {
+                        std::unique_lock<std::mutex> lock(jobs_mutex);
+                        written_cv.wait(lock, [&] { return next_to_write == job.sequence; });
+                    }
+                    fputs("FRAME\n", stream);
+                    fwrite(yuv.data(), 1, yuv.size(), stream);
+                    {
+                        std::lock_guard<std::mutex> lock(jobs_mutex);
+                        next_to_write++;
+                    }
+                    written_cv.notify_all();
+                    return;
+                }
+
+                std::vector<unsigned char> rgb((size_t) width * height * 3);
+                for (unsigned int y=0; y<height; y++) {
+                    // GL's first row is the bottom of the image
+                    const unsigned char *src = pixels + (size_t) (height - 1 - y) * width * 4;
+                    unsigned char *dst = &rgb[(size_t) y * width * 3];
+                    for (unsigned int x=0; x<width; x++) {
+                        dst[x*3 + 0] = src[x*4 + 0];
+                        dst[x*3 + 1] = src[x*4 + 1];
+                        dst[x*3 + 2] = src[x*4 + 2];
+                    }
+                }
+
+                char name[32];
+                snprintf(name, sizeof(name), "/frame_%05lu.%s", job.sequence, format == PNG ? "png" : "ppm");
+                std::string filepath = dir + name;
+                FILE *file = fopen(filepath.c_str(), "wb");
+                if (file == NULL) {
+                    std::cerr << "Failed to open '" << filepath << "' for writing" << std::endl;
+                    return;
+                }
+                if (format == PNG) {
+                    writePNG(file, rgb.data(), width, height);
+                } else {
+                    fprintf(file, "P6\n%u %u\n255\n", width, height);
+                    fwrite(rgb.data(), 1, rgb.size(), file);
+                }
+                fclose(file);
+            }
+
+            /*
+             The loop every encoder thread runs until the capture finishes.
+            */
+            void encoderLoop() {
+                TRACE_THREAD_NAME("encoder");
+                while (true) {
+                    Job job;
+                    {
+                        std::unique_lock<std::mutex> lock(jobs_mutex);
+                        jobs_cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+                        if (stopping && jobs.empty()) return;
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                    }
+                    encode(job);
+                    {
+                        std::lock_guard<std::mutex> lock(jobs_mutex);
+                        spare_buffers.push_back(std::move(job.pixels));
+                        num_in_flight--;
+                    }
+                    space_cv.notify_one();
+                }
+            }
+
+        public:
+            unsigned int width = 0, height = 0;
+            Format format = PPM;
+            std::string dir;
+            unsigned int fps = 60;              // Written in the Y4M header
+            unsigned int max_in_flight = 8;     // Frames queued for the encoders before the renderer waits
+            Stats stats;
+
+            /*
+             Will set up the buffers and start the encoder threads.
+
+             Inputs:
+                * w, h <unsigned int> => The size of the frames.
+                * fmt <Format> => What to write.
+                * directory <const std::string &> => Where to write it (frame_NNNNN.ppm/png or capture.y4m).
+                * gl <bool> => Whether frames come from GL (false for the software renderer).
+                * num_buffers <unsigned int> => How many frames a read can be in flight before it's mapped.
+                * num_encoders <unsigned int> => How many encoder threads to start.
+            */
+            void create(unsigned int w, unsigned int h, Format fmt, const std::string &directory,
+                        bool gl, unsigned int num_buffers=3, unsigned int num_encoders=2) {
+                width = w;
+                height = h;
+                format = fmt;
+                dir = directory;
+
+                if (format == Y4M) {
+                    std::string filepath = dir + "/capture.y4m";
+                    stream = fopen(filepath.c_str(), "wb");
+                    if (stream == NULL) {
+                        std::cerr << "Failed to open '" << filepath << "' for writing" << std::endl;
+                        throw "IOError";
+                    }
+                    stream_width = width;
+                    stream_height = height;
+                    fprintf(stream, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", width, height, fps);
+                }
+
+                if (gl) {
+                    slots.resize(num_buffers);
+                    for (size_t s=0; s<slots.size(); s++) {
+                        glGenBuffers(1, &slots[s].handle);
+                        glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[s].handle);
+                        glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes(), NULL, GL_STREAM_READ);
+                    }
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                }
+
+                for (unsigned int e=0; e<num_encoders; e++)
+                    encoders.emplace_back(&Capturer::encoderLoop, this);
+            }
+
+            /*
+             Will collect the frames read at the old size and remake the buffers
+             for the new one, so the next capture reads the whole framebuffer.
+
+             Inputs:
+                * w, h <unsigned int> => The new size of the frames.
+            */
+            void resize(unsigned int w, unsigned int h) {
+                if (w == width && h == height) return;
+                TRACE_SCOPE("capture::Capturer::resize");
+                for (size_t k=0; k<slots.size(); k++) {
+                    Slot &slot = slots[(next_slot + k) % slots.size()];
+                    if (slot.pending) collect(slot);
+                }
+                width = w;
+                height = h;
+                for (size_t s=0; s<slots.size(); s++) {
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[s].handle);
+                    glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes(), NULL, GL_STREAM_READ);
+                }
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            }
+
+            /*
+             Will start reading the framebuffer that is bound for drawing into the
+             next buffer of the ring, collecting the frame that was read into it last.
+            */
+            void capture() {
+                TRACE_SCOPE("capture::Capturer::capture");
+                timing::Stopwatch timer;
+                Slot &slot = slots[next_slot];
+                next_slot = (next_slot + 1) % slots.size();
+                if (slot.pending) collect(slot);
+
+                int framebuffer = 0;
+                glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.handle);
+                glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                slot.pending = true;
+                stats.render_seconds += timer.seconds();
+            }
+
+            /*
+             Will queue a frame that's already in memory (the software renderer's).
+
+             Inputs:
+                * colour <const uint32_t *> => RGBA pixels, bottom row first.
+                * stride <unsigned int> => Pixels from one row to the next.
+                * w, h <unsigned int> => The size of the image there, the part
+                                         outside the capture size is dropped.
+            */
+            void capture(const uint32_t *colour, unsigned int stride, unsigned int w, unsigned int h) {
+                TRACE_SCOPE("capture::Capturer::capture");
+                timing::Stopwatch timer;
+                std::vector<unsigned char> pixels = takeBuffer();
+                std::fill(pixels.begin(), pixels.end(), 0);
+                unsigned int copy_width = w < width ? w : width;
+                for (unsigned int y=0; y<height && y<h; y++)
+                    memcpy(&pixels[(size_t) y * width * 4], colour + (size_t) y * stride, copy_width * 4);
+                queue(std::move(pixels));
+                stats.render_seconds += timer.seconds();
+            }
+
+            /*
+             Will collect the frames still on the GPU, wait for the encoders to
+             write everything and stop them.
+            */
+            void finish() {
+                for (size_t k=0; k<slots.size(); k++) {
+                    Slot &slot = slots[(next_slot + k) % slots.size()];
+                    if (slot.pending) collect(slot);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(jobs_mutex);
+                    stopping = true;
+                }
+                jobs_cv.notify_all();
+                for (size_t e=0; e<encoders.size(); e++)
+                    encoders[e].join();
+                encoders.clear();
+                if (stream != NULL) {
+                    fclose(stream);
+                    stream = NULL;
+                }
+            }
+
+            void print() const {
+                if (stats.num_frames == 0) return;
+                std::cout << "capture: " << stats.num_frames << " frames, ";
+                std::cout << 1000.0 * stats.render_seconds / stats.num_frames << " ms a frame on the render thread, ";
+                std::cout << stats.gpu_stalls << " GPU stalls, " << stats.encoder_stalls << " encoder stalls" << std::endl;
+            }
+
+            void destroy() {
+                for (size_t s=0; s<slots.size(); s++)
+                    glDeleteBuffers(1, &slots[s].handle);
+                slots.clear();
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,534 @@
+#ifndef CULLING_HEADER_GUARD
+#define CULLING_HEADER_GUARD
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <immintrin.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include <rng.hpp>
+#include <threads.hpp>
+#include <timing.hpp>
+#include <trace.hpp>
+
+
+/*
+ CPU frustum culling of instances.
+
+ Every instance is bounded by a sphere, a bounding volume hierarchy is built
+ over the spheres and walked against the 6 planes of the view frustum. Whole
+ subtrees that are completely inside (or outside) are accepted (or rejected)
+ without looking at their instances and the instances in partially visible
+ leaves are tested 4 at a time with SSE.
+*/
+namespace culling {
+
+    /*
+     The 6 frustum planes (left, right, bottom, top, near, far) stored as
+     structure-of-arrays and padded to 8 so they fill two SSE registers.
+
+     A point p is in front of plane i when nx[i]*p.x + ny[i]*p.y + nz[i]*p.z + d[i] >= 0.
+    */
+    struct Frustum {
+        alignas(16) float nx[8];
+        alignas(16) float ny[8];
+        alignas(16) float nz[8];
+        alignas(16) float d[8];
+    };
+
+    /*
+     Will pull the frustum planes out of a projection * view matrix (the
+     Gribb/Hartmann method) and normalise them so distances are in world units.
+
+     Inputs:
+        * view_proj <const glm::mat4 &> => proj * view.
+    */
+    Frustum extractFrustum(const glm::mat4 &view_proj) {
+        // glm is column-major so row i is (m[0][i], m[1][i], m[2][i], m[3][i])
+        glm::vec4 rows[4];
+        for (unsigned int i=0; i<4; i++)
+            rows[i] = glm::vec4(view_proj[0][i], view_proj[1][i], view_proj[2][i], view_proj[3][i]);
+
+        glm::vec4 planes[6] = {
+            rows[3] + rows[0], rows[3] - rows[0],
+            rows[3] + rows[1], rows[3] - rows[1],
+            rows[3] + rows[2], rows[3] - rows[2]
+        };
+
+        Frustum f;
+        for (unsigned int i=0; i<8; i++) {
+            // The padding planes accept everything
+            if (i >= 6) {
+                f.nx[i] = 0.0f; f.ny[i] = 0.0f; f.nz[i] = 0.0f; f.d[i] = 1.0f;
+                continue;
+            }
+            float len = glm::length(glm::vec3(planes[i]));
+            f.nx[i] = planes[i].x / len;
+            f.ny[i] = planes[i].y / len;
+            f.nz[i] = planes[i].z / len;
+            f.d[i]  = planes[i].w / len;
+        }
+        return f;
+    }
+
+    enum Overlap {
+        OUTSIDE,
+        INTERSECTING,
+        INSIDE
+    };
+
+    /*
+     Tests an axis aligned box against all the planes at once.
+    */
+    Overlap testBox(const Frustum &f, const glm::vec3 &bmin, const glm::vec3 &bmax) {
+        const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+        glm::vec3 c = 0.5f * (bmin + bmax);
+        glm::vec3 e = 0.5f * (bmax - bmin);
+        __m128 cx = _mm_set1_ps(c.x), cy = _mm_set1_ps(c.y), cz = _mm_set1_ps(c.z);
+        __m128 ex = _mm_set1_ps(e.x), ey = _mm_set1_ps(e.y), ez = _mm_set1_ps(e.z);
+
+        int outside = 0, inside = 0;
+        for (unsigned int half=0; half<8; half+=4) {
+            __m128 nx = _mm_load_ps(f.nx + half);
+            __m128 ny = _mm_load_ps(f.ny + half);
+            __m128 nz = _mm_load_ps(f.nz + half);
+
+            // Distance of the centre and the projected radius of the box
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+                                     _mm_add_ps(_mm_mul_ps(nz, cz), _mm_load_ps(f.d + half)));
+            __m128 rad = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign_mask, nx), ex),
+                                               _mm_mul_ps(_mm_andnot_ps(sign_mask, ny), ey)),
+                                    _mm_mul_ps(_mm_andnot_ps(sign_mask, nz), ez));
+
+            outside |= _mm_movemask_ps(_mm_cmplt_ps(dist, _mm_xor_ps(rad, sign_mask)));
+            inside  |= _mm_movemask_ps(_mm_cmplt_ps(dist, rad));
+        }
+
+        if (outside) return OUTSIDE;
+        if (inside)  return INTERSECTING;
+        return INSIDE;
+    }
+
+    /*
+     Will keep only the chunks whose box (bmin, bmax) touches the frustum.
+
+     Inputs:
+        * f <const Frustum &> => The frustum to test against.
+        * chunks <const Chunk *> => Anything with a bmin and bmax.
+        * num_chunks <size_t> => How many there are.
+        * visible <std::vector<unsigned int> &> => Filled with the indices of those that pass.
+    */
+    template <typename Chunk>
+    void cullChunks(const Frustum &f, const Chunk *chunks, size_t num_chunks, std::vector<unsigned int> &visible) {
+        visible.clear();
+        for (size_t c=0; c<num_chunks; c++) {
+            if (testBox(f, chunks[c].bmin, chunks[c].bmax) != OUTSIDE)
+                visible.push_back(c);
+        }
+    }
+
+    /*
+     Will walk the visible chunks as runs of neighbours that can be drawn
+     together, so each run is one draw.
+
+     Inputs:
+        * chunks <const Chunk *> => What the visible indices refer to.
+        * visible <const std::vector<unsigned int> &> => The chunks that passed the cull, in order.
+        * sameRun <SameRun> => sameRun(first, next) says whether the chunk next
+                                can join the run that starts at first.
+        * fn <Fn> => Called as fn(begin, end) with the chunk indices of each run.
+    */
+    template <typename Chunk, typename SameRun, typename Fn>
+    void forEachChunkRun(const Chunk *chunks, const std::vector<unsigned int> &visible, SameRun sameRun, Fn fn) {
+        for (size_t v=0; v<visible.size(); ) {
+            size_t next = v + 1;
+            while (next < visible.size() && visible[next] == visible[next - 1] + 1 &&
+                   sameRun(chunks[visible[v]], chunks[visible[next]]))
+                next++;
+            fn(visible[v], visible[next - 1] + 1);
+            v = next;
+        }
+    }
+
+    /*
+     Numbers from the last cull.
+    */
+    struct Stats {
+        unsigned int num_instances = 0;
+        unsigned int num_visible = 0;
+        unsigned int nodes_visited = 0;
+        unsigned int spheres_tested = 0;
+        double seconds = 0.0;
+    };
+
+    /*
+     A bounding volume hierarchy over instance bounding spheres.
+
+     The spheres are kept in BVH order (each node covers a contiguous range of
+     them) so leaves can be tested with aligned SIMD loads and fully visible
+     subtrees can be appended as a single range.
+    */
+    class BVH {
+        private:
+            struct Node {
+                glm::vec3 bmin, bmax;
+                unsigned int first;   // First sphere (in BVH order) this node covers
+                unsigned int count;   // How many spheres this node covers
+                unsigned int left;    // Index of the left child (right is left + 1), 0 for a leaf
+            };
+
+            /*
+             Will make `node` a leaf or split it along its longest axis at the median.
+            */
+            void subdivide(unsigned int node_index, std::vector<glm::vec4> &spheres) {
+                Node &node = nodes[node_index];
+                computeBounds(node);
+                if (node.count <= leaf_size) return;
+
+                glm::vec3 extent = node.bmax - node.bmin;
+                unsigned int axis = 0;
+                if (extent.y > extent.x) axis = 1;
+                if (extent.z > extent[axis]) axis = 2;
+
+                // Partition the instance order (and their spheres) about the median centre
+                unsigned int first = node.first, count = node.count;
+                unsigned int mid = first + count / 2;
+                std::vector<unsigned int> idx(count);
+                for (unsigned int i=0; i<count; i++) idx[i] = i;
+                std::nth_element(idx.begin(), idx.begin() + count / 2, idx.end(),
+                                 [&](unsigned int a, unsigned int b) {
+                                     return spheres[first + a][axis] < spheres[first + b][axis];
+                                 });
+                std::vector<glm::vec4> tmp_spheres(count);
+                std::vector<unsigned int> tmp_order(count);
+                for (unsigned int i=0; i<count; i++) {
+                    tmp_spheres[i] = spheres[first + idx[i]];
+                    tmp_order[i] = order[first + idx[i]];
+                }
+                std::copy(tmp_spheres.begin(), tmp_spheres.end(), spheres.begin() + first);
+                std::copy(tmp_order.begin(), tmp_order.end(), order.begin() + first);
+                for (unsigned int i=0; i<count; i++) {
+                    const glm::vec4 &s = spheres[first + i];
+                    cx[first + i] = s.x; cy[first + i] = s.y; cz[first + i] = s.z; radius[first + i] = s.w;
+                }
+
+                unsigned int left = nodes.size();
+                nodes.push_back({glm::vec3(0.0f), glm::vec3(0.0f), first, mid - first, 0});
+                nodes.push_back({glm::vec3(0.0f), glm::vec3(0.0f), mid, first + count - mid, 0});
+                nodes[node_index].left = left;
+
+                subdivide(left, spheres);
+                subdivide(left + 1, spheres);
+            }
+
+            /*
+             Will set a node's box from the spheres it covers.
+            */
+            void computeBounds(Node &node) {
+                node.bmin = glm::vec3(1e30f);
+                node.bmax = glm::vec3(-1e30f);
+                for (unsigned int i=node.first; i<node.first + node.count; i++) {
+                    glm::vec3 c(cx[i], cy[i], cz[i]);
+                    node.bmin = glm::min(node.bmin, c - radius[i]);
+                    node.bmax = glm::max(node.bmax, c + radius[i]);
+                }
+            }
+
+            /*
+             Tests the spheres in [first, first + count) against the planes,
+             4 at a time, and appends the visible ones.
+            */
+            void testSpheres(const Frustum &f, unsigned int first, unsigned int count,
+                             std::vector<unsigned int> &visible, Stats &s) const {
+                const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+                unsigned int end = first + count;
+                s.spheres_tested += count;
+
+                for (unsigned int i=first; i<end; i+=4) {
+                    // The arrays are padded so reading past the end of a leaf is safe
+                    __m128 x = _mm_loadu_ps(&cx[i]);
+                    __m128 y = _mm_loadu_ps(&cy[i]);
+                    __m128 z = _mm_loadu_ps(&cz[i]);
+                    __m128 neg_r = _mm_xor_ps(_mm_loadu_ps(&radius[i]), sign_mask);
+
+                    __m128 in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+                    for (unsigned int p=0; p<6; p++) {
+                        __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(f.nx[p]), x),
+                                                            _mm_mul_ps(_mm_set1_ps(f.ny[p]), y)),
+                                                 _mm_add_ps(_mm_mul_ps(_mm_set1_ps(f.nz[p]), z),
+                                                            _mm_set1_ps(f.d[p])));
+                        in = _mm_and_ps(in, _mm_cmpge_ps(dist, neg_r));
+                    }
+
+                    int mask = _mm_movemask_ps(in);
+                    for (unsigned int k=0; k<4 && i + k<end; k++) {
+                        if (mask & (1 << k)) visible.push_back(order[i + k]);
+                    }
+                }
+            }
+
+            /*
+             Will walk the subtree under root, appending its visible instances
+             in the same order as a walk of the whole tree would.
+            */
+            void cullSubtree(const Frustum &f, unsigned int root, std::vector<unsigned int> &visible,
+                             Stats &s) const {
+                unsigned int stack[64];
+                unsigned int stack_size = 0;
+                stack[stack_size++] = root;
+
+                while (stack_size > 0) {
+                    const Node &node = nodes[stack[--stack_size]];
+                    s.nodes_visited++;
+
+                    Overlap overlap = testBox(f, node.bmin, node.bmax);
+                    if (overlap == OUTSIDE) continue;
+
+                    if (overlap == INSIDE) {
+                        visible.insert(visible.end(), order.begin() + node.first,
+                                       order.begin() + node.first + node.count);
+                    } else if (node.left == 0) {
+                        testSpheres(f, node.first, node.count, visible, s);
+                    } else {
+                        stack[stack_size++] = node.left + 1;
+                        stack[stack_size++] = node.left;
+                    }
+                }
+            }
+
+            // Per job results for the parallel cull
+            std::vector<unsigned int> job_roots;
+            std::vector<std::vector<unsigned int>> job_visible;
+            std::vector<Stats> job_stats;
+
+        public:
+            std::vector<Node> nodes;
+            std::vector<unsigned int> order;     // Instance index of each sphere in BVH order
+            std::vector<unsigned int> slot;      // Where each instance's sphere is in BVH order
+            std::vector<float> cx, cy, cz, radius;
+            unsigned int leaf_size = 8;
+            Stats stats;
+
+            /*
+             Will build the tree over the instances' bounding spheres.
+
+             Inputs:
+                * centres <const std::vector<glm::vec3> &> => The centre of each instance.
+                * radii <const std::vector<float> &> => The bounding radius of each instance.
+            */
+            void build(const std::vector<glm::vec3> &centres, const std::vector<float> &radii) {
+                TRACE_SCOPE("culling::BVH::build");
+                unsigned int n = centres.size();
+                std::vector<glm::vec4> spheres(n);
+                order.resize(n);
+                // Pad by 4 so the SIMD leaf test can always load 4 lanes
+                cx.assign(n + 4, 0.0f); cy.assign(n + 4, 0.0f); cz.assign(n + 4, 0.0f);
+                radius.assign(n + 4, -1.0f);
+                for (unsigned int i=0; i<n; i++) {
+                    spheres[i] = glm::vec4(centres[i], radii[i]);
+                    order[i] = i;
+                    cx[i] = centres[i].x; cy[i] = centres[i].y; cz[i] = centres[i].z; radius[i] = radii[i];
+                }
+
+                nodes.clear();
+                nodes.reserve(n > 0 ? 2 * n / leaf_size + 2 : 1);
+                nodes.push_back({glm::vec3(0.0f), glm::vec3(0.0f), 0, n, 0});
+                subdivide(0, spheres);
+
+                slot.resize(n);
+                for (unsigned int i=0; i<n; i++)
+                    slot[order[i]] = i;
+                stats.num_instances = n;
+            }
+
+            /*
+             Will move an instance's bounding sphere. Call refit() once all the
+             moving instances have been updated.
+            */
+            void inline update(unsigned int instance, const glm::vec3 &centre, float r) {
+                unsigned int s = slot[instance];
+                cx[s] = centre.x; cy[s] = centre.y; cz[s] = centre.z; radius[s] = r;
+            }
+
+            /*
+             Will recompute the node boxes bottom up without changing the tree
+             structure. Children are always stored after their parents so a single
+             backwards pass is enough.
+            */
+            void refit() {
+                for (int i=(int)nodes.size()-1; i>=0; i--) {
+                    Node &node = nodes[i];
+                    if (node.left == 0) {
+                        computeBounds(node);
+                    } else {
+                        node.bmin = glm::min(nodes[node.left].bmin, nodes[node.left + 1].bmin);
+                        node.bmax = glm::max(nodes[node.left].bmax, nodes[node.left + 1].bmax);
+                    }
+                }
+            }
+
+            /*
+             Will fill `visible` with the indices of every instance whose bounding
+             sphere touches the frustum.
+
+             With a pool the tree is cut into subtrees a few levels down, one
+             job each, and their results joined in tree order, so the visible
+             list comes out the same as culling on one thread.
+
+             Inputs:
+                * f <const Frustum &> => The frustum to test against.
+                * visible <std::vector<unsigned int> &> => Cleared and filled with instance indices.
+                * pool <threads::Pool *> => If given (and the tree is big enough) the subtrees are spread over it.
+            */
+            void cull(const Frustum &f, std::vector<unsigned int> &visible, threads::Pool *pool=NULL) {
+                TRACE_SCOPE("culling::BVH::cull");
+                timing::Stopwatch timer;
+                visible.clear();
+                stats.nodes_visited = 0;
+                stats.spheres_tested = 0;
+
+                // Below this many instances a thread or two is plenty
+                const unsigned int min_parallel = 16384;
+                if (!nodes.empty() && nodes[0].count > 0) {
+                    if (pool == NULL || pool->numThreads() == 1 || nodes[0].count < min_parallel) {
+                        cullSubtree(f, 0, visible, stats);
+                    } else {
+                        // Split the widest subtree until there are a few per thread (left to right order kept)
+                        job_roots.assign(1, 0);
+                        while (job_roots.size() < 4 * pool->numThreads()) {
+                            size_t widest = 0;
+                            for (size_t r=1; r<job_roots.size(); r++)
+                                if (nodes[job_roots[r]].count > nodes[job_roots[widest]].count) widest = r;
+                            const Node &node = nodes[job_roots[widest]];
+                            if (node.left == 0) break;
+                            job_roots[widest] = node.left + 1;
+                            job_roots.insert(job_roots.begin() + widest, node.left);
+                        }
+
+                        job_visible.resize(job_roots.size());
+                        job_stats.assign(job_roots.size(), Stats());
+                        pool->parallelFor(job_roots.size(), 1, [&](size_t begin, size_t end) {
+                            for (size_t r=begin; r<end; r++) {
+                                job_visible[r].clear();
+                                cullSubtree(f, job_roots[r], job_visible[r], job_stats[r]);
+                            }
+                        });
+                        for (size_t r=0; r<job_roots.size(); r++) {
+                            visible.insert(visible.end(), job_visible[r].begin(), job_visible[r].end());
+                            stats.nodes_visited += job_stats[r].nodes_visited;
+                            stats.spheres_tested += job_stats[r].spheres_tested;
+                        }
+                    }
+                }
+
+                stats.num_visible = visible.size();
+                stats.seconds = timer.seconds();
+            }
+    };
+
+    /*
+     Will average the per frame culling stats so they can be printed on exit.
+    */
+    class StatsAccumulator {
+        public:
+            unsigned long num_frames = 0;
+            double total_visible = 0.0;
+            double total_nodes = 0.0;
+            double total_spheres = 0.0;
+            double total_seconds = 0.0;
+            unsigned int num_instances = 0;
+
+            void add(const Stats &s) {
+                num_frames++;
+                num_instances = s.num_instances;
+                total_visible += s.num_visible;
+                total_nodes += s.nodes_visited;
+                total_spheres += s.spheres_tested;
+                total_seconds += s.seconds;
+            }
+
+            void print() const {
+                if (num_frames == 0) return;
+                std::cout << "cull: avg " << total_visible / num_frames << " / " << num_instances;
+                std::cout << " visible, " << total_nodes / num_frames << " nodes and ";
+                std::cout << total_spheres / num_frames << " spheres tested, ";
+                std::cout << 1000.0 * total_seconds / num_frames << " ms" << std::endl;
+            }
+    };
+
+    /*
+     Will let a field of spheres drift for a few frames and each frame both
+     refit the tree and rebuild it from scratch, timing the two and checking
+     that the refit tree culls exactly the same spheres as the rebuilt one.
+
+     Inputs:
+        * count <size_t> => How many spheres.
+    */
+    void benchmark(size_t count) {
+        const unsigned int frames = 10;
+        rng::Xoshiro128 r(1);
+        std::vector<glm::vec3> centres(count);
+        std::vector<float> radii(count, 0.5f * sqrtf(3.0f));
+        for (glm::vec3 &c : centres) {
+            c.x = r.uniform(-25.0f, 25.0f);
+            c.y = r.uniform(-25.0f, 25.0f);
+            c.z = r.uniform(-25.0f, 25.0f);
+        }
+
+        // Looking into the field from one side, so some of it is culled
+        glm::mat4 proj = glm::perspective(glm::radians(40.0f), 1.0f, 0.01f, 200.0f);
+        glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 0.0f, 40.0f), glm::vec3(10.0f, 0.0f, 0.0f),
+                                     glm::vec3(0.0f, 1.0f, 0.0f));
+        Frustum f = extractFrustum(proj * view);
+
+        BVH refitted, rebuilt;
+        refitted.build(centres, radii);
+        std::vector<unsigned int> a, b;
+        double refit_seconds = 0.0, rebuild_seconds = 0.0;
+        double refit_nodes = 0.0, rebuild_nodes = 0.0;
+        bool same = true;
+
+        std::cout << "BVH over " << count << " drifting spheres, " << frames << " frames" << std::endl;
+        for (unsigned int frame=0; frame<frames; frame++) {
+            for (glm::vec3 &c : centres) {
+                c.x += r.uniform(-0.5f, 0.5f);
+                c.y += r.uniform(-0.5f, 0.5f);
+                c.z += r.uniform(-0.5f, 0.5f);
+            }
+
+            timing::Stopwatch timer;
+            for (size_t i=0; i<count; i++)
+                refitted.update(i, centres[i], radii[i]);
+            refitted.refit();
+            refit_seconds += timer.seconds();
+
+            timer.reset();
+            rebuilt.build(centres, radii);
+            rebuild_seconds += timer.seconds();
+
+            refitted.cull(f, a);
+            rebuilt.cull(f, b);
+            refit_nodes += refitted.stats.nodes_visited;
+            rebuild_nodes += rebuilt.stats.nodes_visited;
+            // The two trees list the visible spheres in their own orders
+            std::sort(a.begin(), a.end());
+            std::sort(b.begin(), b.end());
+            same = same && a == b;
+        }
+
+        std::cout << "  rebuild  " << 1000.0 * rebuild_seconds / frames << " ms a frame, ";
+        std::cout << rebuild_nodes / frames << " nodes visited a cull" << std::endl;
+        std::cout << "  refit    " << 1000.0 * refit_seconds / frames << " ms a frame, ";
+        std::cout << refit_nodes / frames << " nodes visited a cull, ";
+        std::cout << (same ? "same" : "DIFFERENT") << " visible set as the rebuild" << std::endl;
+        if (!same) {
+            std::cerr << "The refit BVH culled a different set of spheres to the rebuilt one" << std::endl;
+            throw "CullingError";
+        }
+    }
+}
+
+#endif
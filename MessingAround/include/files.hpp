@@ -6,6 +6,8 @@
 #include <string>
 #include <sstream>
 
+#include <trace.hpp>
+
 
 namespace IO {
     /*
@@ -97,6 +99,7 @@ namespace IO {
              This shouldn't be overriden.
             */
             void read(std::string fp) {
+                TRACE_SCOPE("IO::File::read");
                 file_path = fp;
                 std::ifstream fin(file_path);
 
@@ -200,6 +203,13 @@ namespace IO {
                     iline++;
                 }
 
+                // Blank lines were counted above but never read
+                if (iline < num_vertices) {
+                    size = size / num_vertices * iline;
+                    num_vertices = iline;
+                    length = num_arr_elem * num_vertices;
+                }
+
                 // Remember to close the file
                 fin.close();
             }
@@ -0,0 +1,109 @@
+#ifndef FRAMESTATE_HEADER_GUARD
+#define FRAMESTATE_HEADER_GUARD
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <vector>
+
+
+namespace framestate {
+
+    /*
+     The state the simulation steps forward, everything else in a snapshot
+     is worked out from it.
+    */
+    struct SimState {
+        glm::vec3 camera = glm::vec3(0.0f, 0.0f, -3.0f);
+        float yaw = 0.0f;     // Which way the camera is turned (radians, left is positive)
+        float pitch = 0.0f;   // Up is positive
+        double time = 0.0;
+    };
+
+    /*
+     Will blend two simulation states, alpha 0 gives a and 1 gives b. Used
+     to draw frames that fall between two fixed simulation steps.
+    */
+    SimState interpolate(const SimState &a, const SimState &b, double alpha) {
+        SimState s;
+        s.camera = glm::mix(a.camera, b.camera, (float) alpha);
+        s.yaw = glm::mix(a.yaw, b.yaw, (float) alpha);
+        s.pitch = glm::mix(a.pitch, b.pitch, (float) alpha);
+        s.time = a.time + (b.time - a.time) * alpha;
+        return s;
+    }
+
+    /*
+     Everything the renderer needs from the simulation to draw one frame.
+
+     Once published a snapshot is never written to again until the renderer
+     has moved on to a newer one, so it can be read without any locking.
+    */
+    struct Snapshot {
+        unsigned long step = 0;          // Which simulation step produced it
+        float time = 0.0f;               // The simulation time the cubes are animated to
+        glm::mat4 view = glm::mat4(1.0f);
+        std::vector<glm::mat4> models;   // Only filled when the CPU animates the cubes
+    };
+
+    /*
+     A lock-free single producer, single consumer triple buffer.
+
+     The writer fills writeBuffer() and calls publish(), the reader calls
+     update() and then reads readBuffer(). The two sides never touch the same
+     slot, neither ever waits for the other and the reader always gets the
+     newest published value (older ones are just dropped).
+
+     The third slot is the hand over point: its index is swapped atomically
+     along with a "fresh" bit that says the writer has put something new there.
+    */
+    template <typename T>
+    class TripleBuffer {
+        private:
+            static const unsigned int INDEX_MASK = 3;
+            static const unsigned int FRESH = 4;
+
+            T slots[3];
+            std::atomic<unsigned int> middle;
+            unsigned int back = 0;   // Owned by the writer
+            unsigned int front = 2;  // Owned by the reader
+
+        public:
+            TripleBuffer() : middle(1) { }
+
+            /*
+             Direct access to a slot, only for setting things up before the
+             threads start (e.g. reserving memory in every slot).
+            */
+            T &slot(unsigned int i) { return slots[i]; }
+
+            /*
+             The slot the writer should fill next.
+            */
+            T &writeBuffer() { return slots[back]; }
+
+            /*
+             Hand the filled slot over to the reader.
+            */
+            void publish() {
+                back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+            }
+
+            /*
+             Will grab the newest published slot if there is one. Returns false
+             (and keeps the current slot) if nothing new has been published.
+            */
+            bool update() {
+                if (!(middle.load(std::memory_order_acquire) & FRESH)) return false;
+                front = middle.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+                return true;
+            }
+
+            /*
+             The slot the reader currently owns.
+            */
+            const T &readBuffer() const { return slots[front]; }
+    };
+}
+
+#endif
@@ -0,0 +1,384 @@
+#ifndef GEOMETRYPOOL_HEADER_GUARD
+#define GEOMETRYPOOL_HEADER_GUARD
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <mesh.hpp>
+#include <trace.hpp>
+
+
+/*
+ Many meshes sharing one big vertex buffer, one big index buffer and one VAO.
+
+ Instead of a VAO/VBO/EBO per mesh, every mesh of a vertex format is given a
+ range of the pool's buffers by an offset allocator, and is drawn by where
+ it lives (base vertex, first index, count) with glDrawElementsBaseVertex.
+ Indices stay relative to the mesh's first vertex, so switching between
+ meshes never rebinds anything and ranges can be moved around freely.
+
+ Meshes can be removed again, which leaves holes. When a new mesh doesn't
+ fit in any hole the live ranges are packed to the front of fresh buffers
+ on the GPU (glCopyBufferSubData) if that makes enough room, or into
+ buffers twice the size if it doesn't. Meshes are referred to by handles
+ that stay the same when their range moves.
+*/
+namespace geometrypool {
+
+    /*
+     Hands out ranges of [0, capacity) and takes them back, best fit from
+     the free blocks, merging a freed block with the free blocks either side.
+    */
+    class Allocator {
+        private:
+            std::map<unsigned int, unsigned int> free_by_offset;        // Offset => size
+            std::multimap<unsigned int, unsigned int> free_by_size;     // Size => offset
+
+            void addFree(unsigned int offset, unsigned int size) {
+                free_by_offset[offset] = size;
+                free_by_size.insert(std::make_pair(size, offset));
+            }
+
+            void removeFree(std::map<unsigned int, unsigned int>::iterator it) {
+                std::multimap<unsigned int, unsigned int>::iterator s = free_by_size.lower_bound(it->second);
+                while (s->second != it->first) s++;
+                free_by_size.erase(s);
+                free_by_offset.erase(it);
+            }
+
+        public:
+            unsigned int capacity = 0;
+            unsigned int used = 0;
+
+            /*
+             Will forget every allocation, leaving one free block of the given size.
+            */
+            void reset(unsigned int new_capacity) {
+                free_by_offset.clear();
+                free_by_size.clear();
+                capacity = new_capacity;
+                used = 0;
+                if (capacity > 0) addFree(0, capacity);
+            }
+
+            /*
+             Will take a range from the smallest free block it fits in.
+
+             Inputs:
+                * size <unsigned int> => How many elements are needed.
+                * offset <unsigned int &> => Set to where the range starts.
+             Returns whether there was a block big enough.
+            */
+            bool allocate(unsigned int size, unsigned int &offset) {
+                offset = 0;
+                if (size == 0) return true;
+                std::multimap<unsigned int, unsigned int>::iterator s = free_by_size.lower_bound(size);
+                if (s == free_by_size.end()) return false;
+
+                unsigned int block_offset = s->second, block_size = s->first;
+                removeFree(free_by_offset.find(block_offset));
+                if (block_size > size) addFree(block_offset + size, block_size - size);
+                offset = block_offset;
+                used += size;
+                return true;
+            }
+
+            /*
+             Will give a range back.
+            */
+            void free(unsigned int offset, unsigned int size) {
+                if (size == 0) return;
+                used -= size;
+
+                // Merge with the free block after it and then the one before it
+                std::map<unsigned int, unsigned int>::iterator next = free_by_offset.lower_bound(offset);
+                if (next != free_by_offset.end() && next->first == offset + size) {
+                    size += next->second;
+                    removeFree(next);
+                }
+                std::map<unsigned int, unsigned int>::iterator prev = free_by_offset.lower_bound(offset);
+                if (prev != free_by_offset.begin()) {
+                    prev--;
+                    if (prev->first + prev->second == offset) {
+                        offset = prev->first;
+                        size += prev->second;
+                        removeFree(prev);
+                    }
+                }
+                addFree(offset, size);
+            }
+
+            unsigned int largestFree() const {
+                return free_by_size.empty() ? 0 : free_by_size.rbegin()->first;
+            }
+
+            unsigned int numFreeBlocks() const {
+                return free_by_offset.size();
+            }
+    };
+
+    /*
+     Where a mesh lives in the pool's buffers.
+    */
+    struct MeshRange {
+        unsigned int num_indices = 0;
+        unsigned int first_index = 0;
+        int base_vertex = 0;
+        unsigned int num_vertices = 0;
+        bool live = false;
+    };
+
+    /*
+     Running totals, printed on exit.
+    */
+    struct Stats {
+        unsigned long num_adds = 0;
+        unsigned long num_removes = 0;
+        unsigned long num_defragments = 0;
+        unsigned long num_grows = 0;
+        unsigned long bytes_moved = 0;  // Copied on the GPU by defragments and grows
+    };
+
+    /*
+     The buffers for one vertex format: `stride` floats per vertex, the first
+     3 the position (location 0) and the next 2 the texture coordinates
+     (location 1), as with mesh::GLMesh.
+    */
+    class Pool {
+        private:
+            std::vector<unsigned int> free_handles;
+
+            /*
+             Will point the VAO at the current buffers.
+            */
+            void bindAttributes() {
+                glBindVertexArray(VAO_handle);
+                glBindBuffer(GL_ARRAY_BUFFER, VBO_handle);
+                glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride * sizeof(float), (void*)0);
+                glEnableVertexAttribArray(0);
+                glVertexAttribPointer(1, 2, GL_FLOAT, GL_TRUE, stride * sizeof(float), (void*)(3 * sizeof(float)));
+                glEnableVertexAttribArray(1);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO_handle);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                glBindVertexArray(0);
+            }
+
+            /*
+             Will allocate both ranges for a mesh, or neither.
+            */
+            bool tryAllocate(MeshRange &r) {
+                unsigned int vertex_offset, index_offset;
+                if (!vertex_space.allocate(r.num_vertices, vertex_offset)) return false;
+                if (!index_space.allocate(r.num_indices, index_offset)) {
+                    vertex_space.free(vertex_offset, r.num_vertices);
+                    return false;
+                }
+                r.base_vertex = vertex_offset;
+                r.first_index = index_offset;
+                return true;
+            }
+
+            /*
+             Will pack every live mesh, in its current order, to the front of new
+             buffers of the given sizes, copying on the GPU.
+            */
+            void relocate(unsigned int vertex_capacity, unsigned int index_capacity) {
+                TRACE_SCOPE("geometrypool::Pool::relocate");
+                unsigned int vertex_bytes = stride * sizeof(float);
+                unsigned int new_VBO, new_EBO;
+                glGenBuffers(1, &new_VBO);
+                glGenBuffers(1, &new_EBO);
+
+                std::vector<unsigned int> order;
+                for (unsigned int h=0; h<ranges.size(); h++)
+                    if (ranges[h].live) order.push_back(h);
+
+                // Through the copy targets so the element buffer of whatever VAO is bound isn't touched
+                vertex_space.reset(vertex_capacity);
+                glBindBuffer(GL_COPY_READ_BUFFER, VBO_handle);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, new_VBO);
+                glBufferData(GL_COPY_WRITE_BUFFER, (size_t) vertex_capacity * vertex_bytes, NULL, GL_STATIC_DRAW);
+                std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+                    return ranges[a].base_vertex < ranges[b].base_vertex;
+                });
+                for (size_t k=0; k<order.size(); k++) {
+                    MeshRange &r = ranges[order[k]];
+                    unsigned int offset;
+                    vertex_space.allocate(r.num_vertices, offset);
+                    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (size_t) r.base_vertex * vertex_bytes,
+                                        (size_t) offset * vertex_bytes, (size_t) r.num_vertices * vertex_bytes);
+                    stats.bytes_moved += r.num_vertices * vertex_bytes;
+                    r.base_vertex = offset;
+                }
+
+                index_space.reset(index_capacity);
+                glBindBuffer(GL_COPY_READ_BUFFER, EBO_handle);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, new_EBO);
+                glBufferData(GL_COPY_WRITE_BUFFER, (size_t) index_capacity * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+                std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+                    return ranges[a].first_index < ranges[b].first_index;
+                });
+                for (size_t k=0; k<order.size(); k++) {
+                    MeshRange &r = ranges[order[k]];
+                    unsigned int offset;
+                    index_space.allocate(r.num_indices, offset);
+                    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (size_t) r.first_index * sizeof(unsigned int),
+                                        (size_t) offset * sizeof(unsigned int), (size_t) r.num_indices * sizeof(unsigned int));
+                    stats.bytes_moved += r.num_indices * sizeof(unsigned int);
+                    r.first_index = offset;
+                }
+                glBindBuffer(GL_COPY_READ_BUFFER, 0);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+                glDeleteBuffers(1, &VBO_handle);
+                glDeleteBuffers(1, &EBO_handle);
+                VBO_handle = new_VBO;
+                EBO_handle = new_EBO;
+                bindAttributes();
+            }
+
+        public:
+            unsigned int VAO_handle = 0;
+            unsigned int VBO_handle = 0;
+            unsigned int EBO_handle = 0;
+            unsigned int stride = 5;
+            Allocator vertex_space, index_space;
+            std::vector<MeshRange> ranges;      // By handle
+            Stats stats;
+
+            /*
+             Will create the VAO and the (empty) buffers.
+
+             Inputs:
+                * vertex_stride <unsigned int> => Floats per vertex.
+                * vertex_capacity <unsigned int> => How many vertices fit before the pool grows.
+                * index_capacity <unsigned int> => How many indices fit before the pool grows.
+            */
+            void create(unsigned int vertex_stride, unsigned int vertex_capacity, unsigned int index_capacity) {
+                stride = vertex_stride;
+                glGenVertexArrays(1, &VAO_handle);
+                glGenBuffers(1, &VBO_handle);
+                glGenBuffers(1, &EBO_handle);
+
+                glBindBuffer(GL_COPY_WRITE_BUFFER, VBO_handle);
+                glBufferData(GL_COPY_WRITE_BUFFER, (size_t) vertex_capacity * stride * sizeof(float), NULL, GL_STATIC_DRAW);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, EBO_handle);
+                glBufferData(GL_COPY_WRITE_BUFFER, (size_t) index_capacity * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+                vertex_space.reset(vertex_capacity);
+                index_space.reset(index_capacity);
+                bindAttributes();
+            }
+
+            /*
+             Will copy a mesh into the pool, making room for it if it has to.
+
+             Inputs:
+                * m <const mesh::Mesh &> => The mesh, it must have the pool's stride.
+             Returns the handle to draw (or remove) it with.
+            */
+            unsigned int add(const mesh::Mesh &m) {
+                if (m.stride != stride) {
+                    std::cerr << "A mesh with " << m.stride << " floats per vertex can't go in a pool of ";
+                    std::cerr << stride << std::endl;
+                    throw "GeometryPoolError";
+                }
+
+                MeshRange r;
+                r.num_vertices = m.numVertices();
+                r.num_indices = m.numIndices();
+                r.live = true;
+                if (!tryAllocate(r)) {
+                    unsigned int free_vertices = vertex_space.capacity - vertex_space.used;
+                    unsigned int free_indices = index_space.capacity - index_space.used;
+                    if (free_vertices >= r.num_vertices && free_indices >= r.num_indices) {
+                        // There is room, just not in one piece
+                        defragment();
+                    } else {
+                        relocate(std::max(2 * vertex_space.capacity, vertex_space.used + r.num_vertices),
+                                 std::max(2 * index_space.capacity, index_space.used + r.num_indices));
+                        stats.num_grows++;
+                    }
+                    tryAllocate(r);
+                }
+
+                glBindBuffer(GL_COPY_WRITE_BUFFER, VBO_handle);
+                glBufferSubData(GL_COPY_WRITE_BUFFER, (size_t) r.base_vertex * stride * sizeof(float),
+                                m.vertices.size() * sizeof(float), m.vertices.data());
+                glBindBuffer(GL_COPY_WRITE_BUFFER, EBO_handle);
+                glBufferSubData(GL_COPY_WRITE_BUFFER, (size_t) r.first_index * sizeof(unsigned int),
+                                m.indices.size() * sizeof(unsigned int), m.indices.data());
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+                unsigned int handle;
+                if (!free_handles.empty()) {
+                    handle = free_handles.back();
+                    free_handles.pop_back();
+                    ranges[handle] = r;
+                } else {
+                    handle = ranges.size();
+                    ranges.push_back(r);
+                }
+                stats.num_adds++;
+                return handle;
+            }
+
+            /*
+             Will give a mesh's ranges back to the pool, the handle can be reused.
+            */
+            void remove(unsigned int handle) {
+                MeshRange &r = ranges[handle];
+                if (!r.live) return;
+                vertex_space.free(r.base_vertex, r.num_vertices);
+                index_space.free(r.first_index, r.num_indices);
+                r.live = false;
+                free_handles.push_back(handle);
+                stats.num_removes++;
+            }
+
+            /*
+             Will close up the holes left by removed meshes.
+            */
+            void defragment() {
+                relocate(vertex_space.capacity, index_space.capacity);
+                stats.num_defragments++;
+            }
+
+            /*
+             Will draw a mesh, the pool's VAO must be bound.
+            */
+            void draw(unsigned int handle) const {
+                const MeshRange &r = ranges[handle];
+                glDrawElementsBaseVertex(GL_TRIANGLES, r.num_indices, GL_UNSIGNED_INT,
+                                         (void*)(r.first_index * sizeof(unsigned int)), r.base_vertex);
+            }
+
+            /*
+             Will print how full the pool is and what it has had to do.
+            */
+            void print() const {
+                unsigned int num_live = ranges.size() - free_handles.size();
+                std::cout << "geometry pool: " << num_live << " meshes, " << vertex_space.used << " / ";
+                std::cout << vertex_space.capacity << " vertices, " << index_space.used << " / ";
+                std::cout << index_space.capacity << " indices, " << vertex_space.numFreeBlocks() + index_space.numFreeBlocks();
+                std::cout << " free blocks (largest " << vertex_space.largestFree() << " vertices, ";
+                std::cout << index_space.largestFree() << " indices)" << std::endl;
+                std::cout << "  " << stats.num_adds << " adds, " << stats.num_removes << " removes, ";
+                std::cout << stats.num_defragments << " defragments, " << stats.num_grows << " grows, ";
+                std::cout << stats.bytes_moved / 1024.0 << " KiB moved on the GPU" << std::endl;
+            }
+
+            void destroy() {
+                glDeleteVertexArrays(1, &VAO_handle);
+                glDeleteBuffers(1, &VBO_handle);
+                glDeleteBuffers(1, &EBO_handle);
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef GL43_HEADER_GUARD
+#define GL43_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <iostream>
+#include <string>
+
+/*
+ The bundled glad loader was generated for a 3.3 core profile, this adds
+ the handful of OpenGL 4.x entry points and enums the optional 4.x code
+ paths need. They are loaded the same way glad loads everything else and
+ named the same way so the calling code reads like plain OpenGL.
+*/
+
+#ifndef GL_VERSION_4_3
+#define GL_DRAW_INDIRECT_BUFFER              0x8F3F
+#define GL_SHADER_STORAGE_BUFFER             0x90D2
+#define GL_COMPUTE_SHADER                    0x91B9
+#define GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT   0x00000001
+#define GL_COMMAND_BARRIER_BIT               0x00000040
+#define GL_BUFFER_UPDATE_BARRIER_BIT         0x00000200
+#define GL_SHADER_STORAGE_BARRIER_BIT        0x00002000
+#define GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT 0x90DF
+
+typedef void (APIENTRYP PFNGLDISPATCHCOMPUTEPROC)(GLuint num_groups_x, GLuint num_groups_y, GLuint num_groups_z);
+typedef void (APIENTRYP PFNGLMEMORYBARRIERPROC)(GLbitfield barriers);
+typedef void (APIENTRYP PFNGLMULTIDRAWARRAYSINDIRECTPROC)(GLenum mode, const void *indirect,
+                                                          GLsizei drawcount, GLsizei stride);
+typedef void (APIENTRYP PFNGLMULTIDRAWELEMENTSINDIRECTPROC)(GLenum mode, GLenum type, const void *indirect,
+                                                            GLsizei drawcount, GLsizei stride);
+
+PFNGLDISPATCHCOMPUTEPROC glad_glDispatchCompute = NULL;
+PFNGLMEMORYBARRIERPROC glad_glMemoryBarrier = NULL;
+PFNGLMULTIDRAWARRAYSINDIRECTPROC glad_glMultiDrawArraysIndirect = NULL;
+PFNGLMULTIDRAWELEMENTSINDIRECTPROC glad_glMultiDrawElementsIndirect = NULL;
+
+#define glDispatchCompute glad_glDispatchCompute
+#define glMemoryBarrier glad_glMemoryBarrier
+#define glMultiDrawArraysIndirect glad_glMultiDrawArraysIndirect
+#define glMultiDrawElementsIndirect glad_glMultiDrawElementsIndirect
+#endif
+
+#ifndef GL_VERSION_4_4
+#define GL_MAP_PERSISTENT_BIT                0x0040
+#define GL_MAP_COHERENT_BIT                  0x0080
+#define GL_DYNAMIC_STORAGE_BIT               0x0100
+
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+
+PFNGLBUFFERSTORAGEPROC glad_glBufferStorage = NULL;
+
+#define glBufferStorage glad_glBufferStorage
+#endif
+
+
+namespace gl43 {
+
+    /*
+     Whether the current context is at least a given version. Only valid
+     after gladLoadGLLoader has been called.
+    */
+    bool inline hasVersion(int major, int minor) {
+        return GLVersion.major > major || (GLVersion.major == major && GLVersion.minor >= minor);
+    }
+
+    /*
+     Whether the driver lists an extension. Only valid after gladLoadGLLoader.
+    */
+    bool hasExtension(const std::string &name) {
+        int num_extensions = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+        for (int i=0; i<num_extensions; i++) {
+            if (name == (const char*) glGetStringi(GL_EXTENSIONS, i)) return true;
+        }
+        return false;
+    }
+
+    /*
+     Will load glBufferStorage if the context is 4.4+ or has
+     GL_ARB_buffer_storage. Returns false if it isn't there (not an error,
+     callers should fall back to plain glBufferData).
+    */
+    bool loadBufferStorage(GLADloadproc load) {
+        if (!hasVersion(4, 4) && !hasExtension("GL_ARB_buffer_storage")) return false;
+        glad_glBufferStorage = (PFNGLBUFFERSTORAGEPROC) load("glBufferStorage");
+        return glad_glBufferStorage != NULL;
+    }
+
+    /*
+     Will load the 4.3 entry points, call this after gladLoadGLLoader.
+
+     Returns false (and prints why) if the context is older than 4.3 or the
+     driver doesn't give us every function.
+
+     Inputs:
+        * load <GLADloadproc> => The same proc address function given to glad.
+    */
+    bool load(GLADloadproc load) {
+        if (!hasVersion(4, 3)) {
+            std::cerr << "OpenGL 4.3 is needed but the context is " << GLVersion.major;
+            std::cerr << "." << GLVersion.minor << std::endl;
+            return false;
+        }
+
+        glad_glDispatchCompute = (PFNGLDISPATCHCOMPUTEPROC) load("glDispatchCompute");
+        glad_glMemoryBarrier = (PFNGLMEMORYBARRIERPROC) load("glMemoryBarrier");
+        glad_glMultiDrawArraysIndirect = (PFNGLMULTIDRAWARRAYSINDIRECTPROC) load("glMultiDrawArraysIndirect");
+        glad_glMultiDrawElementsIndirect = (PFNGLMULTIDRAWELEMENTSINDIRECTPROC) load("glMultiDrawElementsIndirect");
+
+        if (!glad_glDispatchCompute || !glad_glMemoryBarrier ||
+            !glad_glMultiDrawArraysIndirect || !glad_glMultiDrawElementsIndirect) {
+            std::cerr << "Failed to load the OpenGL 4.3 functions" << std::endl;
+            return false;
+        }
+        return true;
+    }
+}
+
+#endif
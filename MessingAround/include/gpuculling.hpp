@@ -0,0 +1,203 @@
+#ifndef GPUCULLING_HEADER_GUARD
+#define GPUCULLING_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gl43.hpp>
+#include <shaders.hpp>
+#include <culling.hpp>
+
+
+/*
+ Instance culling on the GPU (needs OpenGL 4.3).
+
+ A compute shader (src/cullInstances.comp) tests every instance's bounding
+ sphere against the frustum planes and appends the visible ones to a list
+ per mesh, bumping the instance count of that mesh's indirect draw command
+ with an atomic add. The draw is then a single glMultiDrawElementsIndirect
+ that reads the counts straight from the GPU, so the CPU never sees (or
+ waits for) the visibility results.
+*/
+namespace gpuculling {
+
+    /*
+     An instance as the shaders see it (std430 layout, 48 bytes).
+    */
+    struct Instance {
+        glm::vec4 position_radius;   // Centre of the bounding sphere and its radius
+        glm::vec4 axis_speed;        // Rotation axis and angular speed
+        unsigned int mesh;           // Which draw command (mesh) this instance belongs to
+        unsigned int pad[3];
+    };
+
+    /*
+     The layout glMultiDrawElementsIndirect reads. The compute shader only
+     relies on the instance count being the second field and the base
+     instance the last (true of the DrawArrays version too).
+    */
+    struct DrawElementsIndirectCommand {
+        unsigned int count;
+        unsigned int instance_count;
+        unsigned int first_index;
+        int base_vertex;
+        unsigned int base_instance;
+    };
+
+    /*
+     Where a mesh lives in the (shared) index and vertex buffers of the VAO.
+    */
+    struct MeshRange {
+        unsigned int num_indices;
+        unsigned int first_index;
+        int base_vertex;
+    };
+
+    class Culler {
+        private:
+            std::vector<DrawElementsIndirectCommand> reset_commands;
+
+        public:
+            unsigned int instance_buffer = 0;
+            unsigned int visible_buffer = 0;
+            unsigned int command_buffer = 0;
+            unsigned int VAO_handle = 0;
+            unsigned int num_instances = 0;
+            unsigned int visible_location = 2;
+
+            /*
+             Will upload the instances, make a draw command per mesh and hook the
+             visible list up to the VAO as a per instance attribute.
+
+             The visible index is read through an attribute (rather than
+             gl_InstanceID) because attribute divisors honour the base instance
+             of each command.
+
+             Inputs:
+                * VAO <unsigned int> => The vertex array holding all the meshes.
+                * instances <const std::vector<Instance> &> => Every instance.
+                * meshes <const std::vector<MeshRange> &> => Where each mesh is in the VAO.
+            */
+            void create(unsigned int VAO, const std::vector<Instance> &instances,
+                        const std::vector<MeshRange> &meshes) {
+                VAO_handle = VAO;
+                num_instances = instances.size();
+
+                // Give each mesh a slice of the visible list as big as its instance count
+                std::vector<unsigned int> per_mesh(meshes.size(), 0);
+                for (unsigned int i=0; i<num_instances; i++) {
+                    if (instances[i].mesh >= meshes.size()) {
+                        std::cerr << "Instance " << i << " uses mesh " << instances[i].mesh;
+                        std::cerr << " but there are only " << meshes.size() << std::endl;
+                        throw "GpuCullingError";
+                    }
+                    per_mesh[instances[i].mesh]++;
+                }
+                reset_commands.resize(meshes.size());
+                unsigned int base_instance = 0;
+                for (unsigned int m=0; m<meshes.size(); m++) {
+                    reset_commands[m].count = meshes[m].num_indices;
+                    reset_commands[m].instance_count = 0;
+                    reset_commands[m].first_index = meshes[m].first_index;
+                    reset_commands[m].base_vertex = meshes[m].base_vertex;
+                    reset_commands[m].base_instance = base_instance;
+                    base_instance += per_mesh[m];
+                }
+
+                glGenBuffers(1, &instance_buffer);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, instance_buffer);
+                glBufferData(GL_SHADER_STORAGE_BUFFER, num_instances * sizeof(Instance), instances.data(), GL_STATIC_DRAW);
+
+                glGenBuffers(1, &command_buffer);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_buffer);
+                glBufferData(GL_SHADER_STORAGE_BUFFER, reset_commands.size() * sizeof(DrawElementsIndirectCommand),
+                             reset_commands.data(), GL_DYNAMIC_DRAW);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+                glGenBuffers(1, &visible_buffer);
+                glBindVertexArray(VAO_handle);
+                glBindBuffer(GL_ARRAY_BUFFER, visible_buffer);
+                glBufferData(GL_ARRAY_BUFFER, (num_instances > 0 ? num_instances : 1) * sizeof(unsigned int),
+                             NULL, GL_DYNAMIC_COPY);
+                glEnableVertexAttribArray(visible_location);
+                glVertexAttribIPointer(visible_location, 1, GL_UNSIGNED_INT, sizeof(unsigned int), (void*)0);
+                glVertexAttribDivisor(visible_location, 1);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                glBindVertexArray(0);
+            }
+
+            /*
+             Will run the culling compute shader, it's all queued on the GPU so
+             this doesn't wait for anything.
+
+             Inputs:
+                * cull_program <const shader::Program &> => Built from src/cullInstances.comp.
+                * f <const culling::Frustum &> => The frustum to test against.
+            */
+            void cull(shader::Program &cull_program, const culling::Frustum &f) {
+                // Zero the instance counts
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_buffer);
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, reset_commands.size() * sizeof(DrawElementsIndirectCommand),
+                                reset_commands.data());
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+                cull_program.use();
+                for (unsigned int p=0; p<6; p++)
+                    cull_program.set("planes[" + std::to_string(p) + "]", glm::vec4(f.nx[p], f.ny[p], f.nz[p], f.d[p]));
+                cull_program.set("numInstances", (int) num_instances);
+                cull_program.set("commandStride", (int) (sizeof(DrawElementsIndirectCommand) / sizeof(unsigned int)));
+
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instance_buffer);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, visible_buffer);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, command_buffer);
+                glDispatchCompute((num_instances + 63) / 64, 1, 1);
+
+                // The draw reads the commands, the visible attribute and the instances
+                glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                                GL_SHADER_STORAGE_BARRIER_BIT);
+            }
+
+            /*
+             Will draw every mesh's visible instances in one call. The draw
+             program (src/culledShader.vert) must be in use.
+            */
+            void draw() {
+                glBindVertexArray(VAO_handle);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instance_buffer);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+                glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0,
+                                           reset_commands.size(), 0);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+            }
+
+            /*
+             Will read back how many instances were visible in the last cull.
+
+             This waits for the GPU so it is only meant for stats and debugging.
+            */
+            unsigned int readVisibleCount() {
+                std::vector<DrawElementsIndirectCommand> commands(reset_commands.size());
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_buffer);
+                glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, commands.size() * sizeof(DrawElementsIndirectCommand),
+                                   commands.data());
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+                unsigned int total = 0;
+                for (unsigned int m=0; m<commands.size(); m++)
+                    total += commands[m].instance_count;
+                return total;
+            }
+
+            void destroy() {
+                glDeleteBuffers(1, &instance_buffer);
+                glDeleteBuffers(1, &visible_buffer);
+                glDeleteBuffers(1, &command_buffer);
+            }
+    };
+}
+
+#endif
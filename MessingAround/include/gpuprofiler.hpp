@@ -0,0 +1,225 @@
+#ifndef GPUPROFILER_HEADER_GUARD
+#define GPUPROFILER_HEADER_GUARD
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <timing.hpp>
+
+
+/*
+ GPU (and CPU) timings for named scopes of a frame, e.g. the clear or the
+ cube pass.
+
+ Each scope drops a GL_TIMESTAMP query (glQueryCounter) when it starts and
+ when it ends. Timestamps rather than GL_TIME_ELAPSED because elapsed
+ queries can't be nested or overlap. The queries of a frame are only read
+ back NUM_FRAMES frames later, by which point the GPU is normally done with
+ them, and if it isn't the results are dropped instead of waiting, so the
+ profiler never stalls the pipeline.
+*/
+namespace gpuprofiler {
+
+    const unsigned int NUM_FRAMES = 4;     // Frames of queries in flight
+    const unsigned int WINDOW = 240;       // Samples the rolling stats are taken over
+
+    /*
+     Rolling timings of one scope, in milliseconds.
+    */
+    struct ScopeStats {
+        std::string name;
+        unsigned int depth = 0;             // How deeply nested it was when first seen
+        std::vector<double> gpu_ms;         // The last WINDOW samples (a ring)
+        std::vector<double> cpu_ms;
+        unsigned long num_samples = 0;
+
+        void add(double gpu, double cpu) {
+            if (gpu_ms.size() < WINDOW) {
+                gpu_ms.push_back(gpu);
+                cpu_ms.push_back(cpu);
+            } else {
+                gpu_ms[num_samples % WINDOW] = gpu;
+                cpu_ms[num_samples % WINDOW] = cpu;
+            }
+            num_samples++;
+        }
+    };
+
+    class Profiler {
+        private:
+            /*
+             One scope of one frame: which scope, its two queries and the CPU time.
+            */
+            struct Record {
+                unsigned int scope;
+                unsigned int begin_query;
+                unsigned int end_query;
+                double cpu_seconds;
+            };
+
+            /*
+             Everything recorded in one frame, reused every NUM_FRAMES frames.
+            */
+            struct FrameSlot {
+                std::vector<unsigned int> queries;  // Query objects, grown as needed
+                unsigned int num_used = 0;
+                std::vector<Record> records;
+                unsigned int last_query = 0;        // The query issued last, an outer scope's end comes after its inner ones
+            };
+
+            FrameSlot slots[NUM_FRAMES];
+            unsigned long frame = 0;
+            std::map<std::string, unsigned int> scope_ids;
+            std::vector<unsigned int> open;         // Stack of open records in the current frame
+            std::vector<timing::Stopwatch> open_timers;
+
+            unsigned int nextQuery(FrameSlot &slot) {
+                if (slot.num_used == slot.queries.size()) {
+                    unsigned int query;
+                    glGenQueries(1, &query);
+                    slot.queries.push_back(query);
+                }
+                return slot.queries[slot.num_used++];
+            }
+
+            /*
+             Will read a slot's queries back if the GPU has finished all of them.
+            */
+            void collect(FrameSlot &slot) {
+                if (slot.records.empty()) return;
+
+                // Queries complete in the order they were issued, so if the last one is there they all are
+                GLint available = 0;
+                glGetQueryObjectiv(slot.last_query, GL_QUERY_RESULT_AVAILABLE, &available);
+                if (!available) {
+                    num_dropped++;
+                } else {
+                    for (size_t i=0; i<slot.records.size(); i++) {
+                        const Record &r = slot.records[i];
+                        GLuint64 begin_ns = 0, end_ns = 0;
+                        glGetQueryObjectui64v(r.begin_query, GL_QUERY_RESULT, &begin_ns);
+                        glGetQueryObjectui64v(r.end_query, GL_QUERY_RESULT, &end_ns);
+                        scopes[r.scope].add((end_ns - begin_ns) * 1e-6, r.cpu_seconds * 1e3);
+                    }
+                }
+                slot.records.clear();
+                slot.num_used = 0;
+            }
+
+        public:
+            bool enabled = false;
+            std::vector<ScopeStats> scopes;
+            unsigned long num_dropped = 0;  // Frames whose results weren't ready in time
+
+            /*
+             Call at the start of every frame, before any scope.
+            */
+            void beginFrame() {
+                if (!enabled) return;
+                collect(slots[frame % NUM_FRAMES]);
+            }
+
+            /*
+             Call once every scope of the frame has ended.
+            */
+            void endFrame() {
+                if (!enabled) return;
+                if (!open.empty()) {
+                    std::cerr << "A GPU profiler scope was begun but never ended" << std::endl;
+                    throw "ProfilerError";
+                }
+                frame++;
+            }
+
+            /*
+             Will start timing a scope, scopes can be nested.
+
+             Inputs:
+                * name <const std::string &> => The scope's name, the same name is the same scope.
+            */
+            void begin(const std::string &name) {
+                if (!enabled) return;
+                std::map<std::string, unsigned int>::iterator it = scope_ids.find(name);
+                if (it == scope_ids.end()) {
+                    it = scope_ids.insert(std::make_pair(name, (unsigned int) scopes.size())).first;
+                    scopes.push_back(ScopeStats());
+                    scopes.back().name = name;
+                    scopes.back().depth = open.size();
+                }
+
+                FrameSlot &slot = slots[frame % NUM_FRAMES];
+                Record r;
+                r.scope = it->second;
+                r.begin_query = nextQuery(slot);
+                r.end_query = nextQuery(slot);
+                r.cpu_seconds = 0.0;
+                glQueryCounter(r.begin_query, GL_TIMESTAMP);
+
+                open.push_back(slot.records.size());
+                slot.records.push_back(r);
+                open_timers.push_back(timing::Stopwatch());
+            }
+
+            /*
+             Will stop timing the innermost open scope.
+            */
+            void end() {
+                if (!enabled) return;
+                FrameSlot &slot = slots[frame % NUM_FRAMES];
+                Record &r = slot.records[open.back()];
+                glQueryCounter(r.end_query, GL_TIMESTAMP);
+                slot.last_query = r.end_query;
+                r.cpu_seconds = open_timers.back().seconds();
+                open.pop_back();
+                open_timers.pop_back();
+            }
+
+            /*
+             Will print the rolling min/avg/max GPU time and the average CPU time of every scope.
+            */
+            void print() const {
+                if (!enabled || scopes.empty()) return;
+                std::cout << "gpu timers (last " << WINDOW << " frames, ms):" << std::endl;
+                std::cout << "  scope                  gpu min   gpu avg   gpu max   cpu avg" << std::endl;
+                for (size_t i=0; i<scopes.size(); i++) {
+                    const ScopeStats &s = scopes[i];
+                    if (s.gpu_ms.empty()) continue;
+                    double gpu_min = *std::min_element(s.gpu_ms.begin(), s.gpu_ms.end());
+                    double gpu_max = *std::max_element(s.gpu_ms.begin(), s.gpu_ms.end());
+                    double gpu_sum = 0.0, cpu_sum = 0.0;
+                    for (size_t j=0; j<s.gpu_ms.size(); j++) {
+                        gpu_sum += s.gpu_ms[j];
+                        cpu_sum += s.cpu_ms[j];
+                    }
+
+                    std::string label = std::string(2 * s.depth, ' ') + s.name;
+                    std::cout << "  " << std::left << std::setw(20) << label << std::right << std::fixed;
+                    std::cout << std::setprecision(3);
+                    std::cout << std::setw(10) << gpu_min << std::setw(10) << gpu_sum / s.gpu_ms.size();
+                    std::cout << std::setw(10) << gpu_max << std::setw(10) << cpu_sum / s.cpu_ms.size();
+                    std::cout << std::defaultfloat << std::endl;
+                }
+                if (num_dropped > 0)
+                    std::cout << "  (" << num_dropped << " frames dropped, the GPU was too far behind)" << std::endl;
+            }
+
+            void destroy() {
+                for (unsigned int i=0; i<NUM_FRAMES; i++) {
+                    if (!slots[i].queries.empty())
+                        glDeleteQueries(slots[i].queries.size(), slots[i].queries.data());
+                    slots[i].queries.clear();
+                    slots[i].records.clear();
+                    slots[i].num_used = 0;
+                }
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef HEADLESS_HEADER_GUARD
+#define HEADLESS_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <iostream>
+#include <string>
+
+
+/*
+ Rendering without a window, so the benchmarks can run on machines with no
+ display (build boxes, CI, ssh sessions).
+
+ The GL context comes from EGL. Mesa's surfaceless platform is tried first
+ (no X/Wayland needed at all, llvmpipe works fine), then the default display.
+ Nothing is drawn to a surface, everything goes into an off screen
+ framebuffer object, which capture::Capturer can read back like a window.
+*/
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA        0x31DD
+#endif
+
+namespace headless {
+
+    /*
+     Will give GL function pointers to glad (and gl43.hpp) from EGL.
+    */
+    void *getProcAddress(const char *name) {
+        return (void*) eglGetProcAddress(name);
+    }
+
+    /*
+     An EGL display and GL context that isn't attached to any window.
+    */
+    class Context {
+        private:
+            EGLDisplay display = EGL_NO_DISPLAY;
+            EGLContext context = EGL_NO_CONTEXT;
+            EGLSurface surface = EGL_NO_SURFACE;  // Only when surfaceless contexts aren't supported
+
+            bool hasExtension(const char *extensions, const std::string &name) const {
+                if (extensions == NULL) return false;
+                std::string list = std::string(" ") + extensions + " ";
+                return list.find(" " + name + " ") != std::string::npos;
+            }
+
+        public:
+            /*
+             Will create a core profile context of a given version and make it
+             current on the calling thread.
+
+             Inputs:
+                * major <int> => The OpenGL major version.
+                * minor <int> => The OpenGL minor version.
+            */
+            void create(int major, int minor) {
+                const char *client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+                if (hasExtension(client_extensions, "EGL_MESA_platform_surfaceless")) {
+                    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+                        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+                    if (getPlatformDisplay)
+                        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+                }
+                if (display == EGL_NO_DISPLAY)
+                    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+                EGLint egl_major, egl_minor;
+                if (display == EGL_NO_DISPLAY || !eglInitialize(display, &egl_major, &egl_minor)) {
+                    std::cerr << "Failed to initialise an EGL display" << std::endl;
+                    throw "HeadlessError";
+                }
+                if (!eglBindAPI(EGL_OPENGL_API)) {
+                    std::cerr << "EGL doesn't support desktop OpenGL" << std::endl;
+                    throw "HeadlessError";
+                }
+
+                const EGLint config_attribs[] = {
+                    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+                    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+                    EGL_NONE
+                };
+                EGLConfig config;
+                EGLint num_configs = 0;
+                if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs == 0) {
+                    std::cerr << "No EGL config supports OpenGL" << std::endl;
+                    throw "HeadlessError";
+                }
+
+                const EGLint context_attribs[] = {
+                    EGL_CONTEXT_MAJOR_VERSION, major,
+                    EGL_CONTEXT_MINOR_VERSION, minor,
+                    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                    EGL_NONE
+                };
+                context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+                if (context == EGL_NO_CONTEXT) {
+                    std::cerr << "Failed to create an OpenGL " << major << "." << minor;
+                    std::cerr << " core context with EGL" << std::endl;
+                    throw "HeadlessError";
+                }
+
+                // We never draw to the default framebuffer, but without
+                // EGL_KHR_surfaceless_context a context needs some surface
+                if (!hasExtension(eglQueryString(display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context")) {
+                    const EGLint pbuffer_attribs[] = {EGL_WIDTH, 16, EGL_HEIGHT, 16, EGL_NONE};
+                    surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+                }
+                if (!eglMakeCurrent(display, surface, surface, context)) {
+                    std::cerr << "Failed to make the EGL context current" << std::endl;
+                    throw "HeadlessError";
+                }
+            }
+
+            void destroy() {
+                if (display == EGL_NO_DISPLAY) return;
+                eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+                if (surface != EGL_NO_SURFACE) eglDestroySurface(display, surface);
+                if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+                eglTerminate(display);
+                display = EGL_NO_DISPLAY;
+                context = EGL_NO_CONTEXT;
+                surface = EGL_NO_SURFACE;
+            }
+    };
+
+    /*
+     An off screen framebuffer with an RGBA8 colour and a depth/stencil
+     attachment for everything to be drawn into.
+    */
+    class Framebuffer {
+        public:
+            unsigned int handle = 0;
+            unsigned int colour_handle = 0;
+            unsigned int depth_handle = 0;
+            unsigned int width = 0;
+            unsigned int height = 0;
+
+            /*
+             Will create the framebuffer and bind it, so all drawing goes into it.
+            */
+            void create(unsigned int w, unsigned int h) {
+                width = w;
+                height = h;
+
+                glGenFramebuffers(1, &handle);
+                glBindFramebuffer(GL_FRAMEBUFFER, handle);
+
+                glGenRenderbuffers(1, &colour_handle);
+                glBindRenderbuffer(GL_RENDERBUFFER, colour_handle);
+                glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colour_handle);
+
+                glGenRenderbuffers(1, &depth_handle);
+                glBindRenderbuffer(GL_RENDERBUFFER, depth_handle);
+                glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+                glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth_handle);
+                glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+                if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                    std::cerr << "The off screen framebuffer is incomplete" << std::endl;
+                    throw "HeadlessError";
+                }
+            }
+
+            void destroy() {
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                glDeleteRenderbuffers(1, &colour_handle);
+                glDeleteRenderbuffers(1, &depth_handle);
+                glDeleteFramebuffers(1, &handle);
+                handle = colour_handle = depth_handle = 0;
+            }
+    };
+}
+
+#endif
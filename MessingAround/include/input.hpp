@@ -2,10 +2,22 @@
 #define INPUT_HEADER_GUARD
 
 //#include <glad/glad.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <GLFW/glfw3.h>
 
 
+/*
+ Keyboard and mouse input, read straight from GLFW or as a stream of events.
+
+ The events are stamped with the simulation step they were applied before,
+ rather than a wall clock time, so a recorded log replays onto exactly the
+ same steps whatever the frame rate (see --record and --replay).
+*/
 namespace input {
 
     /*
@@ -18,6 +30,9 @@ namespace input {
         float yaw = 0.0f;
         float pitch = 0.0f;
         float roll = 0.0f;
+        float look_x = 0.0f;   // Mouse drag over the last step (pixels)
+        float look_y = 0.0f;
+        float dolly = 0.0f;    // Scroll over the last step
     };
 
     /*
@@ -80,6 +95,329 @@ namespace input {
         }
         return to_return;
     }
+
+    enum EventType {
+        KEY_DOWN = 0,
+        KEY_UP = 1,
+        MOUSE_MOVE = 2,   // x and y are how far the cursor moved
+        SCROLL = 3,       // x and y are the scroll offsets
+        END = 4           // The step the recording stopped at
+    };
+
+    // Mouse buttons share the key codes, after the last key
+    const int MOUSE_BUTTON_BASE = GLFW_KEY_LAST + 1;
+    const int NUM_CODES = MOUSE_BUTTON_BASE + GLFW_MOUSE_BUTTON_LAST + 1;
+
+    struct Event {
+        unsigned long step = 0;
+        EventType type = END;
+        int code = 0;          // The key or mouse button, for KEY_DOWN and KEY_UP
+        float x = 0.0f;
+        float y = 0.0f;
+    };
+
+    /*
+     The input as the simulation sees it, built up by applying events.
+    */
+    class State {
+        public:
+            bool down[NUM_CODES] = {};
+            float look_x = 0.0f;
+            float look_y = 0.0f;
+            float dolly = 0.0f;
+
+            void apply(const Event &e) {
+                switch (e.type) {
+                    case KEY_DOWN:   down[e.code] = true; break;
+                    case KEY_UP:     down[e.code] = false; break;
+                    case MOUSE_MOVE: look_x += e.x; look_y += e.y; break;
+                    case SCROLL:     dolly += e.y; break;
+                    case END:        break;
+                }
+            }
+
+            /*
+             The directions for the next step, with the same keys as processInput.
+            */
+            Directions directions() const {
+                Directions d;
+                if (down[GLFW_KEY_S])     d.y = 1.0f;
+                if (down[GLFW_KEY_W])     d.y = -1.0f;
+                if (down[GLFW_KEY_RIGHT]) d.x = -1.0f;
+                if (down[GLFW_KEY_LEFT])  d.x = 1.0f;
+                if (down[GLFW_KEY_UP])    d.z = 1.0f;
+                if (down[GLFW_KEY_DOWN])  d.z = -1.0f;
+                if (down[GLFW_KEY_A])     d.yaw = 1.0f;
+                if (down[GLFW_KEY_D])     d.yaw = -1.0f;
+                d.look_x = look_x;
+                d.look_y = look_y;
+                d.dolly = dolly;
+                return d;
+            }
+
+            /*
+             The mouse and scroll only move things for the step they arrive on.
+            */
+            void endStep() {
+                look_x = look_y = dolly = 0.0f;
+            }
+    };
+
+    /*
+     Turns what GLFW says the keys and mouse are doing into events. Only
+     changes are events, and the mouse only counts while the left button is
+     held (it drags the view round), so an idle session logs nothing.
+    */
+    class Poller {
+        private:
+            bool was_down[NUM_CODES] = {};
+            double last_x = 0.0, last_y = 0.0;
+            bool have_cursor = false;
+            double scrolled = 0.0;
+
+            static void scrollCallback(GLFWwindow *window, double, double y_offset) {
+                ((Poller*) glfwGetWindowUserPointer(window))->scrolled += y_offset;
+            }
+
+            void change(std::vector<Event> &events, int code, bool is_down) {
+                if (is_down == was_down[code]) return;
+                was_down[code] = is_down;
+                Event e;
+                e.type = is_down ? KEY_DOWN : KEY_UP;
+                e.code = code;
+                events.push_back(e);
+            }
+
+        public:
+            /*
+             Will hook the scroll wheel up, the poller must outlive the window.
+            */
+            void attach(GLFWwindow *window) {
+                glfwSetWindowUserPointer(window, this);
+                glfwSetScrollCallback(window, scrollCallback);
+            }
+
+            /*
+             Will add any new events to the end of events. Escape still closes
+             the window, it isn't an event.
+
+             Inputs:
+                * window <GLFWwindow *> => The window to read.
+                * events <std::vector<Event> &> => Where the events go (unstamped).
+            */
+            void poll(GLFWwindow *window, std::vector<Event> &events) {
+                if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+                    glfwSetWindowShouldClose(window, true);
+
+                static const int KEYS[] = { GLFW_KEY_S, GLFW_KEY_W, GLFW_KEY_RIGHT, GLFW_KEY_LEFT,
+                                            GLFW_KEY_UP, GLFW_KEY_DOWN, GLFW_KEY_A, GLFW_KEY_D };
+                for (int key : KEYS)
+                    change(events, key, glfwGetKey(window, key) == GLFW_PRESS);
+                change(events, MOUSE_BUTTON_BASE + GLFW_MOUSE_BUTTON_LEFT,
+                       glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS);
+
+                double x, y;
+                glfwGetCursorPos(window, &x, &y);
+                if (have_cursor && was_down[MOUSE_BUTTON_BASE + GLFW_MOUSE_BUTTON_LEFT] && (x != last_x || y != last_y)) {
+                    Event e;
+                    e.type = MOUSE_MOVE;
+                    e.x = (float) (x - last_x);
+                    e.y = (float) (y - last_y);
+                    events.push_back(e);
+                }
+                last_x = x;
+                last_y = y;
+                have_cursor = true;
+
+                if (scrolled != 0.0) {
+                    Event e;
+                    e.type = SCROLL;
+                    e.y = (float) scrolled;
+                    events.push_back(e);
+                    scrolled = 0.0;
+                }
+            }
+    };
+
+    /*
+     A recorded session, saved as a compact binary log:
+        "MAIN" magic, a version byte, then per event
+        varint steps since the last event, a type byte and
+            KEY_DOWN/KEY_UP => varint code
+            MOUSE_MOVE/SCROLL => x and y as little endian 32 bit floats
+        finishing with an END event on the last step.
+    */
+    class Log {
+        private:
+            static const unsigned char VERSION = 1;
+
+            static void putVarint(std::vector<unsigned char> &out, uint64_t v) {
+                while (v >= 0x80) {
+                    out.push_back((unsigned char) (v | 0x80));
+                    v >>= 7;
+                }
+                out.push_back((unsigned char) v);
+            }
+
+            static void putFloat(std::vector<unsigned char> &out, float f) {
+                uint32_t bits;
+                std::memcpy(&bits, &f, 4);
+                for (int i=0; i<4; i++)
+                    out.push_back((unsigned char) (bits >> (8 * i)));
+            }
+
+            static bool getVarint(const std::vector<unsigned char> &in, size_t &pos, uint64_t &v) {
+                v = 0;
+                for (int shift=0; shift<64 && pos<in.size(); shift+=7) {
+                    unsigned char b = in[pos++];
+                    v |= (uint64_t) (b & 0x7F) << shift;
+                    if (!(b & 0x80)) return true;
+                }
+                return false;
+            }
+
+            static bool getFloat(const std::vector<unsigned char> &in, size_t &pos, float &f) {
+                if (pos + 4 > in.size()) return false;
+                uint32_t bits = 0;
+                for (int i=0; i<4; i++)
+                    bits |= (uint32_t) in[pos++] << (8 * i);
+                std::memcpy(&f, &bits, 4);
+                return true;
+            }
+
+        public:
+            std::vector<Event> events;
+            size_t num_bytes = 0;   // Size of the last log saved or loaded
+
+            /*
+             The step the recording stopped at.
+            */
+            unsigned long endStep() const {
+                return events.empty() ? 0 : events.back().step;
+            }
+
+            /*
+             Will write the log, with an END event for the given step.
+
+             Inputs:
+                * filepath <std::string> => Where to write it.
+                * end_step <unsigned long> => The last step simulated.
+            */
+            void save(const std::string &filepath, unsigned long end_step) {
+                Event end;
+                end.step = end_step;
+                events.push_back(end);
+
+                std::vector<unsigned char> out = { 'M', 'A', 'I', 'N', VERSION };
+                unsigned long last_step = 0;
+                for (const Event &e : events) {
+                    putVarint(out, e.step - last_step);
+                    last_step = e.step;
+                    out.push_back((unsigned char) e.type);
+                    if (e.type == KEY_DOWN || e.type == KEY_UP)
+                        putVarint(out, e.code);
+                    else if (e.type == MOUSE_MOVE || e.type == SCROLL) {
+                        putFloat(out, e.x);
+                        putFloat(out, e.y);
+                    }
+                }
+
+                FILE *file = fopen(filepath.c_str(), "wb");
+                if (file == NULL || fwrite(out.data(), 1, out.size(), file) != out.size()) {
+                    std::cerr << "Failed to write the input log '" << filepath << "'" << std::endl;
+                    if (file != NULL) fclose(file);
+                    throw "InputLogError";
+                }
+                fclose(file);
+                num_bytes = out.size();
+            }
+
+            /*
+             Will read a log written by save.
+
+             Inputs:
+                * filepath <std::string> => The log to read.
+            */
+            void load(const std::string &filepath) {
+                std::vector<unsigned char> in;
+                FILE *file = fopen(filepath.c_str(), "rb");
+                if (file == NULL) {
+                    std::cerr << "Failed to open the input log '" << filepath << "'" << std::endl;
+                    throw "InputLogError";
+                }
+                unsigned char buffer[4096];
+                size_t n;
+                while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+                    in.insert(in.end(), buffer, buffer + n);
+                fclose(file);
+                num_bytes = in.size();
+
+                if (in.size() < 5 || std::memcmp(in.data(), "MAIN", 4) != 0 || in[4] != VERSION) {
+                    std::cerr << "'" << filepath << "' isn't a version " << (int) VERSION << " input log" << std::endl;
+                    throw "InputLogError";
+                }
+
+                events.clear();
+                size_t pos = 5;
+                unsigned long step = 0;
+                while (true) {
+                    Event e;
+                    uint64_t delta, code = 0;
+                    bool ok = getVarint(in, pos, delta) && pos < in.size();
+                    if (ok) {
+                        e.type = (EventType) in[pos++];
+                        if (e.type == KEY_DOWN || e.type == KEY_UP)
+                            ok = getVarint(in, pos, code) && code < (uint64_t) NUM_CODES;
+                        else if (e.type == MOUSE_MOVE || e.type == SCROLL)
+                            ok = getFloat(in, pos, e.x) && getFloat(in, pos, e.y);
+                        else
+                            ok = e.type == END;
+                    }
+                    if (!ok) {
+                        std::cerr << "The input log '" << filepath << "' is cut short or corrupt at byte ";
+                        std::cerr << pos << std::endl;
+                        throw "InputLogError";
+                    }
+                    step += delta;
+                    e.step = step;
+                    e.code = (int) code;
+                    events.push_back(e);
+                    if (e.type == END) break;
+                }
+            }
+    };
+
+    /*
+     Plays a log back, one simulation step at a time.
+    */
+    class Replay {
+        private:
+            const Log *log = NULL;
+            size_t next = 0;
+
+        public:
+            void start(const Log &l) {
+                log = &l;
+                next = 0;
+            }
+
+            /*
+             Will apply every event stamped with this step (or an earlier one
+             that was somehow missed).
+
+             Inputs:
+                * step <unsigned long> => The step about to be simulated.
+                * state <State &> => The input to apply them to.
+            */
+            void feed(unsigned long step, State &state) {
+                while (next < log->events.size() && log->events[next].step <= step)
+                    state.apply(log->events[next++]);
+            }
+
+            bool finished(unsigned long step) const {
+                return step >= log->endStep();
+            }
+    };
 }
 
 #endif
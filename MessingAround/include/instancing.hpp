@@ -0,0 +1,237 @@
+#ifndef INSTANCING_HEADER_GUARD
+#define INSTANCING_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <iostream>
+#include <cstddef>
+#include <cstring>
+
+#include <ringbuffer.hpp>
+
+
+namespace instancing {
+
+    /*
+     Holds a model matrix per instance in its own vertex buffer so a whole
+     field of objects can be drawn with a single instanced draw call.
+
+     The matrix is fed to the vertex shader as 4 vec4 attributes starting at
+     `location` with a divisor of 1, i.e. in the shader:
+        layout (location = 2) in mat4 aModel;
+    */
+    class InstanceBuffer {
+        private:
+            // Where this frame's matrices start (this buffer or a ring) and where the attributes point now
+            unsigned int base_buffer = 0, bound_buffer = 0;
+            size_t base_offset = 0, bound_offset = 0;
+
+        public:
+            unsigned int handle = 0;
+            unsigned int VAO_handle = 0;
+            unsigned int capacity = 0;
+            unsigned int count = 0;
+            unsigned int location = 2;
+
+            /*
+             Will point the matrix attributes at a buffer (and byte offset into it).
+            */
+            void bindAttributes(unsigned int buffer, size_t offset) {
+                bound_buffer = buffer;
+                bound_offset = offset;
+                glBindVertexArray(VAO_handle);
+                glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+                // A mat4 attribute takes up 4 consecutive vec4 slots
+                for (unsigned int i=0; i<4; i++) {
+                    glEnableVertexAttribArray(location + i);
+                    glVertexAttribPointer(location + i, 4, GL_FLOAT, GL_FALSE,
+                                          sizeof(glm::mat4), (void*)(offset + i * sizeof(glm::vec4)));
+                    glVertexAttribDivisor(location + i, 1);
+                }
+
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                glBindVertexArray(0);
+            }
+
+            /*
+             Will create the buffer and hook it up to the attributes of a VAO.
+
+             Inputs:
+                * VAO_handle <unsigned int> => The vertex array holding the mesh.
+                * max_instances <unsigned int> => How many matrices the buffer can hold.
+            */
+            void create(unsigned int VAO, unsigned int max_instances) {
+                VAO_handle = VAO;
+                capacity = max_instances;
+
+                glGenBuffers(1, &handle);
+                glBindBuffer(GL_ARRAY_BUFFER, handle);
+                glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+                base_buffer = handle;
+                bindAttributes(handle, 0);
+            }
+
+            /*
+             Will copy the model matrices to the GPU.
+
+             The old storage is orphaned first so the driver doesn't have to
+             wait for the previous frame's draw to finish reading it.
+            */
+            void upload(const glm::mat4 *models, unsigned int num_models) {
+                if (num_models > capacity) {
+                    std::cerr << "Too many instances: " << num_models;
+                    std::cerr << " (capacity " << capacity << ")" << std::endl;
+                    throw "InstanceBufferError";
+                }
+                count = num_models;
+
+                glBindBuffer(GL_ARRAY_BUFFER, handle);
+                glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(glm::mat4), models);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+                base_buffer = handle;
+                base_offset = 0;
+                if (bound_buffer != handle || bound_offset != 0)
+                    bindAttributes(handle, 0);
+            }
+
+            /*
+             Will copy the model matrices into this frame's part of a ring buffer
+             and point the attributes at them, so there is no glBufferData and no
+             implicit sync. Must be called between the ring's beginFrame/endFrame.
+            */
+            void uploadRing(ringbuffer::Ring &ring, const glm::mat4 *models, unsigned int num_models) {
+                count = num_models;
+                ringbuffer::Allocation a = ring.allocate(count * sizeof(glm::mat4), ringbuffer::VERTEX);
+                memcpy(a.data, models, a.size);
+                ring.commit(a);
+                base_buffer = ring.handle;
+                base_offset = a.offset;
+                bindAttributes(ring.handle, a.offset);
+            }
+
+            /*
+             Draw every instance of a non-indexed mesh. The mesh's VAO must be bound.
+            */
+            void inline draw(unsigned int first, unsigned int num_vertices) const {
+                glDrawArraysInstanced(GL_TRIANGLES, first, num_vertices, count);
+            }
+
+            /*
+             Draw every instance of an indexed mesh. The mesh's VAO must be bound.
+            */
+            void inline drawElements(unsigned int num_indices) const {
+                glDrawElementsInstanced(GL_TRIANGLES, num_indices, GL_UNSIGNED_INT, 0, count);
+            }
+
+            /*
+             Draw some of the uploaded instances with a range of an index
+             buffer, e.g. one level of detail for the instances that picked it.
+             GL 3.3 has no base instance so the attributes are moved instead.
+
+             Inputs:
+                * num_indices <unsigned int> => How many indices to draw.
+                * first_index <unsigned int> => Where they start in the VAO's element buffer.
+                * first_instance <unsigned int> => The first uploaded matrix to use.
+                * num_instances <unsigned int> => How many matrices (instances) to draw.
+            */
+            void drawElementsRange(unsigned int num_indices, unsigned int first_index,
+                                   unsigned int first_instance, unsigned int num_instances) {
+                size_t offset = base_offset + first_instance * sizeof(glm::mat4);
+                if (bound_buffer != base_buffer || bound_offset != offset)
+                    bindAttributes(base_buffer, offset);
+                glBindVertexArray(VAO_handle);
+                glDrawElementsInstanced(GL_TRIANGLES, num_indices, GL_UNSIGNED_INT,
+                                        (void*)(first_index * sizeof(unsigned int)), num_instances);
+            }
+
+            void destroy() {
+                glDeleteBuffers(1, &handle);
+                handle = 0;
+            }
+    };
+
+
+    /*
+     The static parameters of an instance that is animated on the GPU.
+
+     The vertex shader rotates the mesh by `time * speed` about `axis` and
+     then moves it to `position`, so nothing needs re-uploading per frame.
+    */
+    struct AnimatedInstance {
+        glm::vec3 position;
+        glm::vec3 axis;
+        float speed;
+    };
+
+    /*
+     Holds the AnimatedInstance parameters in a vertex buffer. These are
+     uploaded once and the only per frame work is setting the `time` uniform,
+     see src/animatedShader.vert.
+
+     Attribute layout (all with a divisor of 1):
+        * location     => vec3 position
+        * location + 1 => vec3 axis
+        * location + 2 => float speed
+    */
+    class AnimatedInstanceBuffer {
+        public:
+            unsigned int handle = 0;
+            unsigned int count = 0;
+            unsigned int location = 2;
+
+            /*
+             Will create the buffer, upload the instances and hook it up to the
+             attributes of a VAO.
+
+             Inputs:
+                * VAO_handle <unsigned int> => The vertex array holding the mesh.
+                * instances <const AnimatedInstance *> => The instance parameters.
+                * num_instances <unsigned int> => How many instances there are.
+            */
+            void create(unsigned int VAO_handle, const AnimatedInstance *instances,
+                        unsigned int num_instances) {
+                count = num_instances;
+
+                glGenBuffers(1, &handle);
+                glBindVertexArray(VAO_handle);
+                glBindBuffer(GL_ARRAY_BUFFER, handle);
+                glBufferData(GL_ARRAY_BUFFER, count * sizeof(AnimatedInstance), instances, GL_STATIC_DRAW);
+
+                glEnableVertexAttribArray(location);
+                glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, sizeof(AnimatedInstance),
+                                      (void*)offsetof(AnimatedInstance, position));
+                glVertexAttribDivisor(location, 1);
+
+                glEnableVertexAttribArray(location + 1);
+                glVertexAttribPointer(location + 1, 3, GL_FLOAT, GL_FALSE, sizeof(AnimatedInstance),
+                                      (void*)offsetof(AnimatedInstance, axis));
+                glVertexAttribDivisor(location + 1, 1);
+
+                glEnableVertexAttribArray(location + 2);
+                glVertexAttribPointer(location + 2, 1, GL_FLOAT, GL_FALSE, sizeof(AnimatedInstance),
+                                      (void*)offsetof(AnimatedInstance, speed));
+                glVertexAttribDivisor(location + 2, 1);
+
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                glBindVertexArray(0);
+            }
+
+            /*
+             Draw every instance of a non-indexed mesh. The mesh's VAO must be bound.
+            */
+            void inline draw(unsigned int first, unsigned int num_vertices) const {
+                glDrawArraysInstanced(GL_TRIANGLES, first, num_vertices, count);
+            }
+
+            void destroy() {
+                glDeleteBuffers(1, &handle);
+                handle = 0;
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,411 @@
+#ifndef LOD_HEADER_GUARD
+#define LOD_HEADER_GUARD
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <queue>
+#include <vector>
+
+#include <mesh.hpp>
+#include <trace.hpp>
+
+
+/*
+ Levels of detail for meshes: simplified versions built at load time and
+ picked per instance by how big their error would look on screen.
+
+ The simplifier is quadric error metric edge collapse (Garland & Heckbert)
+ using half edge collapses, a vertex is only ever merged into one of its
+ neighbours. That means no new vertices are made, so every level is just a
+ different index list over the original vertex buffer and the whole chain
+ fits in one VBO/EBO pair.
+
+ Vertices on a seam (the same position with different texture coordinates)
+ or on an open boundary are never moved, so the texturing and the outline
+ of the mesh stay intact.
+*/
+namespace lod {
+
+    /*
+     The sum of squared distances to a set of planes, as a symmetric 4x4 matrix.
+    */
+    struct Quadric {
+        double a[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+        void addPlane(double nx, double ny, double nz, double d) {
+            a[0] += nx*nx; a[1] += nx*ny; a[2] += nx*nz; a[3] += nx*d;
+            a[4] += ny*ny; a[5] += ny*nz; a[6] += ny*d;
+            a[7] += nz*nz; a[8] += nz*d;
+            a[9] += d*d;
+        }
+
+        void add(const Quadric &q) {
+            for (unsigned int i=0; i<10; i++) a[i] += q.a[i];
+        }
+
+        double evaluate(const glm::dvec3 &p) const {
+            return a[0]*p.x*p.x + 2*a[1]*p.x*p.y + 2*a[2]*p.x*p.z + 2*a[3]*p.x
+                 + a[4]*p.y*p.y + 2*a[5]*p.y*p.z + 2*a[6]*p.y
+                 + a[7]*p.z*p.z + 2*a[8]*p.z
+                 + a[9];
+        }
+    };
+
+    /*
+     Will simplify a mesh down to (about) a target number of triangles.
+
+     Returns the new index list (into the same vertices) and sets error to
+     how far the furthest original vertex ends up from the simplified surface
+     around the vertex it was merged into, in the mesh's own units.
+
+     Inputs:
+        * m <const mesh::Mesh &> => The mesh to simplify.
+        * target_triangles <unsigned int> => Stop once there are this many left.
+        * error <float &> => Set to the error of the result.
+    */
+    std::vector<unsigned int> simplify(const mesh::Mesh &m, unsigned int target_triangles, float &error) {
+        TRACE_SCOPE("lod::simplify");
+        unsigned int num_vertices = m.numVertices();
+        unsigned int num_triangles = m.numIndices() / 3;
+        std::vector<unsigned int> tris(m.indices.begin(), m.indices.begin() + 3 * num_triangles);
+
+        std::vector<glm::dvec3> pos(num_vertices);
+        for (unsigned int v=0; v<num_vertices; v++)
+            pos[v] = glm::dvec3(m.vertices[v*m.stride], m.vertices[v*m.stride + 1], m.vertices[v*m.stride + 2]);
+
+        // Which triangles use each vertex
+        std::vector<std::vector<unsigned int>> vert_tris(num_vertices);
+        for (unsigned int t=0; t<num_triangles; t++)
+            for (unsigned int k=0; k<3; k++)
+                vert_tris[tris[3*t + k]].push_back(t);
+
+        // Lock seams (several vertices at one position) and open boundaries
+        std::vector<bool> locked(num_vertices, false);
+        std::map<std::vector<long>, unsigned int> at_position;
+        for (unsigned int v=0; v<num_vertices; v++) {
+            std::vector<long> key = {lround(pos[v].x * 1e5), lround(pos[v].y * 1e5), lround(pos[v].z * 1e5)};
+            std::map<std::vector<long>, unsigned int>::iterator it = at_position.find(key);
+            if (it == at_position.end()) {
+                at_position[key] = v;
+            } else {
+                locked[v] = true;
+                locked[it->second] = true;
+            }
+        }
+        std::map<std::pair<unsigned int, unsigned int>, unsigned int> edge_count;
+        for (unsigned int t=0; t<num_triangles; t++) {
+            for (unsigned int k=0; k<3; k++) {
+                unsigned int a = tris[3*t + k], b = tris[3*t + (k+1) % 3];
+                edge_count[std::make_pair(std::min(a, b), std::max(a, b))]++;
+            }
+        }
+        for (std::map<std::pair<unsigned int, unsigned int>, unsigned int>::iterator it=edge_count.begin();
+             it!=edge_count.end(); it++) {
+            if (it->second != 2) {
+                locked[it->first.first] = true;
+                locked[it->first.second] = true;
+            }
+        }
+
+        // Every vertex starts with the planes of the triangles around it
+        std::vector<Quadric> quadrics(num_vertices);
+        for (unsigned int t=0; t<num_triangles; t++) {
+            glm::dvec3 n = glm::cross(pos[tris[3*t+1]] - pos[tris[3*t]], pos[tris[3*t+2]] - pos[tris[3*t]]);
+            double length = glm::length(n);
+            if (length == 0.0) continue;
+            n /= length;
+            double d = -glm::dot(n, pos[tris[3*t]]);
+            for (unsigned int k=0; k<3; k++)
+                quadrics[tris[3*t + k]].addPlane(n.x, n.y, n.z, d);
+        }
+
+        /*
+         Candidate collapses of `from` into `to`. The versions say which state
+         of the two vertices the cost was worked out for, stale ones are skipped.
+        */
+        struct Collapse {
+            double cost;
+            unsigned int from, to;
+            unsigned int from_version, to_version;
+            bool operator>(const Collapse &o) const { return cost > o.cost; }
+        };
+        std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+        std::vector<unsigned int> version(num_vertices, 0);
+        std::vector<bool> removed(num_vertices, false);
+        std::vector<bool> tri_alive(num_triangles, true);
+        std::vector<unsigned int> merged_into(num_vertices);
+
+        auto push = [&](unsigned int from, unsigned int to) {
+            if (locked[from] || removed[from] || removed[to] || from == to) return;
+            Quadric q = quadrics[from];
+            q.add(quadrics[to]);
+            Collapse c = {std::max(q.evaluate(pos[to]), 0.0), from, to, version[from], version[to]};
+            heap.push(c);
+        };
+        std::vector<unsigned int> ring;
+        auto neighbours = [&](unsigned int v, std::vector<unsigned int> &out) {
+            out.clear();
+            for (unsigned int t : vert_tris[v]) {
+                if (!tri_alive[t]) continue;
+                for (unsigned int k=0; k<3; k++)
+                    if (tris[3*t + k] != v) out.push_back(tris[3*t + k]);
+            }
+            std::sort(out.begin(), out.end());
+            out.erase(std::unique(out.begin(), out.end()), out.end());
+        };
+
+        for (unsigned int v=0; v<num_vertices; v++) {
+            neighbours(v, ring);
+            for (unsigned int w : ring) push(v, w);
+        }
+
+        unsigned int live_triangles = num_triangles;
+        std::vector<unsigned int> ring_to;
+        while (live_triangles > target_triangles && !heap.empty()) {
+            Collapse c = heap.top();
+            heap.pop();
+            if (removed[c.from] || removed[c.to]) continue;
+            if (version[c.from] != c.from_version || version[c.to] != c.to_version) continue;
+
+            // Only collapse edges with exactly two shared neighbours, anything
+            // else would pinch the surface into something non-manifold
+            neighbours(c.from, ring);
+            if (!std::binary_search(ring.begin(), ring.end(), c.to)) continue;
+            neighbours(c.to, ring_to);
+            unsigned int shared = 0;
+            for (unsigned int w : ring)
+                if (std::binary_search(ring_to.begin(), ring_to.end(), w)) shared++;
+            if (shared != 2) continue;
+
+            // Don't let any triangle flip over or collapse to nothing
+            bool ok = true;
+            for (unsigned int t : vert_tris[c.from]) {
+                if (!tri_alive[t]) continue;
+                unsigned int *tri = &tris[3*t];
+                if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to) continue;
+                glm::dvec3 p[3], q[3];
+                for (unsigned int k=0; k<3; k++) {
+                    p[k] = pos[tri[k]];
+                    q[k] = tri[k] == c.from ? pos[c.to] : pos[tri[k]];
+                }
+                glm::dvec3 n_before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                glm::dvec3 n_after = glm::cross(q[1] - q[0], q[2] - q[0]);
+                double after = glm::length(n_after), before = glm::length(n_before);
+                if (after < 1e-12 || glm::dot(n_before, n_after) < 0.2 * before * after) {
+                    ok = false;
+                    break;
+                }
+            }
+            if (!ok) continue;
+
+            // Do it: triangles with both ends go, the rest move over to `to`
+            for (unsigned int t : vert_tris[c.from]) {
+                if (!tri_alive[t]) continue;
+                unsigned int *tri = &tris[3*t];
+                if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to) {
+                    tri_alive[t] = false;
+                    live_triangles--;
+                    continue;
+                }
+                for (unsigned int k=0; k<3; k++)
+                    if (tri[k] == c.from) tri[k] = c.to;
+                vert_tris[c.to].push_back(t);
+            }
+            removed[c.from] = true;
+            merged_into[c.from] = c.to;
+            quadrics[c.to].add(quadrics[c.from]);
+            version[c.to]++;
+
+            // Only `to` changed, so only the edges touching it need new costs
+            neighbours(c.to, ring);
+            for (unsigned int w : ring) {
+                push(w, c.to);
+                push(c.to, w);
+            }
+        }
+
+        std::vector<unsigned int> out;
+        out.reserve(3 * live_triangles);
+        for (unsigned int t=0; t<num_triangles; t++)
+            if (tri_alive[t])
+                out.insert(out.end(), tris.begin() + 3*t, tris.begin() + 3*t + 3);
+
+        // Measure every original vertex against the triangles it ended up part of
+        double max_distance = 0.0;
+        for (unsigned int v=0; v<num_vertices; v++) {
+            unsigned int r = v;
+            while (removed[r]) r = merged_into[r];
+            if (r == v) continue;
+
+            double distance = HUGE_VAL;
+            for (unsigned int t : vert_tris[r]) {
+                if (!tri_alive[t]) continue;
+                glm::dvec3 n = glm::cross(pos[tris[3*t+1]] - pos[tris[3*t]], pos[tris[3*t+2]] - pos[tris[3*t]]);
+                double length = glm::length(n);
+                if (length == 0.0) continue;
+                distance = std::min(distance, fabs(glm::dot(n / length, pos[v] - pos[tris[3*t]])));
+            }
+            if (distance != HUGE_VAL) max_distance = std::max(max_distance, distance);
+        }
+        error = (float) max_distance;
+        return out;
+    }
+
+    /*
+     One level of detail: a range of the chain's index buffer.
+    */
+    struct Level {
+        unsigned int first_index;
+        unsigned int num_indices;
+        float error;                // How far (in mesh units) the surface moved
+    };
+
+    /*
+     A mesh and all its levels of detail. Every level indexes the same
+     vertices, mesh.indices holds all the levels one after the other.
+    */
+    struct Chain {
+        mesh::Mesh mesh;
+        std::vector<Level> levels;
+    };
+
+    /*
+     Will build a chain of levels, each with about `ratio` times the
+     triangles of the last, always simplifying from the full mesh so the
+     errors don't stack up. Stops early once a level can't be made smaller.
+
+     Inputs:
+        * m <const mesh::Mesh &> => The full detail mesh (level 0).
+        * max_levels <unsigned int> => The most levels to make, including level 0.
+        * ratio <float> => How many triangles each level keeps from the last.
+    */
+    Chain buildChain(const mesh::Mesh &m, unsigned int max_levels=5, float ratio=0.5f) {
+        TRACE_SCOPE("lod::buildChain");
+        Chain chain;
+        chain.mesh.vertices = m.vertices;
+        chain.mesh.stride = m.stride;
+        chain.mesh.indices = m.indices;
+        Level full = {0, m.numIndices(), 0.0f};
+        chain.levels.push_back(full);
+
+        unsigned int target = m.numIndices() / 3;
+        while (chain.levels.size() < max_levels) {
+            target = (unsigned int) (target * ratio);
+            float error = 0.0f;
+            std::vector<unsigned int> indices = simplify(m, target, error);
+
+            // Not worth a level if it didn't get at least 10% smaller
+            if (indices.size() > 0.9 * chain.levels.back().num_indices || indices.empty()) break;
+
+            Level level = {chain.mesh.numIndices(), (unsigned int) indices.size(), error};
+            chain.mesh.indices.insert(chain.mesh.indices.end(), indices.begin(), indices.end());
+            chain.levels.push_back(level);
+        }
+        return chain;
+    }
+
+    /*
+     Will print a line per level of a chain.
+    */
+    void printChain(const Chain &chain) {
+        std::cout << "lod: " << chain.mesh.numVertices() << " vertices, " << chain.levels.size() << " levels" << std::endl;
+        for (size_t l=0; l<chain.levels.size(); l++) {
+            std::cout << "  level " << l << ": " << chain.levels[l].num_indices / 3 << " triangles, error ";
+            std::cout << chain.levels[l].error << std::endl;
+        }
+    }
+
+    /*
+     Picks a level for every instance by how many pixels its error would
+     cover on screen: the coarsest level that stays under the threshold.
+
+     Each instance remembers its level and only drops to a coarser one once
+     that is comfortably (by `hysteresis`) under the threshold, so instances
+     near a switching distance don't flicker between two levels.
+    */
+    class Selector {
+        private:
+            std::vector<unsigned char> current;
+
+        public:
+            float threshold_pixels = 1.0f;
+            float hysteresis = 0.25f;
+            std::vector<std::vector<unsigned int>> buckets;  // Instances picked for each level
+
+            /*
+             Will sort instances into buckets, one per level.
+
+             Inputs:
+                * chain <const Chain &> => The levels (with their errors).
+                * centres <const std::vector<glm::vec3> &> => Every instance's position.
+                * instances <const std::vector<unsigned int> &> => Which instances to draw.
+                * view <const glm::mat4 &> => The view matrix.
+                * pixels_per_unit <float> => Pixels covered by 1 unit at distance 1,
+                                             i.e. proj[1][1] * screen height / 2.
+            */
+            void select(const Chain &chain, const std::vector<glm::vec3> &centres,
+                        const std::vector<unsigned int> &instances, const glm::mat4 &view,
+                        float pixels_per_unit) {
+                TRACE_SCOPE("lod::Selector::select");
+                if (current.size() != centres.size()) current.assign(centres.size(), 0);
+                buckets.resize(chain.levels.size());
+                for (size_t l=0; l<buckets.size(); l++) buckets[l].clear();
+
+                unsigned int coarsest = chain.levels.size() - 1;
+                for (unsigned int i : instances) {
+                    glm::vec3 p = glm::vec3(view * glm::vec4(centres[i], 1.0f));
+                    float scale = pixels_per_unit / std::max(glm::length(p), 1e-3f);
+
+                    // Go finer while the current level's error is too big...
+                    unsigned int level = std::min((unsigned int) current[i], coarsest);
+                    while (level > 0 && chain.levels[level].error * scale > threshold_pixels)
+                        level--;
+                    // ...and coarser while the next level is well under it
+                    while (level < coarsest &&
+                           chain.levels[level + 1].error * scale < threshold_pixels * (1.0f - hysteresis))
+                        level++;
+
+                    current[i] = level;
+                    buckets[level].push_back(i);
+                }
+            }
+    };
+
+    /*
+     Will average how many instances and triangles each level drew.
+    */
+    class StatsAccumulator {
+        public:
+            unsigned long num_frames = 0;
+            std::vector<double> total_instances;
+            double total_triangles = 0.0;
+            double total_full_triangles = 0.0;     // What drawing everything at level 0 would cost
+
+            void add(const Chain &chain, const Selector &selector) {
+                num_frames++;
+                total_instances.resize(chain.levels.size(), 0.0);
+                for (size_t l=0; l<selector.buckets.size(); l++) {
+                    double n = selector.buckets[l].size();
+                    total_instances[l] += n;
+                    total_triangles += n * chain.levels[l].num_indices / 3;
+                    total_full_triangles += n * chain.levels[0].num_indices / 3;
+                }
+            }
+
+            void print() const {
+                if (num_frames == 0) return;
+                std::cout << "lod: avg instances per level";
+                for (size_t l=0; l<total_instances.size(); l++)
+                    std::cout << " " << total_instances[l] / num_frames;
+                std::cout << ", " << total_triangles / num_frames << " triangles drawn (";
+                std::cout << 100.0 * total_triangles / std::max(total_full_triangles, 1.0);
+                std::cout << "% of full detail)" << std::endl;
+            }
+    };
+}
+
+#endif
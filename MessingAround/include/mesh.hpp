@@ -0,0 +1,177 @@
+#ifndef MESH_HEADER_GUARD
+#define MESH_HEADER_GUARD
+
+#include <glad/glad.h>
+
+#include <cmath>
+#include <map>
+#include <vector>
+
+#include <files.hpp>
+
+
+namespace mesh {
+
+    /*
+     An indexed triangle mesh. Each vertex is `stride` floats, the first 3 being
+     the position and the next 2 the texture coordinates (the same layout as
+     data/vertices.arr).
+    */
+    struct Mesh {
+        std::vector<float> vertices;
+        std::vector<unsigned int> indices;
+        unsigned int stride = 5;
+
+        unsigned int numVertices() const { return vertices.size() / stride; }
+        unsigned int numIndices() const { return indices.size(); }
+    };
+
+    /*
+     Will turn a vertex array file (a list of triangles, 3 rows per triangle)
+     into an indexed mesh, merging vertices that are exactly the same.
+
+     Inputs:
+        * file <IO::FloatArrayFile &> => The vertices, already read.
+    */
+    Mesh fromArrayFile(IO::FloatArrayFile &file) {
+        Mesh m;
+        m.stride = file.num_arr_elem;
+
+        std::map<std::vector<float>, unsigned int> seen;
+        for (unsigned int v=0; v<file.num_vertices; v++) {
+            std::vector<float> vert(file.data + v * m.stride, file.data + (v + 1) * m.stride);
+            std::map<std::vector<float>, unsigned int>::iterator it = seen.find(vert);
+            if (it == seen.end()) {
+                unsigned int index = m.numVertices();
+                seen[vert] = index;
+                m.vertices.insert(m.vertices.end(), vert.begin(), vert.end());
+                m.indices.push_back(index);
+            } else {
+                m.indices.push_back(it->second);
+            }
+        }
+        return m;
+    }
+
+    /*
+     Will split every triangle into n*n smaller ones, interpolating every
+     vertex attribute. Vertices shared between neighbouring triangles are
+     merged so the result is still a connected mesh.
+
+     Inputs:
+        * m <const Mesh &> => The mesh to split up.
+        * n <unsigned int> => How many pieces each edge is cut into.
+    */
+    Mesh tessellate(const Mesh &m, unsigned int n) {
+        Mesh out;
+        out.stride = m.stride;
+        if (n < 1) n = 1;
+
+        // Keyed on the attributes rounded a little so both sides of an edge agree
+        std::map<std::vector<long>, unsigned int> seen;
+        std::vector<float> vert(m.stride);
+        std::vector<long> key(m.stride);
+        auto addVertex = [&](const float *a, const float *b, const float *c, float wa, float wb, float wc) {
+            for (unsigned int k=0; k<m.stride; k++) {
+                vert[k] = wa * a[k] + wb * b[k] + wc * c[k];
+                key[k] = lroundf(vert[k] * 1e5f);
+            }
+            std::map<std::vector<long>, unsigned int>::iterator it = seen.find(key);
+            if (it != seen.end()) return it->second;
+            unsigned int index = out.numVertices();
+            seen[key] = index;
+            out.vertices.insert(out.vertices.end(), vert.begin(), vert.end());
+            return index;
+        };
+
+        std::vector<unsigned int> grid;
+        for (unsigned int t=0; t+2<m.indices.size(); t+=3) {
+            const float *a = &m.vertices[m.indices[t] * m.stride];
+            const float *b = &m.vertices[m.indices[t+1] * m.stride];
+            const float *c = &m.vertices[m.indices[t+2] * m.stride];
+
+            // Row i has n-i+1 points going from the a-c edge towards b
+            grid.clear();
+            for (unsigned int i=0; i<=n; i++)
+                for (unsigned int j=0; j<=n-i; j++)
+                    grid.push_back(addVertex(a, b, c, (float) (n-i-j) / n, (float) i / n, (float) j / n));
+
+            unsigned int row = 0;
+            for (unsigned int i=0; i<n; i++) {
+                unsigned int next_row = row + n - i + 1;
+                for (unsigned int j=0; j<n-i; j++) {
+                    unsigned int p0 = grid[row + j], p1 = grid[row + j + 1], p2 = grid[next_row + j];
+                    out.indices.push_back(p0); out.indices.push_back(p2); out.indices.push_back(p1);
+                    if (j + 1 < n - i) {
+                        unsigned int p3 = grid[next_row + j + 1];
+                        out.indices.push_back(p1); out.indices.push_back(p2); out.indices.push_back(p3);
+                    }
+                }
+                row = next_row;
+            }
+        }
+        return out;
+    }
+
+    /*
+     Will pull every vertex part of the way onto a sphere around the origin,
+     e.g. turning a tessellated cube into a rounded one.
+
+     Inputs:
+        * m <Mesh &> => The mesh, changed in place.
+        * radius <float> => The radius of the sphere.
+        * amount <float> => 0 leaves the mesh alone, 1 makes it a sphere.
+    */
+    void spherify(Mesh &m, float radius, float amount) {
+        for (unsigned int v=0; v<m.numVertices(); v++) {
+            float *p = &m.vertices[v * m.stride];
+            float length = sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+            if (length == 0.0f) continue;
+            for (unsigned int k=0; k<3; k++)
+                p[k] += amount * (p[k] * radius / length - p[k]);
+        }
+    }
+
+    /*
+     The OpenGL handles for a mesh uploaded to the GPU.
+    */
+    struct GLMesh {
+        unsigned int VAO_handle = 0;
+        unsigned int VBO_handle = 0;
+        unsigned int EBO_handle = 0;
+        unsigned int num_indices = 0;
+
+        /*
+         Will create the VAO/VBO/EBO and set up the position (location 0) and
+         texture coordinate (location 1) attributes.
+        */
+        void create(const Mesh &m) {
+            num_indices = m.numIndices();
+            glGenVertexArrays(1, &VAO_handle);
+            glGenBuffers(1, &VBO_handle);
+            glGenBuffers(1, &EBO_handle);
+
+            glBindVertexArray(VAO_handle);
+            glBindBuffer(GL_ARRAY_BUFFER, VBO_handle);
+            glBufferData(GL_ARRAY_BUFFER, m.vertices.size() * sizeof(float), m.vertices.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO_handle);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, m.indices.size() * sizeof(unsigned int), m.indices.data(), GL_STATIC_DRAW);
+
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, m.stride * sizeof(float), (void*)0);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(1, 2, GL_FLOAT, GL_TRUE, m.stride * sizeof(float), (void*)(3 * sizeof(float)));
+            glEnableVertexAttribArray(1);
+
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindVertexArray(0);
+        }
+
+        void destroy() {
+            glDeleteVertexArrays(1, &VAO_handle);
+            glDeleteBuffers(1, &VBO_handle);
+            glDeleteBuffers(1, &EBO_handle);
+        }
+    };
+}
+
+#endif
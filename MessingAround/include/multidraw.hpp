@@ -0,0 +1,189 @@
+#ifndef MULTIDRAW_HEADER_GUARD
+#define MULTIDRAW_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <gl43.hpp>
+#include <gpuculling.hpp>
+#include <geometrypool.hpp>
+#include <instancing.hpp>
+#include <renderqueue.hpp>
+#include <trace.hpp>
+
+
+/*
+ Batches the per-draw cubes whose meshes share a geometry pool (needs OpenGL 4.3).
+
+ Each frame the draws are collected as (material, mesh, model matrix),
+ sorted by material and then mesh, and the matrices uploaded in that order
+ to an instance buffer on the pool's VAO. Every run of draws with the same
+ mesh becomes one indirect command whose base instance is where its
+ matrices start, so the vertex shader (src/instancedShader.vert) finds its
+ model matrix through the instance attribute rather than a uniform. Each
+ material is then a single glMultiDrawElementsIndirect, however many meshes
+ and draws it has.
+*/
+namespace multidraw {
+
+    /*
+     Numbers from the last frame.
+    */
+    struct Stats {
+        unsigned int num_draws = 0;
+        unsigned int num_commands = 0;
+        unsigned int num_calls = 0;
+    };
+
+    class Batcher {
+        private:
+            std::vector<uint64_t> keys, tmp_keys;
+            std::vector<uint32_t> order, tmp_order;
+            std::vector<glm::mat4> models, sorted_models;
+            std::vector<gpuculling::DrawElementsIndirectCommand> commands;
+            std::vector<unsigned int> call_materials, call_first_commands;
+
+        public:
+            instancing::InstanceBuffer Instances;
+            unsigned int command_buffer = 0;
+            unsigned int VAO_handle = 0;
+            Stats stats;
+
+            /*
+             Will create the instance and command buffers.
+
+             Inputs:
+                * VAO <unsigned int> => The geometry pool's vertex array.
+                * max_draws <unsigned int> => The most draws that can be added in a frame.
+            */
+            void create(unsigned int VAO, unsigned int max_draws) {
+                VAO_handle = VAO;
+                Instances.create(VAO, max_draws);
+                glGenBuffers(1, &command_buffer);
+                models.reserve(max_draws);
+            }
+
+            /*
+             Empty the batch, ready for the next frame.
+            */
+            void clear() {
+                keys.clear();
+                order.clear();
+                models.clear();
+            }
+
+            /*
+             Add a draw to the batch.
+
+             Inputs:
+                * material <unsigned int> => Index into the materials given to submit.
+                * mesh <unsigned int> => The mesh's handle in the geometry pool.
+                * model <const glm::mat4 &> => Where to draw it.
+            */
+            void add(unsigned int material, unsigned int mesh, const glm::mat4 &model) {
+                keys.push_back(((uint64_t) material << 32) | mesh);
+                order.push_back(models.size());
+                models.push_back(model);
+            }
+
+            /*
+             Will build the commands and draw them, one call per material. The
+             program drawing them must be in use.
+
+             Inputs:
+                * pool <const geometrypool::Pool &> => Where the meshes are.
+                * materials <const std::vector<unsigned int> &> => The texture of each material.
+            */
+            void submit(const geometrypool::Pool &pool, const std::vector<unsigned int> &materials) {
+                TRACE_SCOPE("multidraw::Batcher::submit");
+                stats.num_draws = models.size();
+                stats.num_commands = stats.num_calls = 0;
+                if (models.empty()) return;
+
+                renderqueue::radixSort(keys, order, tmp_keys, tmp_order);
+
+                // A command per run of the same mesh, a call per run of the same material
+                sorted_models.resize(models.size());
+                commands.clear();
+                call_materials.clear();
+                call_first_commands.clear();
+                for (size_t k=0; k<keys.size(); k++) {
+                    sorted_models[k] = models[order[k]];
+                    if (k > 0 && keys[k] == keys[k - 1]) {
+                        commands.back().instance_count++;
+                        continue;
+                    }
+
+                    unsigned int material = keys[k] >> 32;
+                    if (call_materials.empty() || call_materials.back() != material) {
+                        call_materials.push_back(material);
+                        call_first_commands.push_back(commands.size());
+                    }
+                    const geometrypool::MeshRange &r = pool.ranges[keys[k] & 0xFFFFFFFF];
+                    gpuculling::DrawElementsIndirectCommand command;
+                    command.count = r.num_indices;
+                    command.instance_count = 1;
+                    command.first_index = r.first_index;
+                    command.base_vertex = r.base_vertex;
+                    command.base_instance = k;
+                    commands.push_back(command);
+                }
+
+                Instances.upload(sorted_models.data(), sorted_models.size());
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+                glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(gpuculling::DrawElementsIndirectCommand),
+                             commands.data(), GL_STREAM_DRAW);
+
+                glBindVertexArray(VAO_handle);
+                glActiveTexture(GL_TEXTURE0);
+                for (size_t c=0; c<call_materials.size(); c++) {
+                    unsigned int first = call_first_commands[c];
+                    unsigned int last = c + 1 < call_materials.size() ? call_first_commands[c + 1] : commands.size();
+                    glBindTexture(GL_TEXTURE_2D, materials[call_materials[c] % materials.size()]);
+                    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                               (void*)(first * sizeof(gpuculling::DrawElementsIndirectCommand)),
+                                               last - first, 0);
+                }
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+                stats.num_commands = commands.size();
+                stats.num_calls = call_materials.size();
+            }
+
+            void destroy() {
+                Instances.destroy();
+                glDeleteBuffers(1, &command_buffer);
+            }
+    };
+
+    /*
+     Will average the per frame stats so they can be printed on exit.
+    */
+    class StatsAccumulator {
+        public:
+            unsigned long num_frames = 0;
+            double total_draws = 0.0;
+            double total_commands = 0.0;
+            double total_calls = 0.0;
+
+            void add(const Stats &s) {
+                num_frames++;
+                total_draws += s.num_draws;
+                total_commands += s.num_commands;
+                total_calls += s.num_calls;
+            }
+
+            void print() const {
+                if (num_frames == 0) return;
+                std::cout << "multidraw: avg " << total_draws / num_frames << " draws as ";
+                std::cout << total_commands / num_frames << " indirect commands in ";
+                std::cout << total_calls / num_frames << " calls" << std::endl;
+            }
+    };
+}
+
+#endif
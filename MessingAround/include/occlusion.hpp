@@ -0,0 +1,394 @@
+#ifndef OCCLUSION_HEADER_GUARD
+#define OCCLUSION_HEADER_GUARD
+
+#include <glm/glm.hpp>
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include <mesh.hpp>
+#include <threads.hpp>
+#include <timing.hpp>
+#include <trace.hpp>
+
+
+/*
+ CPU occlusion culling against a hierarchical depth buffer.
+
+ Each frame the instances that look biggest on screen are picked as
+ occluders and their triangles are rasterised into a small depth buffer.
+ The screen is split into tiles, triangles are binned into the tiles they
+ touch and the tiles are rasterised in parallel, 4 pixels at a time with
+ SSE edge functions. A max-depth mip pyramid is built from that depth
+ buffer and every instance's bounding box is tested against the pyramid
+ level where its screen rectangle covers a couple of texels: if the box's
+ nearest point is further away than the furthest occluder depth over the
+ whole rectangle the instance is hidden.
+
+ None of this touches GL, so doing it before a frame's draws overlaps it
+ with the GPU still working through the previous frame.
+*/
+namespace occlusion {
+
+    const unsigned int TILE_WIDTH = 32;     // Pixels, a multiple of 4 for the SSE rows
+    const unsigned int TILE_HEIGHT = 16;
+
+    /*
+     Numbers from the last cull.
+    */
+    struct Stats {
+        unsigned int num_tested = 0;
+        unsigned int num_occluded = 0;
+        unsigned int num_occluders = 0;
+        unsigned int num_triangles = 0;     // Occluder triangles that were rasterised
+        double seconds = 0.0;
+    };
+
+    /*
+     A triangle ready for rasterising: the edge functions and the depth as
+     planes over the pixel grid (value = a * x + b * y + c at the pixel centre).
+    */
+    struct Triangle {
+        float edge_a[3], edge_b[3], edge_c[3];
+        float depth_a, depth_b, depth_c;
+        int x0, y0, x1, y1;     // Pixel bounds, inclusive and clamped to the buffer
+    };
+
+    class Culler {
+        private:
+            std::vector<glm::vec3> positions;   // The occluder mesh
+            std::vector<unsigned int> indices;
+            std::vector<std::pair<float, unsigned int>> candidates;
+            std::vector<glm::vec4> clip;
+            std::vector<Triangle> triangles;
+            std::vector<std::vector<unsigned int>> bins;    // Triangles touching each tile
+            std::vector<unsigned char> occluded;
+            unsigned int tiles_x = 0, tiles_y = 0;
+
+            /*
+             Will turn a clip space triangle into edge and depth planes. Returns
+             false if it doesn't need drawing (behind the near plane, off screen or
+             zero area), skipping an occluder triangle is always safe.
+            */
+            bool setup(const glm::vec4 &c0, const glm::vec4 &c1, const glm::vec4 &c2, Triangle &t) const {
+                if (c0.z < -c0.w || c1.z < -c1.w || c2.z < -c2.w) return false;
+
+                glm::vec3 v[3];
+                const glm::vec4 *c[3] = {&c0, &c1, &c2};
+                for (unsigned int i=0; i<3; i++) {
+                    float inv_w = 1.0f / c[i]->w;
+                    v[i] = glm::vec3((c[i]->x * inv_w * 0.5f + 0.5f) * width,
+                                     (c[i]->y * inv_w * 0.5f + 0.5f) * height,
+                                     c[i]->z * inv_w);
+                }
+
+                // Both windings are drawn, flip the clockwise ones so inside is always >= 0
+                float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+                if (std::fabs(area) < 1e-8f) return false;
+                if (area < 0.0f) {
+                    std::swap(v[1], v[2]);
+                    area = -area;
+                }
+
+                t.x0 = std::max(0, (int) std::floor(std::min(v[0].x, std::min(v[1].x, v[2].x))));
+                t.y0 = std::max(0, (int) std::floor(std::min(v[0].y, std::min(v[1].y, v[2].y))));
+                t.x1 = std::min((int) width - 1, (int) std::floor(std::max(v[0].x, std::max(v[1].x, v[2].x))));
+                t.y1 = std::min((int) height - 1, (int) std::floor(std::max(v[0].y, std::max(v[1].y, v[2].y))));
+                if (t.x0 > t.x1 || t.y0 > t.y1) return false;
+
+                // Edge i is opposite vertex i, evaluated at pixel centres
+                for (unsigned int i=0; i<3; i++) {
+                    const glm::vec3 &a = v[(i + 1) % 3];
+                    const glm::vec3 &b = v[(i + 2) % 3];
+                    t.edge_a[i] = a.y - b.y;
+                    t.edge_b[i] = b.x - a.x;
+                    t.edge_c[i] = a.x * b.y - a.y * b.x + 0.5f * (t.edge_a[i] + t.edge_b[i]);
+                }
+
+                // Depth (z / w) is linear in screen space: z0 + (z1 - z0) * l1 + (z2 - z0) * l2
+                float inv_area = 1.0f / area;
+                float dz1 = (v[1].z - v[0].z) * inv_area, dz2 = (v[2].z - v[0].z) * inv_area;
+                t.depth_a = dz1 * t.edge_a[1] + dz2 * t.edge_a[2];
+                t.depth_b = dz1 * t.edge_b[1] + dz2 * t.edge_b[2];
+                t.depth_c = v[0].z + dz1 * t.edge_c[1] + dz2 * t.edge_c[2];
+                return true;
+            }
+
+            /*
+             Will clear one tile and draw every triangle binned into it.
+            */
+            void rasteriseTile(unsigned int tile) {
+                int tx0 = (tile % tiles_x) * TILE_WIDTH, ty0 = (tile / tiles_x) * TILE_HEIGHT;
+                int tx1 = tx0 + TILE_WIDTH - 1, ty1 = ty0 + TILE_HEIGHT - 1;
+                for (int y=ty0; y<=ty1; y++)
+                    std::fill(&depth[y * width + tx0], &depth[y * width + tx0] + TILE_WIDTH, 1.0f);
+
+                const __m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+                const __m128 zero = _mm_setzero_ps();
+                for (size_t b=0; b<bins[tile].size(); b++) {
+                    const Triangle &t = triangles[bins[tile][b]];
+                    int x0 = std::max(t.x0, tx0) & ~3, x1 = std::min(t.x1, tx1);
+                    int y0 = std::max(t.y0, ty0), y1 = std::min(t.y1, ty1);
+
+                    __m128 ea[3], eb[3], ec[3];
+                    for (unsigned int i=0; i<3; i++) {
+                        ea[i] = _mm_set1_ps(t.edge_a[i]);
+                        eb[i] = _mm_set1_ps(t.edge_b[i]);
+                        ec[i] = _mm_set1_ps(t.edge_c[i]);
+                    }
+                    __m128 za = _mm_set1_ps(t.depth_a), zb = _mm_set1_ps(t.depth_b), zc = _mm_set1_ps(t.depth_c);
+
+                    for (int y=y0; y<=y1; y++) {
+                        __m128 fy = _mm_set1_ps((float) y);
+                        float *row = &depth[y * width];
+                        for (int x=x0; x<=x1; x+=4) {
+                            __m128 fx = _mm_add_ps(_mm_set1_ps((float) x), lane);
+                            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+                            for (unsigned int i=0; i<3; i++) {
+                                __m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ea[i], fx), _mm_mul_ps(eb[i], fy)), ec[i]);
+                                inside = _mm_and_ps(inside, _mm_cmpge_ps(e, zero));
+                            }
+                            if (_mm_movemask_ps(inside) == 0) continue;
+
+                            __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(za, fx), _mm_mul_ps(zb, fy)), zc);
+                            __m128 old = _mm_loadu_ps(row + x);
+                            __m128 nearer = _mm_and_ps(inside, _mm_cmplt_ps(z, old));
+                            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(nearer, z), _mm_andnot_ps(nearer, old)));
+                        }
+                    }
+                }
+            }
+
+            /*
+             Will make level l of the pyramid the max of each 2x2 block of level l - 1.
+            */
+            void buildLevel(unsigned int l, threads::Pool &pool) {
+                const std::vector<float> &src = l == 1 ? depth : pyramid[l - 2];
+                unsigned int sw = levelWidth(l - 1), sh = levelHeight(l - 1);
+                unsigned int w = levelWidth(l);
+                std::vector<float> &dst = pyramid[l - 1];
+                pool.parallelFor(levelHeight(l), 16, [&](size_t begin, size_t end) {
+                    for (size_t y=begin; y<end; y++) {
+                        unsigned int y0 = 2 * y, y1 = std::min(2 * (unsigned int) y + 1, sh - 1);
+                        for (unsigned int x=0; x<w; x++) {
+                            unsigned int x0 = 2 * x, x1 = std::min(2 * x + 1, sw - 1);
+                            dst[y * w + x] = std::max(std::max(src[y0 * sw + x0], src[y0 * sw + x1]),
+                                                      std::max(src[y1 * sw + x0], src[y1 * sw + x1]));
+                        }
+                    }
+                });
+            }
+
+            const float *level(unsigned int l) const {
+                return l == 0 ? depth.data() : pyramid[l - 1].data();
+            }
+
+            /*
+             Will test one bounding box against the pyramid, true if it is hidden.
+            */
+            bool isOccluded(const glm::mat4 &view_proj, const glm::vec3 &bmin, const glm::vec3 &bmax) const {
+                float min_x = 1e30f, min_y = 1e30f, max_x = -1e30f, max_y = -1e30f, min_z = 1e30f;
+                for (unsigned int corner=0; corner<8; corner++) {
+                    glm::vec4 p = view_proj * glm::vec4(corner & 1 ? bmax.x : bmin.x,
+                                                         corner & 2 ? bmax.y : bmin.y,
+                                                         corner & 4 ? bmax.z : bmin.z, 1.0f);
+                    // Can't say anything about boxes crossing the near plane
+                    if (p.z < -p.w) return false;
+                    float inv_w = 1.0f / p.w;
+                    min_x = std::min(min_x, p.x * inv_w);
+                    max_x = std::max(max_x, p.x * inv_w);
+                    min_y = std::min(min_y, p.y * inv_w);
+                    max_y = std::max(max_y, p.y * inv_w);
+                    min_z = std::min(min_z, p.z * inv_w);
+                }
+
+                int x0 = std::max(0, (int) std::floor((min_x * 0.5f + 0.5f) * width));
+                int y0 = std::max(0, (int) std::floor((min_y * 0.5f + 0.5f) * height));
+                int x1 = std::min((int) width - 1, (int) std::floor((max_x * 0.5f + 0.5f) * width));
+                int y1 = std::min((int) height - 1, (int) std::floor((max_y * 0.5f + 0.5f) * height));
+                if (x0 > x1 || y0 > y1) return false;
+
+                // The level where the rectangle is at most 2 texels across
+                unsigned int l = 0;
+                int size = std::max(x1 - x0, y1 - y0);
+                while (size > 1 && l < numLevels() - 1) {
+                    size >>= 1;
+                    l++;
+                }
+
+                const float *texels = level(l);
+                unsigned int w = levelWidth(l);
+                for (int y=y0 >> l; y<=(y1 >> l); y++) {
+                    for (int x=x0 >> l; x<=(x1 >> l); x++) {
+                        if (min_z <= texels[y * w + x]) return false;
+                    }
+                }
+                return true;
+            }
+
+        public:
+            unsigned int width = 0, height = 0;     // Of the depth buffer, multiples of the tile size
+            unsigned int max_occluders = 64;
+            std::vector<float> depth;               // z / w of the nearest occluder, 1 where there's none
+            std::vector<std::vector<float>> pyramid;    // Levels 1 and up, the furthest depth of each 2x2
+            Stats stats;
+
+            /*
+             Will size the depth buffer and keep the mesh every occluder is drawn with.
+
+             Inputs:
+                * w <unsigned int> => Depth buffer width, rounded up to a whole number of tiles.
+                * h <unsigned int> => Depth buffer height, rounded up too.
+                * occluder <const mesh::Mesh &> => The instances' mesh, in model space.
+            */
+            void create(unsigned int w, unsigned int h, const mesh::Mesh &occluder) {
+                tiles_x = (w + TILE_WIDTH - 1) / TILE_WIDTH;
+                tiles_y = (h + TILE_HEIGHT - 1) / TILE_HEIGHT;
+                width = tiles_x * TILE_WIDTH;
+                height = tiles_y * TILE_HEIGHT;
+                depth.assign(width * height, 1.0f);
+                bins.resize(tiles_x * tiles_y);
+
+                pyramid.clear();
+                for (unsigned int l=1; levelWidth(l - 1) > 1 || levelHeight(l - 1) > 1; l++)
+                    pyramid.push_back(std::vector<float>(levelWidth(l) * levelHeight(l), 1.0f));
+
+                positions.resize(occluder.numVertices());
+                for (unsigned int v=0; v<occluder.numVertices(); v++)
+                    positions[v] = glm::vec3(occluder.vertices[v * occluder.stride],
+                                             occluder.vertices[v * occluder.stride + 1],
+                                             occluder.vertices[v * occluder.stride + 2]);
+                indices = occluder.indices;
+            }
+
+            unsigned int numLevels() const { return pyramid.size() + 1; }
+            unsigned int levelWidth(unsigned int l) const { return std::max(1u, (width + (1 << l) - 1) >> l); }
+            unsigned int levelHeight(unsigned int l) const { return std::max(1u, (height + (1 << l) - 1) >> l); }
+
+            /*
+             Will draw the biggest of the instances as occluders, build the
+             pyramid and then remove every hidden instance from `visible`.
+
+             Inputs:
+                * view_proj <const glm::mat4 &> => proj * view.
+                * models <const glm::mat4 *> => Every instance's model matrix.
+                * centres <const std::vector<glm::vec3> &> => Every instance's bounding sphere centre...
+                * radius <float> => ...and the radius they all share.
+                * visible <std::vector<unsigned int> &> => The instances to test (e.g. after frustum
+                                                           culling), the hidden ones are removed.
+                * pool <threads::Pool &> => Tiles, pyramid rows and tests are spread over it.
+            */
+            void cull(const glm::mat4 &view_proj, const glm::mat4 *models, const std::vector<glm::vec3> &centres,
+                      float radius, std::vector<unsigned int> &visible, threads::Pool &pool) {
+                TRACE_SCOPE("occlusion::Culler::cull");
+                timing::Stopwatch timer;
+
+                // The instances covering the most screen (radius over distance) occlude the most
+                candidates.clear();
+                for (size_t i=0; i<visible.size(); i++) {
+                    glm::vec4 c = view_proj * glm::vec4(centres[visible[i]], 1.0f);
+                    if (c.w > radius) candidates.push_back(std::make_pair(radius / c.w, visible[i]));
+                }
+                unsigned int num_occluders = std::min((size_t) max_occluders, candidates.size());
+                std::partial_sort(candidates.begin(), candidates.begin() + num_occluders, candidates.end(),
+                                  [](const std::pair<float, unsigned int> &a, const std::pair<float, unsigned int> &b) {
+                                      return a.first > b.first;
+                                  });
+
+                // Set up the occluder triangles and bin them into tiles
+                {
+                    TRACE_SCOPE("occlusion::bin");
+                    triangles.clear();
+                    for (size_t t=0; t<bins.size(); t++) bins[t].clear();
+                    clip.resize(positions.size());
+                    for (unsigned int o=0; o<num_occluders; o++) {
+                        glm::mat4 mvp = view_proj * models[candidates[o].second];
+                        for (size_t v=0; v<positions.size(); v++)
+                            clip[v] = mvp * glm::vec4(positions[v], 1.0f);
+                        for (size_t i=0; i+2<indices.size(); i+=3) {
+                            Triangle t;
+                            if (!setup(clip[indices[i]], clip[indices[i + 1]], clip[indices[i + 2]], t)) continue;
+                            unsigned int index = triangles.size();
+                            triangles.push_back(t);
+                            for (unsigned int ty=t.y0 / TILE_HEIGHT; ty<=t.y1 / TILE_HEIGHT; ty++)
+                                for (unsigned int tx=t.x0 / TILE_WIDTH; tx<=t.x1 / TILE_WIDTH; tx++)
+                                    bins[ty * tiles_x + tx].push_back(index);
+                        }
+                    }
+                }
+
+                {
+                    TRACE_SCOPE("occlusion::rasterise");
+                    pool.parallelFor(bins.size(), 8, [&](size_t begin, size_t end) {
+                        for (size_t tile=begin; tile<end; tile++)
+                            rasteriseTile(tile);
+                    });
+                }
+
+                {
+                    TRACE_SCOPE("occlusion::pyramid");
+                    for (unsigned int l=1; l<numLevels(); l++)
+                        buildLevel(l, pool);
+                }
+
+                {
+                    TRACE_SCOPE("occlusion::test");
+                    occluded.resize(visible.size());
+                    pool.parallelFor(visible.size(), 256, [&](size_t begin, size_t end) {
+                        for (size_t i=begin; i<end; i++) {
+                            const glm::vec3 &c = centres[visible[i]];
+                            occluded[i] = isOccluded(view_proj, c - radius, c + radius);
+                        }
+                    });
+                }
+
+                stats.num_tested = visible.size();
+                size_t kept = 0;
+                for (size_t i=0; i<visible.size(); i++) {
+                    if (!occluded[i]) visible[kept++] = visible[i];
+                }
+                visible.resize(kept);
+
+                stats.num_occluded = stats.num_tested - kept;
+                stats.num_occluders = num_occluders;
+                stats.num_triangles = triangles.size();
+                stats.seconds = timer.seconds();
+            }
+    };
+
+    /*
+     Will average the per frame occlusion stats so they can be printed on exit.
+    */
+    class StatsAccumulator {
+        public:
+            unsigned long num_frames = 0;
+            double total_tested = 0.0;
+            double total_occluded = 0.0;
+            double total_occluders = 0.0;
+            double total_triangles = 0.0;
+            double total_seconds = 0.0;
+
+            void add(const Stats &s) {
+                num_frames++;
+                total_tested += s.num_tested;
+                total_occluded += s.num_occluded;
+                total_occluders += s.num_occluders;
+                total_triangles += s.num_triangles;
+                total_seconds += s.seconds;
+            }
+
+            void print() const {
+                if (num_frames == 0) return;
+                std::cout << "occlusion: avg " << total_occluded / num_frames << " / ";
+                std::cout << total_tested / num_frames << " hidden, " << total_occluders / num_frames;
+                std::cout << " occluders (" << total_triangles / num_frames << " triangles), ";
+                std::cout << 1000.0 * total_seconds / num_frames << " ms" << std::endl;
+            }
+    };
+}
+
+#endif
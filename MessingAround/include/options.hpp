@@ -0,0 +1,545 @@
+#ifndef OPTIONS_HEADER_GUARD
+#define OPTIONS_HEADER_GUARD
+
+#include <iostream>
+#include <limits>
+#include <string>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+
+namespace options {
+
+    /*
+     The different ways the cube field can be drawn.
+
+       * PER_DRAW  => One model uniform and one glDrawArrays per cube.
+       * INSTANCED => All model matrices in an instance buffer and one
+                      glDrawArraysInstanced for the whole field.
+       * GPU_ANIMATED => The static instance parameters are uploaded once and
+                         the vertex shader does the rotation from a time uniform.
+    */
+    enum RenderMode {
+        PER_DRAW,
+        INSTANCED,
+        GPU_ANIMATED
+    };
+
+    /*
+     Whether (and where) to throw away cubes that are off screen.
+
+       * CULL_NONE => Draw everything.
+       * CULL_CPU  => Test a BVH of bounding spheres against the view frustum.
+       * CULL_GPU  => Test the bounding spheres in a compute shader and draw
+                      with glMultiDrawElementsIndirect (needs OpenGL 4.3).
+    */
+    enum CullMode {
+        CULL_NONE,
+        CULL_CPU,
+        CULL_GPU
+    };
+
+    /*
+     How the instanced mode gets its matrices to the GPU.
+
+       * UPLOAD_ORPHAN => glBufferData(NULL) to orphan then glBufferSubData.
+       * UPLOAD_RING   => Write into a persistently mapped ring buffer (or
+                          unsynchronised maps on plain 3.3).
+    */
+    enum UploadMode {
+        UPLOAD_ORPHAN,
+        UPLOAD_RING
+    };
+
+    /*
+     What draws the frames.
+
+       * RENDERER_GL   => OpenGL (whatever driver the context comes from).
+       * RENDERER_SOFT => The SSE tile rasteriser in softraster.hpp, GL is
+                          only used to show the result in a window.
+    */
+    enum Renderer {
+        RENDERER_GL,
+        RENDERER_SOFT
+    };
+
+    /*
+     Where the per-draw shapes (--shapes) keep their vertices.
+
+       * GEOMETRY_SEPARATE => A VAO, vertex and index buffer of their own each.
+       * GEOMETRY_POOL     => Sub-allocated from the shared buffers of a
+                              geometrypool::Pool, drawn from one VAO.
+    */
+    enum GeometryMode {
+        GEOMETRY_SEPARATE,
+        GEOMETRY_POOL
+    };
+
+    /*
+     A struct to hold everything that can be set from the command line.
+    */
+    struct Options {
+        RenderMode mode = PER_DRAW;
+        Renderer renderer = RENDERER_GL;
+        unsigned int num_cubes = 10;
+        uint64_t seed = 1;              // Everything random in the scene comes from this
+        std::string distribution = "uniform";
+        unsigned int num_static = 0;    // Cubes that never move, drawn from static batches
+        CullMode cull = CULL_NONE;
+        bool occlusion = false;         // Also cull cubes hidden behind others (with --cull cpu)
+        bool queue = false;
+        unsigned int num_shapes = 0;    // Different meshes the per-draw cubes cycle through, 0 => the plain cube
+        GeometryMode geometry = GEOMETRY_POOL;
+        unsigned int reshape = 0;       // Rebuild a shape every N frames, 0 => never
+        bool multidraw = false;         // Batch the pooled shapes into indirect multi-draws
+        bool threaded = false;
+        UploadMode upload = UPLOAD_ORPHAN;
+        unsigned int num_materials = 1;
+        std::string bench;
+        bool headless = false;
+        unsigned int frames = 0;        // 0 => until the window is closed (300 when headless)
+        unsigned int width = 1000;
+        unsigned int height = 1000;
+        std::string dump_dir;           // Where frames are captured to, empty => nowhere
+        std::string dump_format = "ppm";
+        bool gpu_timers = false;
+        std::string scene_file;         // A scene file to draw as well, empty => none
+        std::string save_scene_file;    // Where to write the generated cubes as a scene file, empty => don't
+        std::string path_file;          // A camera path to fly along, empty => the keyboard moves the camera
+        std::string record_file;        // Where to save the input log on exit, empty => no recording
+        std::string replay_file;        // An input log to play back instead of the keyboard and mouse
+        std::string trace_file;         // Where to write the CPU trace on exit, empty => no tracing
+        unsigned int lod = 0;           // How finely to tessellate the LOD cubes, 0 => no LOD
+        float lod_error = 1.0f;         // Screen space error (pixels) the LOD selection allows
+    };
+
+    /*
+     The name of a render mode as it is given on the command line.
+    */
+    std::string modeName(RenderMode mode) {
+        switch (mode) {
+            case PER_DRAW:     return "per-draw";
+            case INSTANCED:    return "instanced";
+            case GPU_ANIMATED: return "gpu-animated";
+        }
+        return "unknown";
+    }
+
+    /*
+     Will print the command line usage.
+    */
+    void printUsage(const char *exe) {
+        std::cout << "Usage: " << exe << " [options]\n";
+        std::cout << "  --mode <per-draw|instanced|gpu-animated>\n";
+        std::cout << "                                 How to draw the cubes (default per-draw)\n";
+        std::cout << "  --cubes <N>                    Number of cubes to draw, up to 10000000 (default 10)\n";
+        std::cout << "  --seed <N>                     Seed the scene is generated from (default 1)\n";
+        std::cout << "  --distribution <uniform|clustered|grid|shell>\n";
+        std::cout << "                                 How the cubes are spread out (default uniform)\n";
+        std::cout << "  --static <N>                   Also draw N cubes that never move, pre-transformed into\n";
+        std::cout << "                                 merged buffers (default 0)\n";
+        std::cout << "  --cull <none|cpu|gpu>          Frustum cull the cubes, cpu works with the per-draw\n";
+        std::cout << "                                 and instanced modes, gpu with gpu-animated (GL 4.3)\n";
+        std::cout << "  --occlusion                    Also cull cubes hidden behind the nearest ones, with a\n";
+        std::cout << "                                 software depth buffer (--cull cpu, instanced only)\n";
+        std::cout << "  --queue                        Sort the per-draw draws with a render queue\n";
+        std::cout << "  --shapes <1-8>                 Make the per-draw cubes cycle through N meshes of\n";
+        std::cout << "                                 different detail and roundness\n";
+        std::cout << "  --geometry <separate|pool>     Give each shape its own buffers, or share one\n";
+        std::cout << "                                 sub-allocated pool (default pool)\n";
+        std::cout << "  --reshape <N>                  Rebuild one of the shapes at another detail every N frames\n";
+        std::cout << "  --multidraw                    Draw the pooled shapes with one glMultiDrawElementsIndirect\n";
+        std::cout << "                                 per material (GL 4.3)\n";
+        std::cout << "  --materials <1-4>              How many textures the cubes cycle through (default 1)\n";
+        std::cout << "  --upload <orphan|ring>         How the instanced mode uploads its matrices\n";
+        std::cout << "  --renderer <gl|soft>           Draw with OpenGL or the software rasteriser, soft works\n";
+        std::cout << "                                 with the per-draw and instanced modes (default gl)\n";
+        std::cout << "  --threaded                     Run the simulation and rendering on their own threads\n";
+        std::cout << "  --headless                     Render off screen with EGL instead of opening a window\n";
+        std::cout << "  --frames <N>                   Stop after N frames (headless default 300)\n";
+        std::cout << "  --size <WxH>                   Resolution of the window or off screen target (default 1000x1000)\n";
+        std::cout << "  --dump <dir>                   Capture every frame to dir/frame_NNNNN.ppm, read back\n";
+        std::cout << "                                 asynchronously and written on encoder threads\n";
+        std::cout << "  --dump-format <ppm|png|y4m>    Write PPMs, PNGs or one dir/capture.y4m video (default ppm)\n";
+        std::cout << "  --gpu-timers                   Time the passes on the GPU and print the results on exit\n";
+        std::cout << "  --lod <N>                      Draw rounded cubes tessellated N times per edge, with\n";
+        std::cout << "                                 generated levels of detail (instanced only)\n";
+        std::cout << "  --lod-error <pixels>           Screen space error allowed when picking a level (default 1)\n";
+        std::cout << "  --scene <file>                 Also draw the instances of a binary scene file, memory\n";
+        std::cout << "                                 mapped and uploaded as they are\n";
+        std::cout << "  --save-scene <file>            Write the generated cubes to a scene file and exit\n";
+        std::cout << "  --path <file>                  Fly the camera along the keyframes in file (e.g.\n";
+        std::cout << "                                 data/flythrough.arr) and stop at the end of it\n";
+        std::cout << "  --record <file>                Record the keyboard, mouse and scroll input to a binary log\n";
+        std::cout << "  --replay <file>                Play a recorded input log back onto the same simulation steps\n";
+        std::cout << "                                 and stop at the end of it\n";
+        std::cout << "  --trace <file.json>            Record a CPU trace and write it as Chrome trace JSON on exit\n";
+        std::cout << "  --bench <transforms|frames|jobs|bvh|entities>\n";
+        std::cout << "                                 Time the transform builders on their own, draw --frames\n";
+        std::cout << "                                 frames (default 600) uncapped on a virtual clock, time\n";
+        std::cout << "                                 the job system on 1 to every core, refit the culling BVH\n";
+        std::cout << "                                 against rebuilding it, or check the entity handles\n";
+        std::cout << "                                 through creates and swap-removes\n";
+        std::cout << "  --help                         Print this message" << std::endl;
+    }
+
+    /*
+     Will read the value following a flag and complain if there isn't one.
+    */
+    std::string nextArg(int argc, char **argv, int &i) {
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for argument '" << argv[i] << "'" << std::endl;
+            throw "OptionsError";
+        }
+        i++;
+        return std::string(argv[i]);
+    }
+
+    /*
+     Will read a whole number, false unless the whole string is one (no sign,
+     no trailing junk) and it fits in max.
+    */
+    bool toUnsigned(const std::string &text, unsigned long long &value,
+                    unsigned long long max=std::numeric_limits<unsigned int>::max()) {
+        if (text.empty() || !std::isdigit((unsigned char) text[0])) return false;
+        char *end = NULL;
+        errno = 0;
+        value = std::strtoull(text.c_str(), &end, 10);
+        return errno == 0 && *end == '\0' && value <= max;
+    }
+
+    /*
+     Will read the value following a flag as a whole number and complain if it isn't one.
+    */
+    unsigned long long nextUnsigned(int argc, char **argv, int &i,
+                                    unsigned long long max=std::numeric_limits<unsigned int>::max()) {
+        std::string flag = argv[i];
+        std::string text = nextArg(argc, argv, i);
+        unsigned long long value;
+        if (!toUnsigned(text, value, max)) {
+            std::cerr << flag << " must be a whole number up to " << max << ", not '" << text << "'" << std::endl;
+            throw "OptionsError";
+        }
+        return value;
+    }
+
+    /*
+     Will read the value following a flag as a number and complain if it isn't one.
+    */
+    float nextFloat(int argc, char **argv, int &i) {
+        std::string flag = argv[i];
+        std::string text = nextArg(argc, argv, i);
+        char *end = NULL;
+        errno = 0;
+        float value = std::strtof(text.c_str(), &end);
+        if (text.empty() || errno != 0 || *end != '\0' || !std::isfinite(value)) {
+            std::cerr << flag << " must be a number, not '" << text << "'" << std::endl;
+            throw "OptionsError";
+        }
+        return value;
+    }
+
+    /*
+     Will parse the command line arguments into an Options struct.
+
+     Inputs:
+        * argc <int> => The number of arguments (as passed to main).
+        * argv <char **> => The arguments (as passed to main).
+    */
+    Options parse(int argc, char **argv) {
+        Options opts;
+
+        for (int i=1; i<argc; i++) {
+            std::string arg = argv[i];
+
+            if (arg == "--mode") {
+                std::string mode = nextArg(argc, argv, i);
+                if (mode == "per-draw")       opts.mode = PER_DRAW;
+                else if (mode == "instanced") opts.mode = INSTANCED;
+                else if (mode == "gpu-animated") opts.mode = GPU_ANIMATED;
+                else {
+                    std::cerr << "Unknown render mode '" << mode << "'" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--cubes") {
+                opts.num_cubes = nextUnsigned(argc, argv, i);
+                if (opts.num_cubes > 10000000) {
+                    std::cerr << "--cubes must be at most 10000000" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--seed") {
+                opts.seed = nextUnsigned(argc, argv, i, std::numeric_limits<uint64_t>::max());
+            }
+
+            else if (arg == "--distribution") {
+                opts.distribution = nextArg(argc, argv, i);
+                if (opts.distribution != "uniform" && opts.distribution != "clustered" &&
+                    opts.distribution != "grid" && opts.distribution != "shell") {
+                    std::cerr << "Unknown distribution '" << opts.distribution << "'" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--static") {
+                opts.num_static = nextUnsigned(argc, argv, i);
+            }
+
+            else if (arg == "--cull") {
+                std::string cull = nextArg(argc, argv, i);
+                if (cull == "none")     opts.cull = CULL_NONE;
+                else if (cull == "cpu") opts.cull = CULL_CPU;
+                else if (cull == "gpu") opts.cull = CULL_GPU;
+                else {
+                    std::cerr << "Unknown cull mode '" << cull << "'" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--occlusion") {
+                opts.occlusion = true;
+            }
+
+            else if (arg == "--queue") {
+                opts.queue = true;
+            }
+
+            else if (arg == "--shapes") {
+                opts.num_shapes = nextUnsigned(argc, argv, i);
+                if (opts.num_shapes < 1 || opts.num_shapes > 8) {
+                    std::cerr << "--shapes must be between 1 and 8" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--geometry") {
+                std::string geometry = nextArg(argc, argv, i);
+                if (geometry == "separate")  opts.geometry = GEOMETRY_SEPARATE;
+                else if (geometry == "pool") opts.geometry = GEOMETRY_POOL;
+                else {
+                    std::cerr << "Unknown geometry mode '" << geometry << "'" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--reshape") {
+                opts.reshape = nextUnsigned(argc, argv, i);
+            }
+
+            else if (arg == "--multidraw") {
+                opts.multidraw = true;
+            }
+
+            else if (arg == "--materials") {
+                opts.num_materials = nextUnsigned(argc, argv, i);
+                if (opts.num_materials < 1 || opts.num_materials > 4) {
+                    std::cerr << "--materials must be between 1 and 4" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--upload") {
+                std::string upload = nextArg(argc, argv, i);
+                if (upload == "orphan")    opts.upload = UPLOAD_ORPHAN;
+                else if (upload == "ring") opts.upload = UPLOAD_RING;
+                else {
+                    std::cerr << "Unknown upload mode '" << upload << "'" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--renderer") {
+                std::string renderer = nextArg(argc, argv, i);
+                if (renderer == "gl")        opts.renderer = RENDERER_GL;
+                else if (renderer == "soft") opts.renderer = RENDERER_SOFT;
+                else {
+                    std::cerr << "Unknown renderer '" << renderer << "'" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--threaded") {
+                opts.threaded = true;
+            }
+
+            else if (arg == "--headless") {
+                opts.headless = true;
+            }
+
+            else if (arg == "--frames") {
+                opts.frames = nextUnsigned(argc, argv, i);
+            }
+
+            else if (arg == "--size") {
+                std::string size = nextArg(argc, argv, i);
+                size_t x = size.find('x');
+                unsigned long long width = 0, height = 0;
+                if (x == std::string::npos || !toUnsigned(size.substr(0, x), width) ||
+                    !toUnsigned(size.substr(x + 1), height) || width == 0 || height == 0) {
+                    std::cerr << "--size should look like 1280x720, not '" << size << "'" << std::endl;
+                    throw "OptionsError";
+                }
+                opts.width = width;
+                opts.height = height;
+            }
+
+            else if (arg == "--dump") {
+                opts.dump_dir = nextArg(argc, argv, i);
+            }
+
+            else if (arg == "--dump-format") {
+                opts.dump_format = nextArg(argc, argv, i);
+                if (opts.dump_format != "ppm" && opts.dump_format != "png" && opts.dump_format != "y4m") {
+                    std::cerr << "Unknown dump format '" << opts.dump_format << "'" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--gpu-timers") {
+                opts.gpu_timers = true;
+            }
+
+            else if (arg == "--lod") {
+                opts.lod = nextUnsigned(argc, argv, i);
+            }
+
+            else if (arg == "--lod-error") {
+                opts.lod_error = nextFloat(argc, argv, i);
+                if (opts.lod_error <= 0.0f) {
+                    std::cerr << "--lod-error must be more than 0" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--scene") {
+                opts.scene_file = nextArg(argc, argv, i);
+            }
+
+            else if (arg == "--save-scene") {
+                opts.save_scene_file = nextArg(argc, argv, i);
+            }
+
+            else if (arg == "--path") {
+                opts.path_file = nextArg(argc, argv, i);
+            }
+
+            else if (arg == "--record") {
+                opts.record_file = nextArg(argc, argv, i);
+            }
+
+            else if (arg == "--replay") {
+                opts.replay_file = nextArg(argc, argv, i);
+            }
+
+            else if (arg == "--trace") {
+                opts.trace_file = nextArg(argc, argv, i);
+            }
+
+            else if (arg == "--bench") {
+                opts.bench = nextArg(argc, argv, i);
+                if (opts.bench != "transforms" && opts.bench != "frames" && opts.bench != "jobs" &&
+                    opts.bench != "bvh" && opts.bench != "entities") {
+                    std::cerr << "Unknown benchmark '" << opts.bench << "'" << std::endl;
+                    throw "OptionsError";
+                }
+            }
+
+            else if (arg == "--help") {
+                printUsage(argv[0]);
+                std::exit(0);
+            }
+
+            else {
+                std::cerr << "Unknown argument '" << arg << "'" << std::endl;
+                printUsage(argv[0]);
+                throw "OptionsError";
+            }
+        }
+
+        if (opts.cull == CULL_CPU && opts.mode == GPU_ANIMATED) {
+            std::cerr << "CPU culling needs the cube matrices on the CPU, ";
+            std::cerr << "use --mode per-draw or --mode instanced" << std::endl;
+            throw "OptionsError";
+        }
+        if (opts.upload == UPLOAD_RING && opts.mode != INSTANCED) {
+            std::cerr << "--upload ring is only used by --mode instanced" << std::endl;
+            throw "OptionsError";
+        }
+        if (opts.headless && opts.threaded) {
+            std::cerr << "--threaded needs a window to take input from, it can't be used with --headless" << std::endl;
+            throw "OptionsError";
+        }
+        if (opts.bench == "frames" && opts.threaded) {
+            std::cerr << "--bench frames times the single threaded loop, it can't be used with --threaded" << std::endl;
+            throw "OptionsError";
+        }
+        if ((!opts.record_file.empty() || !opts.replay_file.empty()) && opts.threaded) {
+            std::cerr << "--record and --replay step the input with the single threaded loop, ";
+            std::cerr << "they can't be used with --threaded" << std::endl;
+            throw "OptionsError";
+        }
+        if (!opts.record_file.empty() && (opts.headless || !opts.replay_file.empty())) {
+            std::cerr << "--record needs a window to take input from, ";
+            std::cerr << "it can't be used with --headless or --replay" << std::endl;
+            throw "OptionsError";
+        }
+        // A camera path or input log sets its own length
+        bool ownLength = !opts.path_file.empty() || !opts.replay_file.empty();
+        if (opts.bench == "frames" && opts.frames == 0 && !ownLength)
+            opts.frames = 600;
+        if (opts.headless && opts.frames == 0 && !ownLength)
+            opts.frames = 300;
+        if (opts.lod > 0 && opts.mode != INSTANCED) {
+            std::cerr << "--lod is only used by --mode instanced" << std::endl;
+            throw "OptionsError";
+        }
+        if (opts.occlusion && (opts.cull != CULL_CPU || opts.mode != INSTANCED)) {
+            std::cerr << "--occlusion needs --cull cpu and --mode instanced" << std::endl;
+            throw "OptionsError";
+        }
+        if (opts.renderer == RENDERER_SOFT) {
+            if (opts.mode == GPU_ANIMATED) {
+                std::cerr << "The software renderer needs the cube matrices on the CPU, ";
+                std::cerr << "use --mode per-draw or --mode instanced" << std::endl;
+                throw "OptionsError";
+            }
+            if (opts.threaded || opts.queue || opts.upload != UPLOAD_ORPHAN || opts.gpu_timers || !opts.scene_file.empty()) {
+                std::cerr << "--threaded, --queue, --upload, --gpu-timers and --scene only apply to --renderer gl" << std::endl;
+                throw "OptionsError";
+            }
+        }
+        if (opts.queue && opts.mode != PER_DRAW) {
+            std::cerr << "The render queue is only used by --mode per-draw" << std::endl;
+            throw "OptionsError";
+        }
+        if (opts.num_shapes > 0 && opts.mode != PER_DRAW) {
+            std::cerr << "--shapes is only used by --mode per-draw" << std::endl;
+            throw "OptionsError";
+        }
+        if (opts.reshape > 0 && opts.num_shapes == 0) {
+            std::cerr << "--reshape needs --shapes" << std::endl;
+            throw "OptionsError";
+        }
+        if (opts.multidraw && (opts.num_shapes == 0 || opts.geometry != GEOMETRY_POOL || opts.queue ||
+                               opts.renderer != RENDERER_GL)) {
+            std::cerr << "--multidraw needs --shapes with --geometry pool and --renderer gl, ";
+            std::cerr << "and replaces --queue" << std::endl;
+            throw "OptionsError";
+        }
+        if (opts.cull == CULL_GPU && opts.mode != GPU_ANIMATED) {
+            std::cerr << "GPU culling needs the instances on the GPU, ";
+            std::cerr << "use --mode gpu-animated" << std::endl;
+            throw "OptionsError";
+        }
+
+        return opts;
+    }
+}
+
+#endif
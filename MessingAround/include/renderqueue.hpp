@@ -0,0 +1,250 @@
+#ifndef RENDERQUEUE_HEADER_GUARD
+#define RENDERQUEUE_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <shaders.hpp>
+#include <timing.hpp>
+#include <trace.hpp>
+
+
+/*
+ A render queue that sorts draws to cut down on state changes.
+
+ Each draw is given a 64 bit sort key, the queue is radix sorted every frame
+ and then submitted in key order only touching the program, texture and VAO
+ when they actually change.
+
+ Key layout (most significant bits first):
+    63      => 1 for translucent draws so they go after all the opaque ones
+    62..51  => Program id
+    50..39  => Texture (material) id
+    38..27  => VAO id
+    26..3   => Depth, front-to-back for opaque and back-to-front for translucent
+    2..0    => Unused
+ Opaque draws are grouped by state first and then sorted roughly front to back
+ inside each group so early depth testing can throw fragments away.
+*/
+namespace renderqueue {
+
+    /*
+     Everything needed to submit a single draw.
+    */
+    struct DrawItem {
+        shader::Program *program;
+        unsigned int texture;
+        unsigned int VAO_handle;
+        unsigned int first;             // First vertex, or first index when indexed
+        unsigned int num_vertices;      // Or indices when indexed
+        glm::mat4 model;
+        bool indexed = false;           // glDrawElementsBaseVertex rather than glDrawArrays
+        int base_vertex = 0;
+    };
+
+    /*
+     Will issue the draw call for an item, its state must already be bound.
+    */
+    void issue(const DrawItem &item) {
+        if (item.indexed)
+            glDrawElementsBaseVertex(GL_TRIANGLES, item.num_vertices, GL_UNSIGNED_INT,
+                                     (void*)(item.first * sizeof(unsigned int)), item.base_vertex);
+        else
+            glDrawArrays(GL_TRIANGLES, item.first, item.num_vertices);
+    }
+
+    /*
+     Numbers from the last submitted frame.
+    */
+    struct Stats {
+        unsigned int num_items = 0;
+        unsigned int state_changes = 0;          // Program, texture and VAO binds when sorted
+        unsigned int unsorted_state_changes = 0; // The same if submitted in the order they were added
+        double sort_seconds = 0.0;
+    };
+
+    /*
+     Will sort (key, value) pairs by key with a least significant digit radix
+     sort, 8 bits at a time. Passes where every key has the same digit are skipped.
+    */
+    void radixSort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values,
+                   std::vector<uint64_t> &tmp_keys, std::vector<uint32_t> &tmp_values) {
+        size_t n = keys.size();
+        tmp_keys.resize(n);
+        tmp_values.resize(n);
+
+        // Count every digit of every key in a single pass
+        std::vector<size_t> counts(8 * 256, 0);
+        for (size_t i=0; i<n; i++) {
+            uint64_t k = keys[i];
+            for (unsigned int pass=0; pass<8; pass++)
+                counts[pass * 256 + ((k >> (8 * pass)) & 0xFF)]++;
+        }
+
+        for (unsigned int pass=0; pass<8; pass++) {
+            size_t *count = &counts[pass * 256];
+            unsigned int shift = 8 * pass;
+            if (count[(keys[0] >> shift) & 0xFF] == n) continue;
+
+            size_t offset = 0;
+            for (unsigned int d=0; d<256; d++) {
+                size_t c = count[d];
+                count[d] = offset;
+                offset += c;
+            }
+            for (size_t i=0; i<n; i++) {
+                size_t dst = count[(keys[i] >> shift) & 0xFF]++;
+                tmp_keys[dst] = keys[i];
+                tmp_values[dst] = values[i];
+            }
+            keys.swap(tmp_keys);
+            values.swap(tmp_values);
+        }
+    }
+
+    class Queue {
+        private:
+            std::vector<DrawItem> items;
+            std::vector<uint64_t> keys, tmp_keys;
+            std::vector<uint32_t> order, tmp_order;
+            std::map<unsigned int, uint64_t> program_ids, texture_ids, VAO_ids;
+
+            /*
+             Turns a GL handle into a small dense id for the key.
+            */
+            uint64_t idFor(std::map<unsigned int, uint64_t> &ids, unsigned int handle) {
+                std::map<unsigned int, uint64_t>::iterator it = ids.find(handle);
+                if (it != ids.end()) return it->second;
+                uint64_t id = ids.size() & 0xFFF;
+                ids[handle] = id;
+                return id;
+            }
+
+            /*
+             How many binds submitting the items in a given order needs.
+            */
+            unsigned int countStateChanges(const std::vector<uint32_t> &submit_order) const {
+                unsigned int changes = 0;
+                const DrawItem *last = NULL;
+                for (size_t i=0; i<submit_order.size(); i++) {
+                    const DrawItem &item = items[submit_order[i]];
+                    if (!last || item.program != last->program) changes++;
+                    if (!last || item.texture != last->texture) changes++;
+                    if (!last || item.VAO_handle != last->VAO_handle) changes++;
+                    last = &item;
+                }
+                return changes;
+            }
+
+        public:
+            float max_depth = 200.0f;
+            Stats stats;
+
+            /*
+             Empty the queue, ready for the next frame.
+            */
+            void clear() {
+                items.clear();
+                keys.clear();
+                order.clear();
+            }
+
+            /*
+             Add a draw to the queue.
+
+             Inputs:
+                * item <const DrawItem &> => The draw.
+                * depth <float> => The distance from the camera (view space, positive).
+                * translucent <bool> => Whether it needs blending (drawn last, back to front).
+            */
+            void add(const DrawItem &item, float depth, bool translucent=false) {
+                float d = depth / max_depth;
+                if (d < 0.0f) d = 0.0f;
+                if (d > 1.0f) d = 1.0f;
+                uint64_t depth_bits = (uint64_t) (d * 0xFFFFFF);
+                if (translucent) depth_bits = 0xFFFFFF - depth_bits;
+
+                uint64_t key = 0;
+                key |= (uint64_t) (translucent ? 1 : 0) << 63;
+                key |= idFor(program_ids, item.program->handle) << 51;
+                key |= idFor(texture_ids, item.texture) << 39;
+                key |= idFor(VAO_ids, item.VAO_handle) << 27;
+                key |= depth_bits << 3;
+
+                order.push_back(items.size());
+                keys.push_back(key);
+                items.push_back(item);
+            }
+
+            /*
+             Will sort the queue and issue every draw, only changing state when
+             the next draw needs something different.
+            */
+            void submit() {
+                TRACE_SCOPE("renderqueue::Queue::submit");
+                stats.num_items = items.size();
+                if (items.empty()) {
+                    stats.state_changes = stats.unsorted_state_changes = 0;
+                    return;
+                }
+
+                stats.unsorted_state_changes = countStateChanges(order);
+                timing::Stopwatch timer;
+                radixSort(keys, order, tmp_keys, tmp_order);
+                stats.sort_seconds = timer.seconds();
+                stats.state_changes = countStateChanges(order);
+
+                const DrawItem *last = NULL;
+                for (size_t i=0; i<order.size(); i++) {
+                    const DrawItem &item = items[order[i]];
+                    if (!last || item.program != last->program)
+                        item.program->use();
+                    if (!last || item.texture != last->texture) {
+                        glActiveTexture(GL_TEXTURE0);
+                        glBindTexture(GL_TEXTURE_2D, item.texture);
+                    }
+                    if (!last || item.VAO_handle != last->VAO_handle)
+                        glBindVertexArray(item.VAO_handle);
+
+                    item.program->set("model", item.model);
+                    issue(item);
+                    last = &item;
+                }
+            }
+    };
+
+    /*
+     Will average the per frame queue stats so they can be printed on exit.
+    */
+    class StatsAccumulator {
+        public:
+            unsigned long num_frames = 0;
+            double total_items = 0.0;
+            double total_changes = 0.0;
+            double total_unsorted_changes = 0.0;
+            double total_sort_seconds = 0.0;
+
+            void add(const Stats &s) {
+                num_frames++;
+                total_items += s.num_items;
+                total_changes += s.state_changes;
+                total_unsorted_changes += s.unsorted_state_changes;
+                total_sort_seconds += s.sort_seconds;
+            }
+
+            void print() const {
+                if (num_frames == 0) return;
+                std::cout << "queue: avg " << total_items / num_frames << " draws, sort ";
+                std::cout << 1000.0 * total_sort_seconds / num_frames << " ms, state changes ";
+                std::cout << total_unsorted_changes / num_frames << " unsorted -> ";
+                std::cout << total_changes / num_frames << " sorted" << std::endl;
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef RINGBUFFER_HEADER_GUARD
+#define RINGBUFFER_HEADER_GUARD
+
+#include <glad/glad.h>
+
+#include <iostream>
+
+#include <gl43.hpp>
+
+
+/*
+ A buffer for data that changes every frame (instance matrices, uniform
+ blocks, ...) that never makes the driver stall or copy.
+
+ With glBufferStorage (GL 4.4 or GL_ARB_buffer_storage) the buffer is mapped
+ once, persistently and coherently, and split into NUM_FRAMES regions. Each
+ frame writes into its own region and drops a fence at the end, the region is
+ only reused once that fence has signalled (i.e. the GPU is done with it).
+
+ On plain GL 3.3 each allocation is mapped with GL_MAP_UNSYNCHRONIZED_BIT
+ instead and appended after the last one, when the buffer fills up it is
+ orphaned (glBufferData with NULL) so the driver hands us fresh memory while
+ the GPU keeps reading the old copy.
+*/
+namespace ringbuffer {
+
+    const unsigned int NUM_FRAMES = 3;
+
+    /*
+     What a sub-allocation will be bound as, which decides its alignment.
+    */
+    enum Usage {
+        VERTEX,
+        UNIFORM,
+        STORAGE
+    };
+
+    /*
+     A piece of the ring for this frame. Write `size` bytes to `data` then call
+     Ring::commit, bind the ring's handle at `offset` to use it.
+    */
+    struct Allocation {
+        void *data = NULL;
+        size_t offset = 0;
+        size_t size = 0;
+    };
+
+    class Ring {
+        private:
+            GLsync fences[NUM_FRAMES] = {0, 0, 0};
+            unsigned char *mapped = NULL;
+            size_t offset = 0;          // Next free byte in the current region (or whole buffer)
+            size_t alignments[3] = {16, 256, 256};
+
+            size_t inline alignUp(size_t value, size_t alignment) const {
+                return (value + alignment - 1) / alignment * alignment;
+            }
+
+        public:
+            unsigned int handle = 0;
+            GLenum target = GL_ARRAY_BUFFER;
+            size_t region_size = 0;
+            unsigned int frame = 0;     // Which region is being written
+            bool persistent = false;
+            unsigned long num_stalls = 0;   // Times beginFrame had to wait for the GPU
+            unsigned long num_orphans = 0;  // Times the 3.3 fallback orphaned the buffer
+
+            /*
+             Will create the buffer.
+
+             Inputs:
+                * bytes_per_frame <size_t> => The most that will be allocated in one frame.
+                * use_storage <bool> => Whether glBufferStorage has been loaded (see gl43.hpp).
+            */
+            void create(size_t bytes_per_frame, bool use_storage) {
+                GLint align = 0;
+                glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+                if (align > 0) alignments[UNIFORM] = align;
+                if (gl43::hasVersion(4, 3)) {
+                    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &align);
+                    if (align > 0) alignments[STORAGE] = align;
+                }
+
+                // Leave room for the padding the alignments can add
+                region_size = alignUp(bytes_per_frame + 1024, 256);
+                persistent = use_storage && glBufferStorage != NULL;
+
+                glGenBuffers(1, &handle);
+                glBindBuffer(target, handle);
+                if (persistent) {
+                    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                    glBufferStorage(target, NUM_FRAMES * region_size, NULL, flags);
+                    mapped = (unsigned char*) glMapBufferRange(target, 0, NUM_FRAMES * region_size, flags);
+                    if (mapped == NULL) {
+                        std::cerr << "Failed to persistently map the ring buffer" << std::endl;
+                        throw "RingBufferError";
+                    }
+                } else {
+                    glBufferData(target, NUM_FRAMES * region_size, NULL, GL_STREAM_DRAW);
+                }
+                glBindBuffer(target, 0);
+            }
+
+            /*
+             Call before the first allocation of a frame. With persistent mapping
+             this waits (if it has to) until the GPU has finished with the region
+             this frame is about to overwrite.
+            */
+            void beginFrame() {
+                if (!persistent) return;
+
+                offset = 0;
+                GLsync &fence = fences[frame];
+                if (fence) {
+                    GLenum result = glClientWaitSync(fence, 0, 0);
+                    if (result == GL_TIMEOUT_EXPIRED) {
+                        num_stalls++;
+                        while (result == GL_TIMEOUT_EXPIRED)
+                            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+                    }
+                    glDeleteSync(fence);
+                    fence = 0;
+                }
+            }
+
+            /*
+             Call after the last draw that reads this frame's allocations.
+            */
+            void endFrame() {
+                if (!persistent) return;
+
+                fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                frame = (frame + 1) % NUM_FRAMES;
+            }
+
+            /*
+             Will grab `size` bytes aligned for `usage`.
+            */
+            Allocation allocate(size_t size, Usage usage=VERTEX) {
+                Allocation a;
+                a.size = size;
+                size_t alignment = alignments[usage];
+
+                if (persistent) {
+                    size_t start = alignUp(offset, alignment);
+                    if (start + size > region_size) {
+                        std::cerr << "Ring buffer region is full (" << region_size << " bytes)" << std::endl;
+                        throw "RingBufferError";
+                    }
+                    offset = start + size;
+                    a.offset = frame * region_size + start;
+                    a.data = mapped + a.offset;
+                    return a;
+                }
+
+                size_t total = NUM_FRAMES * region_size;
+                if (size > total) {
+                    std::cerr << "Allocation of " << size << " bytes is bigger than the ring buffer" << std::endl;
+                    throw "RingBufferError";
+                }
+                size_t start = alignUp(offset, alignment);
+                glBindBuffer(target, handle);
+                if (start + size > total) {
+                    // Out of room, orphan and start again at the beginning
+                    glBufferData(target, total, NULL, GL_STREAM_DRAW);
+                    num_orphans++;
+                    start = 0;
+                }
+                a.offset = start;
+                a.data = glMapBufferRange(target, start, size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT |
+                                                              GL_MAP_INVALIDATE_RANGE_BIT);
+                offset = start + size;
+                return a;
+            }
+
+            /*
+             Call once an allocation has been written. Only the 3.3 path has
+             anything to do (unmap), coherent mappings are visible straight away.
+            */
+            void commit(const Allocation &) {
+                if (persistent) return;
+                glBindBuffer(target, handle);
+                glUnmapBuffer(target);
+            }
+
+            void destroy() {
+                for (unsigned int i=0; i<NUM_FRAMES; i++) {
+                    if (fences[i]) glDeleteSync(fences[i]);
+                    fences[i] = 0;
+                }
+                if (persistent) {
+                    glBindBuffer(target, handle);
+                    glUnmapBuffer(target);
+                }
+                glDeleteBuffers(1, &handle);
+                handle = 0;
+            }
+    };
+}
+
+#endif
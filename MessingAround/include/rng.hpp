@@ -0,0 +1,93 @@
+#ifndef RNG_HEADER_GUARD
+#define RNG_HEADER_GUARD
+
+#include <cstdint>
+
+
+/*
+ A small, fast and seedable random number generator, so generated scenes
+ and benchmark inputs are the same on every run and every machine (rand()
+ is neither seeded here nor the same between C libraries).
+
+ The generator is xoshiro128** (Blackman and Vigna): four 32 bit words of
+ state, only adds, shifts, rotates and one multiply per number, so several
+ streams can live side by side in SIMD lanes. Streams are picked by a seed
+ and a stream number run through splitmix64, so every chunk of a scene can
+ have its own stream and be generated on any thread in any order.
+*/
+namespace rng {
+
+    /*
+     One step of splitmix64, used to spread a seed over the state.
+    */
+    uint64_t splitmix64(uint64_t &x) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    class Xoshiro128 {
+        private:
+            uint32_t s[4];
+
+            static uint32_t rotl(uint32_t x, int k) {
+                return (x << k) | (x >> (32 - k));
+            }
+
+        public:
+            /*
+             Constructor: Will seed the state.
+
+             Inputs:
+                * seed <uint64_t> => The run's seed.
+                * stream <uint64_t> => Which of the seed's independent streams.
+            */
+            Xoshiro128(uint64_t seed, uint64_t stream=0) {
+                uint64_t x = seed ^ (stream * 0xD1B54A32D192ED03ull);
+                uint64_t a = splitmix64(x), b = splitmix64(x);
+                s[0] = (uint32_t) a; s[1] = (uint32_t) (a >> 32);
+                s[2] = (uint32_t) b; s[3] = (uint32_t) (b >> 32);
+                if ((s[0] | s[1] | s[2] | s[3]) == 0) s[0] = 1;   // All zero would stay zero forever
+            }
+
+            uint32_t next() {
+                uint32_t result = rotl(s[1] * 5, 7) * 9;
+                uint32_t t = s[1] << 9;
+                s[2] ^= s[0];
+                s[3] ^= s[1];
+                s[1] ^= s[2];
+                s[0] ^= s[3];
+                s[2] ^= t;
+                s[3] = rotl(s[3], 11);
+                return result;
+            }
+
+            /*
+             A float in [0, 1), from the top 24 bits.
+            */
+            float uniform() {
+                return (next() >> 8) * (1.0f / 16777216.0f);
+            }
+
+            float uniform(float lo, float hi) {
+                return lo + (hi - lo) * uniform();
+            }
+
+            /*
+             A roughly normal float (mean 0, standard deviation 1) from the sum of
+             4 uniforms. Only adds and multiplies, so unlike Box-Muller it doesn't
+             depend on how the maths library rounds log and cos.
+            */
+            float normal() {
+                // One at a time, the order operands are evaluated in isn't fixed
+                float sum = uniform();
+                sum += uniform();
+                sum += uniform();
+                sum += uniform();
+                return (sum - 2.0f) * 1.7320508f;   // The sum's variance is 4/12
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,370 @@
+#ifndef SCENE_HEADER_GUARD
+#define SCENE_HEADER_GUARD
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <rng.hpp>
+#include <threads.hpp>
+#include <timing.hpp>
+#include <trace.hpp>
+#include <transforms.hpp>
+
+
+/*
+ The objects in the scene, stored entity-component style.
+
+ Every component is its own tightly packed array indexed by the entity's
+ slot, so a system only streams through the arrays it reads (animation
+ only touches speed and angle, the transform builder the position, axis,
+ angle and scale arrays, culling the bounds). Removing an entity moves the
+ last one into its slot so the arrays never have holes, and entities are
+ referred to by handles that stay valid however the slots move.
+
+ The arrays are walked in chunks of CHUNK_SIZE slots, which is how the
+ systems split the work across the thread pool.
+*/
+namespace scene {
+
+    const uint32_t INVALID = 0xFFFFFFFF;
+    const size_t CHUNK_SIZE = 4096;   // A multiple of 8 so the AVX2 loops never split a chunk
+
+    /*
+     A handle to an entity. The generation goes up every time a handle index
+     is reused, so a handle to a removed entity is never mistaken for a new one.
+    */
+    struct Entity {
+        uint32_t index = INVALID;
+        uint32_t generation = 0;
+    };
+
+    /*
+     What an entity is made from when it's added.
+    */
+    struct Desc {
+        glm::vec3 position = glm::vec3(0.0f);
+        float scale = 1.0f;
+        glm::vec3 axis = glm::vec3(0.0f, 1.0f, 0.0f);
+        float speed = 0.0f;          // Radians per second about the axis
+        uint32_t mesh = 0;
+        uint32_t material = 0;
+        float radius = 0.5f;         // Bounding sphere radius before scaling
+    };
+
+    class Store {
+        private:
+            std::vector<uint32_t> slot_of;      // Handle index => slot, INVALID when removed
+            std::vector<uint32_t> generations;  // Handle index => current generation
+            std::vector<uint32_t> free_indices;
+
+        public:
+            // Transform
+            std::vector<float> pos_x, pos_y, pos_z;
+            std::vector<float> scale;
+            // Rotation, the angle is written by animate
+            std::vector<float> axis_x, axis_y, axis_z;
+            std::vector<float> speed;
+            std::vector<float> angle;
+            // What to draw it with
+            std::vector<uint32_t> mesh;
+            std::vector<uint32_t> material;
+            // Bounds, a world space sphere kept as centres and radii for the culling structures
+            std::vector<glm::vec3> centre;
+            std::vector<float> radius;
+            // Slot => the handle index living there
+            std::vector<uint32_t> owner;
+
+            size_t size() const { return owner.size(); }
+
+            void reserve(size_t n) {
+                pos_x.reserve(n); pos_y.reserve(n); pos_z.reserve(n); scale.reserve(n);
+                axis_x.reserve(n); axis_y.reserve(n); axis_z.reserve(n); speed.reserve(n); angle.reserve(n);
+                mesh.reserve(n); material.reserve(n);
+                centre.reserve(n); radius.reserve(n);
+                owner.reserve(n);
+            }
+
+            /*
+             Will add an entity at the end of the arrays.
+
+             Inputs:
+                * desc <const Desc &> => Its components.
+            */
+            Entity create(const Desc &desc) {
+                Entity e;
+                if (!free_indices.empty()) {
+                    e.index = free_indices.back();
+                    free_indices.pop_back();
+                } else {
+                    e.index = slot_of.size();
+                    slot_of.push_back(INVALID);
+                    generations.push_back(0);
+                }
+                e.generation = generations[e.index];
+                slot_of[e.index] = size();
+                owner.push_back(e.index);
+
+                pos_x.push_back(desc.position.x);
+                pos_y.push_back(desc.position.y);
+                pos_z.push_back(desc.position.z);
+                scale.push_back(desc.scale);
+                axis_x.push_back(desc.axis.x);
+                axis_y.push_back(desc.axis.y);
+                axis_z.push_back(desc.axis.z);
+                speed.push_back(desc.speed);
+                angle.push_back(0.0f);
+                mesh.push_back(desc.mesh);
+                material.push_back(desc.material);
+                centre.push_back(desc.position);
+                radius.push_back(desc.radius * desc.scale);
+                return e;
+            }
+
+            /*
+             Will add n entities with default components in one go, to be filled
+             in afterwards (in parallel, say). Returns the first new slot.
+            */
+            size_t grow(size_t n) {
+                size_t first = size();
+                for (size_t i=0; i<n; i++) {
+                    uint32_t index;
+                    if (!free_indices.empty()) {
+                        index = free_indices.back();
+                        free_indices.pop_back();
+                    } else {
+                        index = slot_of.size();
+                        slot_of.push_back(INVALID);
+                        generations.push_back(0);
+                    }
+                    slot_of[index] = first + i;
+                    owner.push_back(index);
+                }
+
+                const Desc d;
+                size_t total = first + n;
+                pos_x.resize(total, d.position.x); pos_y.resize(total, d.position.y); pos_z.resize(total, d.position.z);
+                scale.resize(total, d.scale);
+                axis_x.resize(total, d.axis.x); axis_y.resize(total, d.axis.y); axis_z.resize(total, d.axis.z);
+                speed.resize(total, d.speed);
+                angle.resize(total, 0.0f);
+                mesh.resize(total, d.mesh);
+                material.resize(total, d.material);
+                centre.resize(total, d.position);
+                radius.resize(total, d.radius * d.scale);
+                return first;
+            }
+
+            /*
+             The handle of the entity in a slot.
+            */
+            Entity entity(uint32_t s) const {
+                Entity e;
+                e.index = owner[s];
+                e.generation = generations[e.index];
+                return e;
+            }
+
+            bool alive(Entity e) const {
+                return e.index < slot_of.size() && generations[e.index] == e.generation && slot_of[e.index] != INVALID;
+            }
+
+            /*
+             The slot an entity is in now (INVALID if it has been removed). Only
+             good until the next create or destroy.
+            */
+            uint32_t slot(Entity e) const {
+                return alive(e) ? slot_of[e.index] : INVALID;
+            }
+
+            /*
+             Will remove an entity, the last one moves into its slot.
+            */
+            void destroy(Entity e) {
+                if (!alive(e)) {
+                    std::cerr << "Tried to destroy entity " << e.index << " (generation " << e.generation;
+                    std::cerr << ") which doesn't exist" << std::endl;
+                    throw "SceneError";
+                }
+                uint32_t s = slot_of[e.index];
+                uint32_t last = size() - 1;
+                moveSlot(last, s);
+                slot_of[owner[s]] = s;
+
+                pos_x.pop_back(); pos_y.pop_back(); pos_z.pop_back(); scale.pop_back();
+                axis_x.pop_back(); axis_y.pop_back(); axis_z.pop_back(); speed.pop_back(); angle.pop_back();
+                mesh.pop_back(); material.pop_back();
+                centre.pop_back(); radius.pop_back();
+                owner.pop_back();
+
+                slot_of[e.index] = INVALID;
+                generations[e.index]++;
+                free_indices.push_back(e.index);
+            }
+
+            /*
+             Will move an entity, keeping its bounds with it.
+            */
+            void setPosition(Entity e, const glm::vec3 &position) {
+                if (!alive(e)) {
+                    std::cerr << "Tried to move entity " << e.index << " (generation " << e.generation;
+                    std::cerr << ") which doesn't exist" << std::endl;
+                    throw "SceneError";
+                }
+                uint32_t s = slot_of[e.index];
+                pos_x[s] = position.x; pos_y[s] = position.y; pos_z[s] = position.z;
+                centre[s] = position;
+            }
+
+            glm::vec3 position(uint32_t s) const {
+                return glm::vec3(pos_x[s], pos_y[s], pos_z[s]);
+            }
+
+            glm::vec3 axis(uint32_t s) const {
+                return glm::vec3(axis_x[s], axis_y[s], axis_z[s]);
+            }
+
+            size_t numChunks() const {
+                return (size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+            }
+
+            /*
+             Will call fn(begin, end) over every chunk of slots, spread over the
+             pool a few chunks at a time.
+            */
+            template <typename Fn>
+            void forEachChunk(threads::Pool &pool, Fn fn) const {
+                size_t n = size();
+                pool.parallelFor(numChunks(), 4, [&](size_t first, size_t last) {
+                    for (size_t c=first; c<last; c++)
+                        fn(c * CHUNK_SIZE, std::min(n, (c + 1) * CHUNK_SIZE));
+                });
+            }
+
+            /*
+             The animation system: turns every entity to where it is at a time.
+             The angle is wrapped to one turn, time * speed grows without bound
+             and the SIMD transform builders are only accurate for small angles.
+            */
+            void animate(float time, threads::Pool &pool) {
+                TRACE_SCOPE("scene::Store::animate");
+                const float turn = 6.28318530718f;
+                float *a = angle.data();
+                const float *s = speed.data();
+                forEachChunk(pool, [&](size_t begin, size_t end) {
+                    for (size_t i=begin; i<end; i++)
+                        a[i] = std::fmod(time * s[i], turn);
+                });
+            }
+
+            /*
+             The transform components as a batch for transforms::build, pointing
+             straight at the arrays (so only good until the next create or destroy).
+            */
+            transforms::Batch transformBatch() const {
+                transforms::Batch b;
+                b.pos_x = pos_x.data(); b.pos_y = pos_y.data(); b.pos_z = pos_z.data();
+                b.axis_x = axis_x.data(); b.axis_y = axis_y.data(); b.axis_z = axis_z.data();
+                b.angle = angle.data();
+                b.scale = scale.data();
+                b.count = size();
+                return b;
+            }
+
+        private:
+            void moveSlot(uint32_t from, uint32_t to) {
+                if (from == to) return;
+                pos_x[to] = pos_x[from]; pos_y[to] = pos_y[from]; pos_z[to] = pos_z[from];
+                scale[to] = scale[from];
+                axis_x[to] = axis_x[from]; axis_y[to] = axis_y[from]; axis_z[to] = axis_z[from];
+                speed[to] = speed[from];
+                angle[to] = angle[from];
+                mesh[to] = mesh[from];
+                material[to] = material[from];
+                centre[to] = centre[from];
+                radius[to] = radius[from];
+                owner[to] = owner[from];
+            }
+    };
+
+    /*
+     Will create a store full of entities, remove a random half of them (so
+     most of the survivors get swap-moved), move the survivors and then reuse
+     the freed handles, checking after every step that each live handle still
+     finds its own entity and each removed one is dead. Prints the time a
+     create and a destroy take.
+
+     Inputs:
+        * count <size_t> => How many entities to start with.
+    */
+    void benchmark(size_t count) {
+        rng::Xoshiro128 r(1);
+        Store store;
+        std::vector<Entity> handles(count);
+        std::vector<glm::vec3> expected(count);
+        std::vector<bool> live(count, true);
+
+        auto check = [&](const char *step) {
+            for (size_t h=0; h<handles.size(); h++) {
+                bool ok = store.alive(handles[h]) == live[h];
+                if (ok && live[h])
+                    ok = store.position(store.slot(handles[h])) == expected[h];
+                else if (ok)
+                    ok = store.slot(handles[h]) == INVALID;
+                if (!ok) {
+                    std::cerr << "Entity handle " << h << " is wrong after " << step << std::endl;
+                    throw "SceneError";
+                }
+            }
+        };
+
+        timing::Stopwatch timer;
+        for (size_t h=0; h<count; h++) {
+            Desc d;
+            d.position = expected[h] = glm::vec3((float) h, 0.0f, 0.0f);
+            handles[h] = store.create(d);
+        }
+        double create_seconds = timer.seconds();
+        check("creating");
+
+        size_t num_destroyed = 0;
+        timer.reset();
+        for (size_t h=0; h<count; h++) {
+            if (r.uniform() < 0.5f) {
+                store.destroy(handles[h]);
+                live[h] = false;
+                num_destroyed++;
+            }
+        }
+        double destroy_seconds = timer.seconds();
+        check("removing");
+
+        for (size_t h=0; h<count; h++) {
+            if (!live[h]) continue;
+            expected[h].y = (float) h;
+            store.setPosition(handles[h], expected[h]);
+        }
+        check("moving");
+
+        // The freed indices come back with a new generation, the old handles must stay dead
+        for (size_t n=0; n<num_destroyed; n++) {
+            Desc d;
+            d.position = glm::vec3(0.0f, 0.0f, (float) n);
+            handles.push_back(store.create(d));
+            expected.push_back(d.position);
+            live.push_back(true);
+        }
+        check("reusing the handles");
+
+        std::cout << "Entities: " << count << " created, " << num_destroyed << " removed, ";
+        std::cout << num_destroyed << " created again, every handle checked after each step" << std::endl;
+        std::cout << "  create   " << 1e9 * create_seconds / count << " ns" << std::endl;
+        std::cout << "  destroy  " << 1e9 * destroy_seconds / std::max<size_t>(num_destroyed, 1) << " ns" << std::endl;
+    }
+}
+
+#endif
@@ -0,0 +1,521 @@
+#ifndef SCENEFILE_HEADER_GUARD
+#define SCENEFILE_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <culling.hpp>
+#include <mesh.hpp>
+#include <trace.hpp>
+
+
+/*
+ A compact binary scene file, laid out so it can be memory mapped and used
+ where it lies: no parsing per instance, the instance table goes straight
+ into a vertex buffer.
+
+ The file is (every section starting on a 16 byte boundary):
+    Header
+    Instance[num_instances]     => Sorted by mesh, material and grid cell
+    Chunk[num_chunks]           => The spatial index, one contiguous range of instances each
+    Ref[num_meshes + num_textures]
+                                => Names of the meshes, then of the textures, in the name blob
+    char[names_size]            => The name blob
+
+ Everything is stored in the writing machine's byte order, the header's
+ byte_order field catches a file moved to a machine of the other one.
+*/
+namespace scenefile {
+
+    const uint32_t VERSION = 1;
+    const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    struct Header {
+        char magic[4];                  // "MASC"
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t num_instances;
+        uint32_t num_meshes;
+        uint32_t num_textures;
+        uint32_t num_chunks;
+        float cell_size;
+        uint64_t instances_offset;
+        uint64_t chunks_offset;
+        uint64_t refs_offset;
+        uint64_t names_offset;
+        uint64_t names_size;
+        uint64_t file_size;
+    };
+
+    /*
+     One object. The position and scale, then the rotation, are the two vec4
+     attributes src/sceneShader.vert reads.
+    */
+    struct Instance {
+        glm::vec3 position;
+        float scale;
+        glm::vec4 rotation;             // Unit quaternion (x, y, z, w)
+        uint32_t mesh;
+        uint32_t material;
+    };
+
+    /*
+     A range of instances with one mesh and material, inside one grid cell.
+    */
+    struct Chunk {
+        glm::vec3 bmin;                 // Of the instances' bounding spheres
+        uint32_t first;
+        glm::vec3 bmax;
+        uint32_t count;
+        uint32_t mesh;
+        uint32_t material;
+        uint32_t padding[2];
+    };
+
+    struct Ref {
+        uint32_t name_offset;
+        uint32_t name_length;
+    };
+
+    static_assert(sizeof(Header) == 80, "The scene file header must be packed");
+    static_assert(sizeof(Instance) == 40, "Scene file instances must be packed");
+    static_assert(sizeof(Chunk) == 48, "Scene file chunks must be packed");
+
+    uint64_t alignUp(uint64_t x) {
+        return (x + 15) & ~(uint64_t) 15;
+    }
+
+    /*
+     Everything that goes into a file.
+    */
+    struct Contents {
+        std::vector<Instance> instances;
+        std::vector<std::string> meshes;
+        std::vector<float> mesh_radii;      // Bounding sphere of each mesh before scaling
+        std::vector<std::string> textures;
+    };
+
+    /*
+     Will sort the instances into chunks and write the file, returning its size in bytes.
+
+     Inputs:
+        * filepath <std::string> => Where to write it.
+        * contents <const Contents &> => The instances and what they reference.
+        * cell_size <float> => Width of the grid cells the chunks are split by.
+    */
+    size_t write(const std::string &filepath, const Contents &contents, float cell_size=16.0f) {
+        TRACE_SCOPE("scenefile::write");
+        const std::vector<Instance> &instances = contents.instances;
+        if (contents.mesh_radii.size() != contents.meshes.size()) {
+            std::cerr << "Scene file has " << contents.meshes.size() << " meshes but ";
+            std::cerr << contents.mesh_radii.size() << " mesh radii" << std::endl;
+            throw "SceneFileError";
+        }
+        for (size_t i=0; i<instances.size(); i++) {
+            if (instances[i].mesh >= contents.meshes.size() || instances[i].material >= contents.textures.size()) {
+                std::cerr << "Scene file instance " << i << " references mesh " << instances[i].mesh;
+                std::cerr << " / texture " << instances[i].material << " which doesn't exist" << std::endl;
+                throw "SceneFileError";
+            }
+        }
+
+        // Sort by (mesh, material, cell) so every chunk is one contiguous range
+        struct Key {
+            uint32_t mesh, material;
+            glm::ivec3 cell;
+            uint32_t index;
+            bool operator<(const Key &o) const {
+                if (mesh != o.mesh) return mesh < o.mesh;
+                if (material != o.material) return material < o.material;
+                if (cell.x != o.cell.x) return cell.x < o.cell.x;
+                if (cell.y != o.cell.y) return cell.y < o.cell.y;
+                if (cell.z != o.cell.z) return cell.z < o.cell.z;
+                return index < o.index;
+            }
+        };
+        std::vector<Key> keys(instances.size());
+        for (size_t i=0; i<instances.size(); i++) {
+            keys[i].mesh = instances[i].mesh;
+            keys[i].material = instances[i].material;
+            keys[i].cell = glm::ivec3(glm::floor(instances[i].position / cell_size));
+            keys[i].index = i;
+        }
+        std::sort(keys.begin(), keys.end());
+
+        std::vector<Chunk> chunks;
+        for (size_t k=0; k<keys.size(); k++) {
+            const Key &key = keys[k];
+            if (k == 0 || key.mesh != keys[k - 1].mesh || key.material != keys[k - 1].material ||
+                key.cell != keys[k - 1].cell) {
+                Chunk c;
+                std::memset(&c, 0, sizeof(c));
+                c.bmin = glm::vec3(1e30f);
+                c.bmax = glm::vec3(-1e30f);
+                c.first = k;
+                c.mesh = key.mesh;
+                c.material = key.material;
+                chunks.push_back(c);
+            }
+            const Instance &inst = instances[key.index];
+            float r = contents.mesh_radii[inst.mesh] * inst.scale;
+            Chunk &c = chunks.back();
+            c.bmin = glm::min(c.bmin, inst.position - r);
+            c.bmax = glm::max(c.bmax, inst.position + r);
+            c.count++;
+        }
+
+        std::vector<Ref> refs;
+        std::string names;
+        for (const std::vector<std::string> *list : {&contents.meshes, &contents.textures}) {
+            for (const std::string &name : *list) {
+                Ref r;
+                r.name_offset = names.size();
+                r.name_length = name.size();
+                refs.push_back(r);
+                names += name;
+            }
+        }
+
+        Header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, "MASC", 4);
+        h.version = VERSION;
+        h.byte_order = BYTE_ORDER_MARK;
+        h.num_instances = instances.size();
+        h.num_meshes = contents.meshes.size();
+        h.num_textures = contents.textures.size();
+        h.num_chunks = chunks.size();
+        h.cell_size = cell_size;
+        h.instances_offset = alignUp(sizeof(Header));
+        h.chunks_offset = alignUp(h.instances_offset + instances.size() * sizeof(Instance));
+        h.refs_offset = alignUp(h.chunks_offset + chunks.size() * sizeof(Chunk));
+        h.names_offset = alignUp(h.refs_offset + refs.size() * sizeof(Ref));
+        h.names_size = names.size();
+        h.file_size = h.names_offset + h.names_size;
+
+        FILE *file = fopen(filepath.c_str(), "wb");
+        bool ok = file != NULL;
+        uint64_t written = 0;
+        auto put = [&](const void *data, size_t size) {
+            ok = ok && (size == 0 || fwrite(data, 1, size, file) == size);
+            written += size;
+        };
+        auto padTo = [&](uint64_t offset) {
+            static const char zeros[16] = {0};
+            put(zeros, offset - written);
+        };
+
+        put(&h, sizeof(h));
+        padTo(h.instances_offset);
+        // In blocks, so a big scene isn't copied twice
+        std::vector<Instance> block;
+        for (size_t k=0; k<keys.size(); k+=4096) {
+            block.clear();
+            for (size_t j=k; j<std::min(keys.size(), k + 4096); j++)
+                block.push_back(instances[keys[j].index]);
+            put(block.data(), block.size() * sizeof(Instance));
+        }
+        padTo(h.chunks_offset);
+        put(chunks.data(), chunks.size() * sizeof(Chunk));
+        padTo(h.refs_offset);
+        put(refs.data(), refs.size() * sizeof(Ref));
+        padTo(h.names_offset);
+        put(names.data(), names.size());
+
+        if (!ok) {
+            std::cerr << "Failed to write the scene file '" << filepath << "'" << std::endl;
+            if (file != NULL) fclose(file);
+            throw "SceneFileError";
+        }
+        fclose(file);
+        return h.file_size;
+    }
+
+    /*
+     A scene file mapped into memory. The instance and chunk tables point
+     straight into the mapping, only the few names are copied out.
+    */
+    class File {
+        private:
+            void *base = NULL;
+            size_t length = 0;
+
+            void corrupt(const std::string &filepath, const std::string &what) {
+                std::cerr << "The scene file '" << filepath << "' is cut short or corrupt (" << what << ")" << std::endl;
+                close();
+                throw "SceneFileError";
+            }
+
+            bool fits(uint64_t offset, uint64_t size) const {
+                return offset % 16 == 0 && offset <= length && size <= length - offset;
+            }
+
+        public:
+            const Header *header = NULL;
+            const Instance *instances = NULL;
+            const Chunk *chunks = NULL;
+            std::vector<std::string> meshes;
+            std::vector<std::string> textures;
+
+            File() { }
+            File(const File&) = delete;
+            File &operator=(const File&) = delete;
+            ~File() { close(); }
+
+            bool isOpen() const { return base != NULL; }
+            size_t numInstances() const { return header ? header->num_instances : 0; }
+            size_t numChunks() const { return header ? header->num_chunks : 0; }
+            size_t numBytes() const { return length; }
+
+            /*
+             Will map a file written by write and check its tables hang together.
+             Only the chunks are checked, the instances are never looked at.
+
+             Inputs:
+                * filepath <std::string> => The scene file.
+            */
+            void open(const std::string &filepath) {
+                TRACE_SCOPE("scenefile::File::open");
+                close();
+                int fd = ::open(filepath.c_str(), O_RDONLY);
+                struct stat st;
+                if (fd < 0 || fstat(fd, &st) != 0) {
+                    std::cerr << "Failed to open the scene file '" << filepath << "'" << std::endl;
+                    if (fd >= 0) ::close(fd);
+                    throw "SceneFileError";
+                }
+                length = st.st_size;
+                if (length >= sizeof(Header))
+                    base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                ::close(fd);   // The mapping keeps the file alive
+                if (base == MAP_FAILED) base = NULL;
+                if (base == NULL || std::memcmp(base, "MASC", 4) != 0 ||
+                    ((const Header *) base)->version != VERSION) {
+                    std::cerr << "'" << filepath << "' isn't a version " << VERSION << " scene file" << std::endl;
+                    close();
+                    throw "SceneFileError";
+                }
+
+                header = (const Header *) base;
+                const char *bytes = (const char *) base;
+                if (header->byte_order != BYTE_ORDER_MARK)
+                    corrupt(filepath, "written on a machine of the other byte order");
+                if (header->file_size != length)
+                    corrupt(filepath, "header says " + std::to_string(header->file_size) + " bytes");
+                if (!fits(header->instances_offset, (uint64_t) header->num_instances * sizeof(Instance)) ||
+                    !fits(header->chunks_offset, (uint64_t) header->num_chunks * sizeof(Chunk)) ||
+                    !fits(header->refs_offset, ((uint64_t) header->num_meshes + header->num_textures) * sizeof(Ref)) ||
+                    header->names_offset > length || header->names_size > length - header->names_offset)
+                    corrupt(filepath, "a table runs off the end");
+                instances = (const Instance *) (bytes + header->instances_offset);
+                chunks = (const Chunk *) (bytes + header->chunks_offset);
+
+                for (size_t c=0; c<header->num_chunks; c++) {
+                    const Chunk &chunk = chunks[c];
+                    if ((uint64_t) chunk.first + chunk.count > header->num_instances ||
+                        chunk.mesh >= header->num_meshes || chunk.material >= header->num_textures)
+                        corrupt(filepath, "chunk " + std::to_string(c));
+                }
+
+                const Ref *refs = (const Ref *) (bytes + header->refs_offset);
+                const char *names = bytes + header->names_offset;
+                meshes.clear();
+                textures.clear();
+                for (size_t r=0; r<header->num_meshes + header->num_textures; r++) {
+                    if ((uint64_t) refs[r].name_offset + refs[r].name_length > header->names_size)
+                        corrupt(filepath, "reference " + std::to_string(r));
+                    std::string name(names + refs[r].name_offset, refs[r].name_length);
+                    (r < header->num_meshes ? meshes : textures).push_back(name);
+                }
+            }
+
+            void close() {
+                if (base != NULL) munmap(base, length);
+                base = NULL;
+                length = 0;
+                header = NULL;
+                instances = NULL;
+                chunks = NULL;
+            }
+    };
+
+    /*
+     Numbers from the last frame.
+    */
+    struct Stats {
+        unsigned int num_chunks = 0;
+        unsigned int num_visible = 0;
+        unsigned int num_draws = 0;
+        unsigned int num_instances = 0;
+    };
+
+    /*
+     Draws a mapped file: the instance table is uploaded once as it is, and
+     every visible run of chunks is one instanced draw of its mesh.
+
+     Attribute layout (all with a divisor of 1):
+        * location 2 => vec4 position and scale
+        * location 3 => vec4 rotation
+    */
+    class Layer {
+        public:
+            const File *file = NULL;
+            std::vector<mesh::GLMesh> meshes;
+            std::vector<unsigned int> textures;
+            unsigned int instance_buffer = 0;
+            std::vector<unsigned int> visible;  // Chunks that passed the last cull
+            Stats stats;
+
+            /*
+             Will point a mesh's instance attributes at an instance in the buffer
+             (GL 3.3 has no base instance, so each draw moves them instead).
+            */
+            void bindInstances(unsigned int m, size_t first) {
+                glBindVertexArray(meshes[m].VAO_handle);
+                glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+                size_t offset = first * sizeof(Instance);
+                glEnableVertexAttribArray(2);
+                glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                                      (void*)(offset + offsetof(Instance, position)));
+                glVertexAttribDivisor(2, 1);
+                glEnableVertexAttribArray(3);
+                glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                                      (void*)(offset + offsetof(Instance, rotation)));
+                glVertexAttribDivisor(3, 1);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }
+
+            /*
+             Will upload the file's instance table and the meshes it references.
+
+             Inputs:
+                * f <const File &> => The mapped file, it must stay open while the layer is drawn.
+                * mesh_list <const std::vector<mesh::Mesh> &> => A mesh for each of the file's mesh names.
+                * texture_list <const std::vector<unsigned int> &> => A texture for each of its texture names.
+            */
+            void create(const File &f, const std::vector<mesh::Mesh> &mesh_list,
+                        const std::vector<unsigned int> &texture_list) {
+                TRACE_SCOPE("scenefile::Layer::create");
+                file = &f;
+                textures = texture_list;
+
+                // Straight from the mapping, the pages are read in as the driver copies them
+                glGenBuffers(1, &instance_buffer);
+                glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+                glBufferData(GL_ARRAY_BUFFER, f.numInstances() * sizeof(Instance), f.instances, GL_STATIC_DRAW);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+                meshes.resize(mesh_list.size());
+                for (size_t m=0; m<mesh_list.size(); m++) {
+                    meshes[m].create(mesh_list[m]);
+                    bindInstances(m, 0);
+                }
+                glBindVertexArray(0);
+
+                visible.resize(f.numChunks());
+                for (size_t c=0; c<visible.size(); c++)
+                    visible[c] = c;
+                stats.num_chunks = f.numChunks();
+            }
+
+            /*
+             Will keep only the chunks whose box touches the frustum.
+            */
+            void cull(const culling::Frustum &f) {
+                culling::cullChunks(f, file->chunks, file->numChunks(), visible);
+            }
+
+            /*
+             Will walk the visible chunks as runs of neighbouring instances that
+             share a mesh and material, so each run is one draw.
+
+             Inputs:
+                * fn <function> => Called as fn(chunk, first_instance, num_instances) for each run,
+                                   the chunk holding the run's mesh and material.
+            */
+            void forEachRun(const std::function<void(const Chunk &, unsigned int, unsigned int)> &fn) {
+                stats.num_visible = visible.size();
+                stats.num_draws = 0;
+                stats.num_instances = 0;
+                culling::forEachChunkRun(file->chunks, visible, [](const Chunk &first, const Chunk &next) {
+                    return next.mesh == first.mesh && next.material == first.material;
+                }, [&](size_t begin, size_t end) {
+                    unsigned int count = 0;
+                    for (size_t c=begin; c<end; c++)
+                        count += file->chunks[c].count;
+
+                    fn(file->chunks[begin], file->chunks[begin].first, count);
+                    stats.num_draws++;
+                    stats.num_instances += count;
+                });
+            }
+
+            /*
+             Will draw the visible chunks. The bound program should be src/sceneShader.vert's.
+            */
+            void draw() {
+                unsigned int bound = (unsigned int) -1;
+                forEachRun([&](const Chunk &chunk, unsigned int first, unsigned int count) {
+                    if (chunk.material != bound) {
+                        glBindTexture(GL_TEXTURE_2D, textures[chunk.material]);
+                        bound = chunk.material;
+                    }
+                    bindInstances(chunk.mesh, first);
+                    glDrawElementsInstanced(GL_TRIANGLES, meshes[chunk.mesh].num_indices, GL_UNSIGNED_INT, 0, count);
+                });
+                glBindVertexArray(0);
+            }
+
+            void destroy() {
+                for (mesh::GLMesh &m : meshes)
+                    m.destroy();
+                meshes.clear();
+                glDeleteBuffers(1, &instance_buffer);
+                instance_buffer = 0;
+            }
+    };
+
+    /*
+     Will average the per frame stats so they can be printed on exit.
+    */
+    class StatsAccumulator {
+        public:
+            unsigned long num_frames = 0;
+            unsigned int num_chunks = 0;
+            double total_visible = 0.0;
+            double total_draws = 0.0;
+            double total_instances = 0.0;
+
+            void add(const Stats &s) {
+                num_frames++;
+                num_chunks = s.num_chunks;
+                total_visible += s.num_visible;
+                total_draws += s.num_draws;
+                total_instances += s.num_instances;
+            }
+
+            void print() const {
+                if (num_frames == 0) return;
+                std::cout << "scene file: avg " << total_visible / num_frames << " / " << num_chunks;
+                std::cout << " chunks visible, " << total_draws / num_frames << " draws, ";
+                std::cout << total_instances / num_frames << " instances" << std::endl;
+            }
+    };
+}
+
+#endif
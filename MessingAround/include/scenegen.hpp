@@ -0,0 +1,168 @@
+#ifndef SCENEGEN_HEADER_GUARD
+#define SCENEGEN_HEADER_GUARD
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <rng.hpp>
+#include <scene.hpp>
+#include <threads.hpp>
+#include <trace.hpp>
+
+
+/*
+ Generates the spinning cubes from a seed, so a benchmark sees the same
+ scene on every run and every machine.
+
+ Each chunk of scene::CHUNK_SIZE cubes draws from its own random stream
+ (the seed and the chunk number), so the chunks can be generated on any
+ thread in any order and still come out the same. The positions follow
+ one of a few distributions, all inside a cube `extent` wide around the
+ origin:
+
+   * UNIFORM   => Anywhere in the box.
+   * CLUSTERED => Normally scattered around a few dozen random centres.
+   * GRID      => On a regular lattice filling the box (no two overlapping
+                  until there are about 125000 of them).
+   * SHELL     => On a thin spherical shell, empty in the middle.
+*/
+namespace scenegen {
+
+    enum Distribution {
+        UNIFORM,
+        CLUSTERED,
+        GRID,
+        SHELL
+    };
+
+    // Streams past any chunk number, for the things that aren't per chunk
+    const uint64_t CLUSTER_STREAM = 1ull << 40;
+    const uint64_t STATIC_STREAM = (1ull << 40) + 1;
+
+    std::string distributionName(Distribution d) {
+        switch (d) {
+            case UNIFORM:   return "uniform";
+            case CLUSTERED: return "clustered";
+            case GRID:      return "grid";
+            case SHELL:     return "shell";
+        }
+        return "unknown";
+    }
+
+    Distribution distributionFromName(const std::string &name) {
+        if (name == "uniform")   return UNIFORM;
+        if (name == "clustered") return CLUSTERED;
+        if (name == "grid")      return GRID;
+        if (name == "shell")     return SHELL;
+        std::cerr << "Unknown scene distribution '" << name << "'" << std::endl;
+        throw "SceneGenError";
+    }
+
+    struct Params {
+        size_t count = 10;
+        uint64_t seed = 1;
+        Distribution distribution = UNIFORM;
+        float extent = 50.0f;
+        unsigned int num_clusters = 64;
+        float max_speed = 10.0f;             // The axis components (and speed) go up to this
+        unsigned int num_meshes = 1;         // Cube i gets mesh i % num_meshes...
+        unsigned int num_materials = 1;      // ...and material i % num_materials
+        float radius = 0.5f * sqrtf(3.0f);   // Half the diagonal of a unit cube bounds it whatever its rotation
+    };
+
+    /*
+     The smallest whole number whose cube is at least n.
+    */
+    size_t gridSide(size_t n) {
+        size_t side = (size_t) std::cbrt((double) n);
+        while (side * side * side < n) side++;
+        while (side > 1 && (side - 1) * (side - 1) * (side - 1) >= n) side--;
+        return side;
+    }
+
+    /*
+     Will add params.count cubes to the store, spread over the pool.
+
+     Inputs:
+        * store <scene::Store &> => Where the cubes go (after anything already there).
+        * params <const Params &> => How many, which seed and how to place them.
+        * pool <threads::Pool &> => The chunks are generated across it.
+    */
+    void generate(scene::Store &store, const Params &params, threads::Pool &pool) {
+        TRACE_SCOPE("scenegen::generate");
+        size_t first = store.grow(params.count);
+        float half = 0.5f * params.extent;
+
+        std::vector<glm::vec3> clusters;
+        if (params.distribution == CLUSTERED) {
+            rng::Xoshiro128 r(params.seed, CLUSTER_STREAM);
+            clusters.resize(params.num_clusters);
+            for (glm::vec3 &c : clusters) {
+                // Keep the clusters' spread (about 3 sigma) inside the box
+                c.x = r.uniform(-0.85f * half, 0.85f * half);
+                c.y = r.uniform(-0.85f * half, 0.85f * half);
+                c.z = r.uniform(-0.85f * half, 0.85f * half);
+            }
+        }
+        float sigma = 0.04f * params.extent;
+        size_t side = params.distribution == GRID ? gridSide(params.count) : 1;
+        float spacing = params.extent / side;
+
+        size_t num_chunks = (params.count + scene::CHUNK_SIZE - 1) / scene::CHUNK_SIZE;
+        pool.parallelFor(num_chunks, 1, [&](size_t chunk_begin, size_t chunk_end) {
+            for (size_t c=chunk_begin; c<chunk_end; c++) {
+                rng::Xoshiro128 r(params.seed, c);
+                size_t end = std::min(params.count, (c + 1) * scene::CHUNK_SIZE);
+                for (size_t i=c * scene::CHUNK_SIZE; i<end; i++) {
+                    // Every draw is its own statement, the order arguments are evaluated in isn't fixed
+                    glm::vec3 p;
+                    if (params.distribution == UNIFORM) {
+                        p.x = r.uniform(-half, half);
+                        p.y = r.uniform(-half, half);
+                        p.z = r.uniform(-half, half);
+                    } else if (params.distribution == CLUSTERED) {
+                        const glm::vec3 &centre = clusters[std::min((size_t) (r.uniform() * clusters.size()),
+                                                                    clusters.size() - 1)];
+                        p.x = centre.x + sigma * r.normal();
+                        p.y = centre.y + sigma * r.normal();
+                        p.z = centre.z + sigma * r.normal();
+                    } else if (params.distribution == GRID) {
+                        p.x = -half + (i % side + 0.5f) * spacing;
+                        p.y = -half + ((i / side) % side + 0.5f) * spacing;
+                        p.z = -half + (i / (side * side) + 0.5f) * spacing;
+                    } else {
+                        // A direction by rejection from the unit ball (no trig, so no libm rounding)
+                        float d2;
+                        do {
+                            p.x = r.uniform(-1.0f, 1.0f);
+                            p.y = r.uniform(-1.0f, 1.0f);
+                            p.z = r.uniform(-1.0f, 1.0f);
+                            d2 = glm::dot(p, p);
+                        } while (d2 > 1.0f || d2 < 1e-6f);
+                        float thickness = r.uniform(0.0f, 0.05f);
+                        p *= half * (1.0f - thickness) / std::sqrt(d2);
+                    }
+
+                    uint32_t s = first + i;
+                    store.pos_x[s] = p.x; store.pos_y[s] = p.y; store.pos_z[s] = p.z;
+                    store.centre[s] = p;
+                    store.axis_x[s] = r.uniform(0.0f, params.max_speed);
+                    store.axis_y[s] = r.uniform(0.0f, params.max_speed);
+                    store.axis_z[s] = r.uniform(0.0f, params.max_speed);
+                    store.speed[s] = store.axis_x[s];
+                    store.scale[s] = 1.0f;
+                    store.radius[s] = params.radius;
+                    store.mesh[s] = i % params.num_meshes;
+                    store.material[s] = i % params.num_materials;
+                }
+            }
+        });
+    }
+}
+
+#endif
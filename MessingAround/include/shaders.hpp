@@ -8,6 +8,7 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <files.hpp>
+#include <trace.hpp>
 #include <iostream>
 
 namespace shader {
@@ -65,6 +66,7 @@ namespace shader {
                     * shader_type <GLenum> => The type of shader to compile.
             */
             SingleShader (std::string fp, GLenum shader_type) {
+                TRACE_SCOPE("shader::SingleShader");
                 // Create a shader
                 handle = glCreateShader(shader_type);
                 
@@ -83,6 +85,16 @@ namespace shader {
     };
 
 
+    /*
+     The projection every program uses, also needed without a GL context
+     (the software renderer).
+    */
+    glm::mat4 perspective(float width, float height, float view_angle=40.0f,
+                          float min_z=0.01f, float max_z=200.0f) {
+        return glm::perspective(glm::radians(view_angle), width / height, min_z, max_z);
+    }
+
+
     /*
      Create a shader program.
     */
@@ -104,11 +116,13 @@ namespace shader {
         public:
             unsigned int handle;
             int success;
+            glm::mat4 projection = glm::mat4(1.0f);
 
             /*
               Create the shader program and link the shaders
             */
             void addShaders(SingleShader Shaders[], unsigned int num_shaders) {
+                TRACE_SCOPE("shader::Program::addShaders");
                 // Create the shader program object
                 handle = glCreateProgram();
             
@@ -132,10 +146,7 @@ namespace shader {
                                        float view_angle=40.0f, float min_z=0.01f,
                                        float max_z=200.0f)
             {
-                glm::mat4 projection = glm::mat4(1.0f);
-                projection = glm::perspective(glm::radians(40.0f),
-                                              width / height, min_z,
-                                              max_z);
+                projection = perspective(width, height, view_angle, min_z, max_z);
                 set("proj", projection);
             }
 
@@ -178,6 +189,10 @@ namespace shader {
             void inline set(const std::string &name, float value) const { 
                 glUniform1f(glGetUniformLocation(handle, name.c_str()), value); 
             }
+            // set vec4
+            void inline set(const std::string &name, glm::vec4 value) const {
+                glUniform4fv(glGetUniformLocation(handle, name.c_str()), 1, glm::value_ptr(value));
+            }
             // set mat4
             void inline set(const std::string &name, glm::mat4 trans) const {
                 unsigned int loc = glGetUniformLocation(handle, name.c_str());
@@ -0,0 +1,597 @@
+#ifndef SOFTRASTER_HEADER_GUARD
+#define SOFTRASTER_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "stb_image.h"
+#include <threads.hpp>
+#include <timing.hpp>
+#include <trace.hpp>
+
+
+/*
+ A software renderer for machines without a GPU, drawing the same textured
+ cubes as the GL path without going through a GL driver at all.
+
+ Draws take the same vertex arrays that are uploaded to GL (3 position and 2
+ texture coordinate floats per vertex), indexed or not, plus a model-view-
+ projection matrix and a texture. Each draw transforms its vertices, clips
+ the triangles against the near plane, sets up their edge and attribute
+ planes and bins them into 64x64 pixel tiles. Nothing is drawn until
+ endFrame(), which rasterises the tiles in parallel on a thread pool, 4
+ pixels at a time with SSE edge functions and depth test. Texture
+ coordinates are interpolated perspective correct and sampled bilinearly
+ from the nearest mip level.
+
+ The framebuffer can be handed to capture::Capturer or, when there is a
+ window, copied to it with a Presenter.
+*/
+namespace softraster {
+
+    const unsigned int TILE_SIZE = 64;      // Pixels, a multiple of 4 for the SSE rows
+
+    /*
+     A texture as RGBA8 texels (R in the lowest byte) with a full mip chain.
+    */
+    class Texture {
+        public:
+            std::vector<std::vector<uint32_t>> levels;
+            std::vector<unsigned int> widths, heights;
+
+            /*
+             Will copy an image in and build its mip levels with a 2x2 box filter.
+
+             Inputs:
+                * data <const unsigned char *> => The pixels, the first row is the bottom (like GL).
+                * w <int> => Width in pixels.
+                * h <int> => Height in pixels.
+                * channels <int> => 3 (RGB) or 4 (RGBA).
+            */
+            void create(const unsigned char *data, int w, int h, int channels) {
+                levels.assign(1, std::vector<uint32_t>(w * h));
+                widths.assign(1, w);
+                heights.assign(1, h);
+                for (int i=0; i<w * h; i++) {
+                    const unsigned char *p = data + i * channels;
+                    uint32_t a = channels == 4 ? p[3] : 255;
+                    levels[0][i] = p[0] | (p[1] << 8) | (p[2] << 16) | (a << 24);
+                }
+
+                while (widths.back() > 1 || heights.back() > 1) {
+                    unsigned int sw = widths.back(), sh = heights.back();
+                    unsigned int dw = std::max(1u, sw / 2), dh = std::max(1u, sh / 2);
+                    const std::vector<uint32_t> &src = levels.back();
+                    std::vector<uint32_t> dst(dw * dh);
+                    for (unsigned int y=0; y<dh; y++) {
+                        for (unsigned int x=0; x<dw; x++) {
+                            unsigned int x0 = std::min(2 * x, sw - 1), x1 = std::min(2 * x + 1, sw - 1);
+                            unsigned int y0 = std::min(2 * y, sh - 1), y1 = std::min(2 * y + 1, sh - 1);
+                            uint32_t texels[4] = {src[y0 * sw + x0], src[y0 * sw + x1],
+                                                  src[y1 * sw + x0], src[y1 * sw + x1]};
+                            uint32_t out = 0;
+                            for (unsigned int c=0; c<32; c+=8) {
+                                uint32_t sum = 2;
+                                for (unsigned int t=0; t<4; t++) sum += (texels[t] >> c) & 0xff;
+                                out |= (sum / 4) << c;
+                            }
+                            dst[y * dw + x] = out;
+                        }
+                    }
+                    levels.push_back(dst);
+                    widths.push_back(dw);
+                    heights.push_back(dh);
+                }
+            }
+
+            /*
+             Bilinear sample of one mip level, wrapping (GL_REPEAT) at the edges.
+             The 4 texels are blended as 16 bit lanes with 7 bit weights.
+            */
+            uint32_t sample(float u, float v, unsigned int level) const {
+                const uint32_t *texels = levels[level].data();
+                int w = widths[level], h = heights[level];
+                float x = std::min(std::max(u * w - 0.5f, -1e6f), 1e6f);
+                float y = std::min(std::max(v * h - 0.5f, -1e6f), 1e6f);
+                int x0 = (int) x, y0 = (int) y;
+                if ((float) x0 > x) x0--;
+                if ((float) y0 > y) y0--;
+                int wx = (int) ((x - x0) * 128.0f), wy = (int) ((y - y0) * 128.0f);
+
+                // Power of two sizes (most textures) wrap with a mask, anything else with %
+                if ((w & (w - 1)) == 0) x0 &= w - 1;
+                else if ((x0 %= w) < 0) x0 += w;
+                if ((h & (h - 1)) == 0) y0 &= h - 1;
+                else if ((y0 %= h) < 0) y0 += h;
+                int x1 = x0 + 1 == w ? 0 : x0 + 1, y1 = y0 + 1 == h ? 0 : y0 + 1;
+
+                const __m128i zero = _mm_setzero_si128();
+                __m128i bottom = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, texels[y0 * w + x1], texels[y0 * w + x0]), zero);
+                __m128i top = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, texels[y1 * w + x1], texels[y1 * w + x0]), zero);
+                __m128i round = _mm_set1_epi16(64);
+
+                // Blend the rows, then the two columns left in the low and high halves
+                __m128i columns = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(bottom, _mm_set1_epi16(128 - wy)),
+                                                                             _mm_mullo_epi16(top, _mm_set1_epi16(wy))), round), 7);
+                __m128i weighted = _mm_mullo_epi16(columns, _mm_set_epi16(wx, wx, wx, wx, 128 - wx, 128 - wx, 128 - wx, 128 - wx));
+                __m128i blended = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(weighted, _mm_srli_si128(weighted, 8)), round), 7);
+                return _mm_cvtsi128_si32(_mm_packus_epi16(blended, blended));
+            }
+    };
+
+    /*
+     Will load an image file into a Texture, flipped like textures::load does.
+
+     Inputs:
+        * tex_filepath <std::string> => The path of the image.
+    */
+    Texture loadTexture(const std::string &tex_filepath) {
+        TRACE_SCOPE("softraster::loadTexture");
+        int width, height, nrChannels;
+        stbi_set_flip_vertically_on_load_thread(true);
+        unsigned char *data = stbi_load(tex_filepath.c_str(), &width, &height, &nrChannels, 0);
+        if (!data || (nrChannels != 3 && nrChannels != 4)) {
+            std::cerr << "Failed to load texture: '" << tex_filepath << "' " << std::endl;
+            throw "IOError";
+        }
+        Texture texture;
+        texture.create(data, width, height, nrChannels);
+        stbi_image_free(data);
+        return texture;
+    }
+
+    /*
+     Colour (RGBA8, R in the lowest byte) and depth (NDC z) buffers. Rows are
+     bottom first like GL and `stride` wide, padded to a whole number of tiles.
+    */
+    class Framebuffer {
+        public:
+            unsigned int width = 0, height = 0;
+            unsigned int stride = 0, padded_height = 0;
+            std::vector<uint32_t> colour;
+            std::vector<float> depth;
+
+            void create(unsigned int w, unsigned int h) {
+                width = w;
+                height = h;
+                stride = (w + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE;
+                padded_height = (h + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE;
+                colour.assign(stride * padded_height, 0);
+                depth.assign(stride * padded_height, 1.0f);
+            }
+    };
+
+    /*
+     Numbers from the last frame.
+    */
+    struct Stats {
+        unsigned int num_triangles = 0;     // Submitted
+        unsigned int num_drawn = 0;         // Left after clipping and rejecting off screen ones
+        double setup_seconds = 0.0;         // Transforming, clipping and binning in the draw calls
+        double raster_seconds = 0.0;        // endFrame()
+    };
+
+    class Renderer {
+        private:
+            /*
+             A vertex after the model-view-projection, before the divide by w.
+            */
+            struct ClipVertex {
+                glm::vec4 pos;
+                glm::vec2 uv;
+            };
+
+            /*
+             A triangle ready for rasterising. Edges, depth, 1/w and u/w, v/w are
+             all planes over the pixel grid, value = a * x + b * y + c.
+            */
+            struct Triangle {
+                float edge_a[3], edge_b[3], edge_c[3];
+                float z[3], q[3], u[3], v[3];
+                int x0, y0, x1, y1;     // Pixel bounds, inclusive and clamped to the framebuffer
+                float nearest;          // Smallest depth of the three corners
+                const Texture *texture;
+            };
+
+            std::vector<Triangle> triangles;
+            std::vector<std::vector<unsigned int>> bins;    // Triangles touching each tile
+            unsigned int tiles_x = 0, tiles_y = 0;
+            uint32_t clear_colour = 0;
+
+            // Transformed vertices of the current indexed draw, stamped so they are only done once
+            std::vector<ClipVertex> cache;
+            std::vector<unsigned int> cache_stamp;
+            unsigned int stamp = 0;
+
+            ClipVertex transform(const float *vertex, const glm::mat4 &mvp) const {
+                ClipVertex out;
+                out.pos = mvp * glm::vec4(vertex[0], vertex[1], vertex[2], 1.0f);
+                out.uv = glm::vec2(vertex[3], vertex[4]);
+                return out;
+            }
+
+            /*
+             Will reject triangles that are completely outside one frustum plane,
+             clip the rest against the near plane and set them up.
+            */
+            void addTriangle(const ClipVertex &a, const ClipVertex &b, const ClipVertex &c, const Texture *texture) {
+                stats.num_triangles++;
+                const glm::vec4 &p0 = a.pos, &p1 = b.pos, &p2 = c.pos;
+                if ((p0.x > p0.w && p1.x > p1.w && p2.x > p2.w) || (p0.x < -p0.w && p1.x < -p1.w && p2.x < -p2.w) ||
+                    (p0.y > p0.w && p1.y > p1.w && p2.y > p2.w) || (p0.y < -p0.w && p1.y < -p1.w && p2.y < -p2.w) ||
+                    (p0.z > p0.w && p1.z > p1.w && p2.z > p2.w) || (p0.z < -p0.w && p1.z < -p1.w && p2.z < -p2.w))
+                    return;
+
+                if (p0.z >= -p0.w && p1.z >= -p1.w && p2.z >= -p2.w) {
+                    setup(a, b, c, texture);
+                    return;
+                }
+
+                // Clip against z = -w, a triangle becomes at most a quad
+                const ClipVertex *in[3] = {&a, &b, &c};
+                ClipVertex out[4];
+                unsigned int n = 0;
+                for (unsigned int i=0; i<3; i++) {
+                    const ClipVertex &s = *in[i], &e = *in[(i + 1) % 3];
+                    float ds = s.pos.z + s.pos.w, de = e.pos.z + e.pos.w;
+                    if (ds >= 0.0f) out[n++] = s;
+                    if ((ds >= 0.0f) != (de >= 0.0f)) {
+                        float t = ds / (ds - de);
+                        out[n].pos = s.pos + t * (e.pos - s.pos);
+                        out[n].uv = s.uv + t * (e.uv - s.uv);
+                        n++;
+                    }
+                }
+                for (unsigned int i=1; i+1<n; i++)
+                    setup(out[0], out[i], out[i + 1], texture);
+            }
+
+            /*
+             Will work out a clipped triangle's planes and bin it.
+            */
+            void setup(const ClipVertex &a, const ClipVertex &b, const ClipVertex &c, const Texture *texture) {
+                const ClipVertex *in[3] = {&a, &b, &c};
+                float sx[3], sy[3], z[3], q[3], u[3], v[3];
+                for (unsigned int i=0; i<3; i++) {
+                    q[i] = 1.0f / in[i]->pos.w;
+                    sx[i] = (in[i]->pos.x * q[i] * 0.5f + 0.5f) * target.width;
+                    sy[i] = (in[i]->pos.y * q[i] * 0.5f + 0.5f) * target.height;
+                    z[i] = in[i]->pos.z * q[i];
+                    u[i] = in[i]->uv.x * q[i];
+                    v[i] = in[i]->uv.y * q[i];
+                }
+
+                // Nothing is back face culled, so flip clockwise triangles to keep inside >= 0
+                float area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sy[1] - sy[0]) * (sx[2] - sx[0]);
+                if (std::fabs(area) < 1e-8f) return;
+                if (area < 0.0f) {
+                    std::swap(sx[1], sx[2]); std::swap(sy[1], sy[2]);
+                    std::swap(z[1], z[2]); std::swap(q[1], q[2]);
+                    std::swap(u[1], u[2]); std::swap(v[1], v[2]);
+                    area = -area;
+                }
+
+                Triangle t;
+                t.x0 = std::max(0, (int) std::floor(std::min(sx[0], std::min(sx[1], sx[2]))));
+                t.y0 = std::max(0, (int) std::floor(std::min(sy[0], std::min(sy[1], sy[2]))));
+                t.x1 = std::min((int) target.width - 1, (int) std::floor(std::max(sx[0], std::max(sx[1], sx[2]))));
+                t.y1 = std::min((int) target.height - 1, (int) std::floor(std::max(sy[0], std::max(sy[1], sy[2]))));
+                if (t.x0 > t.x1 || t.y0 > t.y1) return;
+
+                // Edge i is opposite vertex i, evaluated at pixel centres
+                for (unsigned int i=0; i<3; i++) {
+                    unsigned int j = (i + 1) % 3, k = (i + 2) % 3;
+                    t.edge_a[i] = sy[j] - sy[k];
+                    t.edge_b[i] = sx[k] - sx[j];
+                    t.edge_c[i] = sx[j] * sy[k] - sy[j] * sx[k] + 0.5f * (t.edge_a[i] + t.edge_b[i]);
+                }
+
+                // Anything linear in screen space is a0 + (a1 - a0) * e1 / area + (a2 - a0) * e2 / area
+                float inv_area = 1.0f / area;
+                const float *attribs[4] = {z, q, u, v};
+                float *planes[4] = {t.z, t.q, t.u, t.v};
+                for (unsigned int p=0; p<4; p++) {
+                    float d1 = (attribs[p][1] - attribs[p][0]) * inv_area;
+                    float d2 = (attribs[p][2] - attribs[p][0]) * inv_area;
+                    planes[p][0] = d1 * t.edge_a[1] + d2 * t.edge_a[2];
+                    planes[p][1] = d1 * t.edge_b[1] + d2 * t.edge_b[2];
+                    planes[p][2] = attribs[p][0] + d1 * t.edge_c[1] + d2 * t.edge_c[2];
+                }
+                t.nearest = std::min(z[0], std::min(z[1], z[2]));
+                t.texture = texture;
+
+                unsigned int index = triangles.size();
+                triangles.push_back(t);
+                for (unsigned int ty=t.y0 / TILE_SIZE; ty<=t.y1 / TILE_SIZE; ty++)
+                    for (unsigned int tx=t.x0 / TILE_SIZE; tx<=t.x1 / TILE_SIZE; tx++)
+                        bins[ty * tiles_x + tx].push_back(index);
+                stats.num_drawn++;
+            }
+
+            /*
+             Will clear one tile and draw every triangle binned into it.
+            */
+            void rasteriseTile(unsigned int tile) {
+                unsigned int stride = target.stride;
+                int tx0 = (tile % tiles_x) * TILE_SIZE, ty0 = (tile / tiles_x) * TILE_SIZE;
+                int tx1 = tx0 + TILE_SIZE - 1, ty1 = ty0 + TILE_SIZE - 1;
+                for (int y=ty0; y<=ty1; y++) {
+                    std::fill(&target.colour[y * stride + tx0], &target.colour[y * stride + tx0] + TILE_SIZE, clear_colour);
+                    std::fill(&target.depth[y * stride + tx0], &target.depth[y * stride + tx0] + TILE_SIZE, 1.0f);
+                }
+
+                // Nearest first, so hidden triangles mostly fail the depth test before they're textured
+                std::vector<unsigned int> &bin = bins[tile];
+                std::stable_sort(bin.begin(), bin.end(), [&](unsigned int a, unsigned int b) {
+                    return triangles[a].nearest < triangles[b].nearest;
+                });
+
+                const __m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+                const __m128 zero = _mm_setzero_ps();
+                alignas(16) float us[4], vs[4];
+                alignas(16) int levels[4];
+                for (size_t b=0; b<bin.size(); b++) {
+                    const Triangle &t = triangles[bin[b]];
+                    const Texture &texture = *t.texture;
+                    __m128 tex_w = _mm_set1_ps(texture.widths[0]), tex_h = _mm_set1_ps(texture.heights[0]);
+                    unsigned int max_level = texture.levels.size() - 1;
+                    int x0 = std::max(t.x0, tx0) & ~3, x1 = std::min(t.x1, tx1);
+                    int y0 = std::max(t.y0, ty0), y1 = std::min(t.y1, ty1);
+
+                    __m128 ea[3], eb[3], ec[3];
+                    for (unsigned int i=0; i<3; i++) {
+                        ea[i] = _mm_set1_ps(t.edge_a[i]);
+                        eb[i] = _mm_set1_ps(t.edge_b[i]);
+                        ec[i] = _mm_set1_ps(t.edge_c[i]);
+                    }
+
+                    for (int y=y0; y<=y1; y++) {
+                        __m128 fy = _mm_set1_ps((float) y);
+                        float *depth_row = &target.depth[y * stride];
+                        uint32_t *colour_row = &target.colour[y * stride];
+                        for (int x=x0; x<=x1; x+=4) {
+                            __m128 fx = _mm_add_ps(_mm_set1_ps((float) x), lane);
+                            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+                            for (unsigned int i=0; i<3; i++) {
+                                __m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ea[i], fx), _mm_mul_ps(eb[i], fy)), ec[i]);
+                                inside = _mm_and_ps(inside, _mm_cmpge_ps(e, zero));
+                            }
+                            if (_mm_movemask_ps(inside) == 0) continue;
+
+                            __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.z[0]), fx),
+                                                             _mm_mul_ps(_mm_set1_ps(t.z[1]), fy)), _mm_set1_ps(t.z[2]));
+                            __m128 old = _mm_loadu_ps(depth_row + x);
+                            __m128 pass = _mm_and_ps(inside, _mm_cmplt_ps(z, old));
+                            int mask = _mm_movemask_ps(pass);
+                            if (mask == 0) continue;
+                            _mm_storeu_ps(depth_row + x, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+
+                            // Perspective correct texture coordinates are (u/w) / (1/w)
+                            __m128 q = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.q[0]), fx),
+                                                             _mm_mul_ps(_mm_set1_ps(t.q[1]), fy)), _mm_set1_ps(t.q[2]));
+                            __m128 inv_q = _mm_div_ps(_mm_set1_ps(1.0f), q);
+                            __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.u[0]), fx),
+                                                                        _mm_mul_ps(_mm_set1_ps(t.u[1]), fy)),
+                                                             _mm_set1_ps(t.u[2])), inv_q);
+                            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.v[0]), fx),
+                                                                        _mm_mul_ps(_mm_set1_ps(t.v[1]), fy)),
+                                                             _mm_set1_ps(t.v[2])), inv_q);
+
+                            // Texels per pixel from the derivatives of u = U / Q, which are (dU - u dQ) / Q
+                            __m128 dudx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(t.u[0]), _mm_mul_ps(u, _mm_set1_ps(t.q[0]))), inv_q);
+                            __m128 dvdx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(t.v[0]), _mm_mul_ps(v, _mm_set1_ps(t.q[0]))), inv_q);
+                            __m128 dudy = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(t.u[1]), _mm_mul_ps(u, _mm_set1_ps(t.q[1]))), inv_q);
+                            __m128 dvdy = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(t.v[1]), _mm_mul_ps(v, _mm_set1_ps(t.q[1]))), inv_q);
+                            dudx = _mm_mul_ps(dudx, tex_w); dudy = _mm_mul_ps(dudy, tex_w);
+                            dvdx = _mm_mul_ps(dvdx, tex_h); dvdy = _mm_mul_ps(dvdy, tex_h);
+                            __m128 rho2 = _mm_max_ps(_mm_add_ps(_mm_mul_ps(dudx, dudx), _mm_mul_ps(dvdx, dvdx)),
+                                                     _mm_add_ps(_mm_mul_ps(dudy, dudy), _mm_mul_ps(dvdy, dvdy)));
+
+                            // The nearest level is round(log2(rho)) = floor(log2(2 * rho^2) / 2), and
+                            // floor(log2()) of a float is its exponent
+                            __m128 r = _mm_max_ps(_mm_add_ps(rho2, rho2), _mm_set1_ps(1.0f));
+                            __m128i exponent = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(r), 23), _mm_set1_epi32(127));
+                            _mm_store_si128((__m128i *) levels, _mm_srai_epi32(exponent, 1));
+                            _mm_store_ps(us, u);
+                            _mm_store_ps(vs, v);
+
+                            for (unsigned int k=0; k<4; k++) {
+                                if (!(mask & (1 << k))) continue;
+                                unsigned int level = std::min((unsigned int) levels[k], max_level);
+                                colour_row[x + k] = texture.sample(us[k], vs[k], level);
+                            }
+                        }
+                    }
+                }
+            }
+
+        public:
+            Framebuffer target;
+            Stats stats;
+
+            /*
+             Will size the framebuffer.
+
+             Inputs:
+                * w <unsigned int> => Width in pixels.
+                * h <unsigned int> => Height in pixels.
+            */
+            void create(unsigned int w, unsigned int h) {
+                target.create(w, h);
+                tiles_x = target.stride / TILE_SIZE;
+                tiles_y = target.padded_height / TILE_SIZE;
+                bins.assign(tiles_x * tiles_y, std::vector<unsigned int>());
+            }
+
+            /*
+             Will start a frame, everything is cleared to `background_rgba`.
+            */
+            void beginFrame(const float *background_rgba) {
+                triangles.clear();
+                for (size_t t=0; t<bins.size(); t++) bins[t].clear();
+                clear_colour = 0;
+                for (unsigned int c=0; c<4; c++) {
+                    float channel = std::min(std::max(background_rgba[c], 0.0f), 1.0f);
+                    clear_colour |= (uint32_t) (channel * 255.0f + 0.5f) << (8 * c);
+                }
+                stats = Stats();
+            }
+
+            /*
+             Will draw non-indexed triangles, like glDrawArrays(GL_TRIANGLES, ...).
+
+             Inputs:
+                * vertices <const float *> => Position (3 floats) and texture coordinates (2) per vertex.
+                * stride <unsigned int> => Floats per vertex.
+                * first <unsigned int> => The first vertex to draw.
+                * count <unsigned int> => How many vertices (3 per triangle).
+                * mvp <const glm::mat4 &> => proj * view * model.
+                * texture <const Texture &> => What to texture the triangles with.
+            */
+            void drawArrays(const float *vertices, unsigned int stride, unsigned int first, unsigned int count,
+                            const glm::mat4 &mvp, const Texture &texture) {
+                timing::Stopwatch timer;
+                for (unsigned int i=first; i+2<first + count; i+=3) {
+                    addTriangle(transform(vertices + i * stride, mvp), transform(vertices + (i + 1) * stride, mvp),
+                                transform(vertices + (i + 2) * stride, mvp), &texture);
+                }
+                stats.setup_seconds += timer.seconds();
+            }
+
+            /*
+             Will draw indexed triangles, like glDrawElements(GL_TRIANGLES, ...).
+             Each vertex is only transformed once however many triangles use it.
+
+             Inputs:
+                * vertices <const float *> => Position (3 floats) and texture coordinates (2) per vertex.
+                * stride <unsigned int> => Floats per vertex.
+                * indices <const unsigned int *> => The first index to draw.
+                * count <unsigned int> => How many indices (3 per triangle).
+                * mvp <const glm::mat4 &> => proj * view * model.
+                * texture <const Texture &> => What to texture the triangles with.
+            */
+            void drawElements(const float *vertices, unsigned int stride, const unsigned int *indices,
+                              unsigned int count, const glm::mat4 &mvp, const Texture &texture) {
+                timing::Stopwatch timer;
+                if (++stamp == 0) {
+                    std::fill(cache_stamp.begin(), cache_stamp.end(), 0);
+                    stamp = 1;
+                }
+
+                const ClipVertex *corners[3];
+                for (unsigned int i=0; i+2<count; i+=3) {
+                    for (unsigned int k=0; k<3; k++) {
+                        unsigned int index = indices[i + k];
+                        if (index >= cache.size()) {
+                            cache.resize(index + 1);
+                            cache_stamp.resize(index + 1, 0);
+                        }
+                        if (cache_stamp[index] != stamp) {
+                            cache[index] = transform(vertices + index * stride, mvp);
+                            cache_stamp[index] = stamp;
+                        }
+                        corners[k] = &cache[index];
+                    }
+                    addTriangle(*corners[0], *corners[1], *corners[2], &texture);
+                }
+                stats.setup_seconds += timer.seconds();
+            }
+
+            /*
+             Will rasterise everything drawn since beginFrame(), one tile per task.
+
+             Inputs:
+                * pool <threads::Pool &> => The tiles are spread over it.
+            */
+            void endFrame(threads::Pool &pool) {
+                TRACE_SCOPE("softraster::Renderer::endFrame");
+                timing::Stopwatch timer;
+                pool.parallelFor(bins.size(), 1, [&](size_t begin, size_t end) {
+                    for (size_t tile=begin; tile<end; tile++)
+                        rasteriseTile(tile);
+                });
+                stats.raster_seconds = timer.seconds();
+            }
+    };
+
+    /*
+     Will copy a software framebuffer to the window (whatever framebuffer is
+     bound for drawing, normally the default one) through a texture and a blit.
+    */
+    class Presenter {
+        private:
+            unsigned int texture = 0, fbo = 0;
+            unsigned int width = 0, height = 0;
+
+        public:
+            void present(const Framebuffer &fb) {
+                GLint target = 0;
+                glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+                if (texture == 0) {
+                    glGenTextures(1, &texture);
+                    glGenFramebuffers(1, &fbo);
+                }
+                glBindTexture(GL_TEXTURE_2D, texture);
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, fb.stride);
+                if (fb.width != width || fb.height != height) {
+                    width = fb.width;
+                    height = fb.height;
+                    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, fb.colour.data());
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+                    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+                } else {
+                    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, fb.colour.data());
+                }
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+                glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, target);
+            }
+
+            void destroy() {
+                if (texture == 0) return;
+                glDeleteFramebuffers(1, &fbo);
+                glDeleteTextures(1, &texture);
+                texture = fbo = 0;
+            }
+    };
+
+    /*
+     Will average the per frame stats so they can be printed on exit.
+    */
+    class StatsAccumulator {
+        public:
+            unsigned long num_frames = 0;
+            double total_triangles = 0.0;
+            double total_drawn = 0.0;
+            double total_setup = 0.0;
+            double total_raster = 0.0;
+
+            void add(const Stats &s) {
+                num_frames++;
+                total_triangles += s.num_triangles;
+                total_drawn += s.num_drawn;
+                total_setup += s.setup_seconds;
+                total_raster += s.raster_seconds;
+            }
+
+            void print() const {
+                if (num_frames == 0) return;
+                std::cout << "software: avg " << total_drawn / num_frames << " / " << total_triangles / num_frames;
+                std::cout << " triangles drawn, setup " << 1000.0 * total_setup / num_frames << " ms, raster ";
+                std::cout << 1000.0 * total_raster / num_frames << " ms" << std::endl;
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef STATICBATCH_HEADER_GUARD
+#define STATICBATCH_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include <culling.hpp>
+#include <files.hpp>
+#include <mesh.hpp>
+#include <trace.hpp>
+
+
+/*
+ Static batching for objects that never move.
+
+ Instead of a model matrix per object per draw, every static instance's
+ vertices are transformed once at load time and appended to one merged
+ vertex and index buffer. The instances are grouped by material and by
+ which cell of a coarse grid their centre falls in, each group (a chunk)
+ is a contiguous range of the index buffer with its own bounding box. So
+ thousands of static objects are drawn with one glDrawElements per visible
+ chunk, and chunks off screen are skipped with a box test.
+*/
+namespace staticbatch {
+
+    /*
+     One object that never moves.
+    */
+    struct Instance {
+        glm::mat4 model;
+        unsigned int material = 0;
+    };
+
+    /*
+     A range of the merged index buffer with one material, inside one grid cell.
+    */
+    struct Chunk {
+        glm::vec3 bmin, bmax;           // Of the transformed vertices
+        unsigned int material;
+        unsigned int first_index;
+        unsigned int num_indices;
+        unsigned int num_instances;
+    };
+
+    /*
+     Numbers from the last frame.
+    */
+    struct Stats {
+        unsigned int num_chunks = 0;
+        unsigned int num_visible = 0;
+        unsigned int num_draws = 0;
+        unsigned int num_triangles = 0;
+    };
+
+    class Batch {
+        public:
+            mesh::Mesh merged;                  // Every instance, already in world space
+            mesh::GLMesh gpu;
+            std::vector<Chunk> chunks;          // Sorted by material, then cell
+            std::vector<unsigned int> visible;  // Chunks that passed the last cull
+            float cell_size = 16.0f;
+            Stats stats;
+
+            /*
+             Will transform every instance's copy of the mesh and merge them into
+             chunks.
+
+             Inputs:
+                * file <IO::FloatArrayFile &> => The mesh every instance uses (3 rows per triangle).
+                * instances <const std::vector<Instance> &> => Where the objects are.
+            */
+            void build(IO::FloatArrayFile &file, const std::vector<Instance> &instances) {
+                TRACE_SCOPE("staticbatch::Batch::build");
+                mesh::Mesh m = mesh::fromArrayFile(file);
+
+                // Group the instances by (material, cell), the map keeps the groups sorted
+                std::map<std::tuple<unsigned int, int, int, int>, std::vector<unsigned int>> groups;
+                for (size_t i=0; i<instances.size(); i++) {
+                    glm::vec3 centre = glm::vec3(instances[i].model[3]);
+                    glm::ivec3 cell = glm::ivec3(glm::floor(centre / cell_size));
+                    groups[std::make_tuple(instances[i].material, cell.x, cell.y, cell.z)].push_back(i);
+                }
+
+                merged = mesh::Mesh();
+                merged.stride = m.stride;
+                merged.vertices.reserve(instances.size() * m.vertices.size());
+                merged.indices.reserve(instances.size() * m.indices.size());
+                chunks.clear();
+                for (std::map<std::tuple<unsigned int, int, int, int>, std::vector<unsigned int>>::iterator it=groups.begin();
+                     it!=groups.end(); it++) {
+                    Chunk chunk;
+                    chunk.bmin = glm::vec3(1e30f);
+                    chunk.bmax = glm::vec3(-1e30f);
+                    chunk.material = std::get<0>(it->first);
+                    chunk.first_index = merged.indices.size();
+                    chunk.num_instances = it->second.size();
+
+                    for (size_t j=0; j<it->second.size(); j++) {
+                        const glm::mat4 &model = instances[it->second[j]].model;
+                        unsigned int base = merged.numVertices();
+                        for (unsigned int v=0; v<m.numVertices(); v++) {
+                            const float *src = &m.vertices[v * m.stride];
+                            glm::vec3 p = glm::vec3(model * glm::vec4(src[0], src[1], src[2], 1.0f));
+                            chunk.bmin = glm::min(chunk.bmin, p);
+                            chunk.bmax = glm::max(chunk.bmax, p);
+                            merged.vertices.push_back(p.x);
+                            merged.vertices.push_back(p.y);
+                            merged.vertices.push_back(p.z);
+                            merged.vertices.insert(merged.vertices.end(), src + 3, src + m.stride);
+                        }
+                        for (size_t k=0; k<m.indices.size(); k++)
+                            merged.indices.push_back(base + m.indices[k]);
+                    }
+
+                    chunk.num_indices = merged.indices.size() - chunk.first_index;
+                    chunks.push_back(chunk);
+                }
+
+                visible.resize(chunks.size());
+                for (size_t c=0; c<chunks.size(); c++)
+                    visible[c] = c;
+                stats.num_chunks = chunks.size();
+            }
+
+            /*
+             Will upload the merged buffers to the GPU (not needed by the software renderer).
+            */
+            void upload() {
+                gpu.create(merged);
+            }
+
+            /*
+             Will keep only the chunks whose box touches the frustum.
+            */
+            void cull(const culling::Frustum &f) {
+                culling::cullChunks(f, chunks.data(), chunks.size(), visible);
+            }
+
+            /*
+             Will walk the visible chunks as runs that are next to each other in
+             the index buffer and share a material, so each run is one draw.
+
+             Inputs:
+                * fn <function> => Called as fn(material, first_index, num_indices) for each run.
+            */
+            void forEachRun(const std::function<void(unsigned int, unsigned int, unsigned int)> &fn) {
+                stats.num_visible = visible.size();
+                stats.num_draws = 0;
+                stats.num_triangles = 0;
+                culling::forEachChunkRun(chunks.data(), visible, [](const Chunk &first, const Chunk &next) {
+                    return next.material == first.material;
+                }, [&](size_t begin, size_t end) {
+                    unsigned int count = 0;
+                    for (size_t c=begin; c<end; c++)
+                        count += chunks[c].num_indices;
+
+                    fn(chunks[begin].material, chunks[begin].first_index, count);
+                    stats.num_draws++;
+                    stats.num_triangles += count / 3;
+                });
+            }
+
+            /*
+             Will draw the visible chunks with GL, switching texture per material.
+             The bound program's model matrix should be the identity.
+
+             Inputs:
+                * materials <const std::vector<unsigned int> &> => The texture of each material.
+            */
+            void draw(const std::vector<unsigned int> &materials) {
+                glBindVertexArray(gpu.VAO_handle);
+                unsigned int bound = (unsigned int) -1;
+                forEachRun([&](unsigned int material, unsigned int first_index, unsigned int num_indices) {
+                    if (material != bound) {
+                        glBindTexture(GL_TEXTURE_2D, materials[material % materials.size()]);
+                        bound = material;
+                    }
+                    glDrawElements(GL_TRIANGLES, num_indices, GL_UNSIGNED_INT,
+                                   (void*)(first_index * sizeof(unsigned int)));
+                });
+            }
+
+            void destroy() {
+                if (gpu.VAO_handle != 0) gpu.destroy();
+            }
+    };
+
+    /*
+     Will average the per frame stats so they can be printed on exit.
+    */
+    class StatsAccumulator {
+        public:
+            unsigned long num_frames = 0;
+            unsigned int num_chunks = 0;
+            double total_visible = 0.0;
+            double total_draws = 0.0;
+            double total_triangles = 0.0;
+
+            void add(const Stats &s) {
+                num_frames++;
+                num_chunks = s.num_chunks;
+                total_visible += s.num_visible;
+                total_draws += s.num_draws;
+                total_triangles += s.num_triangles;
+            }
+
+            void print() const {
+                if (num_frames == 0) return;
+                std::cout << "static: avg " << total_visible / num_frames << " / " << num_chunks;
+                std::cout << " chunks visible, " << total_draws / num_frames << " draws, ";
+                std::cout << total_triangles / num_frames << " triangles" << std::endl;
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef TEXTURES_HEADER_GUARD
+#define TEXTURES_HEADER_GUARD
+
+#include <glad/glad.h>
+#include <iostream>
+#include <string>
+
+#include "stb_image.h"
+#include <trace.hpp>
+
+
+namespace textures {
+
+    /*
+     An image decoded into memory, ready to upload.
+    */
+    struct Image {
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        unsigned char *data = NULL;
+    };
+
+    /*
+     Will decode an image file, flipped so the first row is the bottom.
+     Doesn't touch GL so it can run on any thread.
+
+     Inputs:
+        * tex_filepath <std::string> => The path of the image.
+    */
+    Image decode(const std::string &tex_filepath) {
+        TRACE_SCOPE("stbi_load");
+        Image image;
+        stbi_set_flip_vertically_on_load_thread(true);
+        image.data = stbi_load(tex_filepath.c_str(), &image.width, &image.height, &image.channels, 0);
+        if (!image.data) {
+            std::cerr << "Failed to load texture: '" << tex_filepath << "' " << std::endl;
+            throw "IOError";
+        }
+        return image;
+    }
+
+    /*
+     Will upload a decoded image into a new 2D texture (with mipmaps), free
+     the image and return the texture's handle.
+
+     Inputs:
+        * image <Image &> => The decoded image.
+    */
+    unsigned int upload(Image &image) {
+        TRACE_SCOPE("textures::upload");
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        // Set some parameters to tell OpenGL how the texture should be used.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        GLenum format = image.channels == 4 ? GL_RGBA : GL_RGB;
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.data);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+        stbi_image_free(image.data);
+        image.data = NULL;
+        return texture;
+    }
+
+    /*
+     Will load an image file into a new 2D texture (with mipmaps) and return
+     its handle.
+
+     Inputs:
+        * tex_filepath <std::string> => The path of the image.
+    */
+    unsigned int load(std::string tex_filepath) {
+        TRACE_SCOPE("textures::load");
+        Image image = decode(tex_filepath);
+        return upload(image);
+    }
+}
+
+#endif
@@ -0,0 +1,501 @@
+#ifndef THREADS_HEADER_GUARD
+#define THREADS_HEADER_GUARD
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <timing.hpp>
+#include <trace.hpp>
+
+
+/*
+ A work-stealing job system.
+
+ Every worker has its own Chase-Lev deque: it pushes and pops jobs at the
+ bottom without any locking, and idle threads steal from the top of the
+ others' deques, so they take the oldest (and for a split loop, biggest)
+ pieces of work. The thread that made the pool has a deque too. Other
+ threads hand their jobs in through a locked inbox.
+
+ Jobs count down a Counter when they finish. A thread waiting on a counter
+ runs jobs itself until it reaches zero rather than sleeping, and jobs can
+ be held back until another counter reaches zero, which is how
+ dependencies between jobs are expressed.
+*/
+namespace threads {
+
+    class Counter;
+
+    struct Job {
+        std::function<void()> work;
+        Counter *counter = NULL;
+    };
+
+    /*
+     Counts the jobs still to finish. Jobs waiting for it to reach zero are
+     kept on it and handed to the pool when it does.
+    */
+    class Counter {
+        private:
+            friend class Pool;
+            std::atomic<int> pending;
+            std::mutex continuations_mutex;
+            std::vector<Job*> continuations;
+            std::exception_ptr error;   // The first exception a job threw, rethrown by wait
+
+        public:
+            Counter() : pending(0) { }
+            bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+    };
+
+    /*
+     A Chase-Lev deque of jobs (Le, Pop, Cohen and Zappa Nardelli's C11
+     version). Only the owning thread may push and pop, anyone may steal.
+    */
+    class Deque {
+        private:
+            struct Array {
+                int64_t capacity;
+                std::atomic<Job*> *slots;
+
+                Array(int64_t c) : capacity(c), slots(new std::atomic<Job*>[c]) { }
+                ~Array() { delete[] slots; }
+                Job *get(int64_t i) const { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+                void put(int64_t i, Job *job) { slots[i & (capacity - 1)].store(job, std::memory_order_relaxed); }
+            };
+
+            std::atomic<int64_t> top;
+            std::atomic<int64_t> bottom;
+            std::atomic<Array*> array;
+            std::vector<Array*> retired;   // Old arrays a thief might still be reading, freed with the deque
+
+        public:
+            Deque(int64_t capacity=256) : top(0), bottom(0), array(new Array(capacity)) { }
+
+            ~Deque() {
+                delete array.load();
+                for (Array *a : retired) delete a;
+            }
+
+            void push(Job *job) {
+                int64_t b = bottom.load(std::memory_order_relaxed);
+                int64_t t = top.load(std::memory_order_acquire);
+                Array *a = array.load(std::memory_order_relaxed);
+                if (b - t > a->capacity - 1) {
+                    Array *bigger = new Array(2 * a->capacity);
+                    for (int64_t i=t; i<b; i++)
+                        bigger->put(i, a->get(i));
+                    retired.push_back(a);
+                    array.store(bigger, std::memory_order_release);
+                    a = bigger;
+                }
+                a->put(b, job);
+                bottom.store(b + 1, std::memory_order_release);
+            }
+
+            Job *pop() {
+                int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+                Array *a = array.load(std::memory_order_relaxed);
+                bottom.store(b, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                int64_t t = top.load(std::memory_order_relaxed);
+
+                Job *job = NULL;
+                if (t <= b) {
+                    job = a->get(b);
+                    if (t == b) {
+                        // The last one, race any thief for it
+                        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                         std::memory_order_relaxed))
+                            job = NULL;
+                        bottom.store(b + 1, std::memory_order_relaxed);
+                    }
+                } else {
+                    bottom.store(b + 1, std::memory_order_relaxed);
+                }
+                return job;
+            }
+
+            Job *steal() {
+                int64_t t = top.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                int64_t b = bottom.load(std::memory_order_acquire);
+                if (t >= b) return NULL;
+
+                Array *a = array.load(std::memory_order_acquire);
+                Job *job = a->get(t);
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    return NULL;   // Lost to the owner or another thief
+                return job;
+            }
+    };
+
+    /*
+     The job system's threads.
+
+     Besides run and wait it keeps the parallelFor of the old fixed split
+     pool, which now hands the range out recursively (see parallelFor).
+    */
+    class Pool {
+        private:
+            std::vector<std::thread> workers;
+            std::vector<Deque*> deques;          // 0 is the creating thread's, then one per worker
+            std::thread::id owner;
+            std::deque<Job*> inbox;              // Jobs from threads that don't have a deque
+            std::mutex inbox_mutex;
+            std::atomic<int> inbox_size;         // So take can skip the lock when it's empty
+            std::atomic<int> num_queued;         // Jobs pushed and not yet taken, for waking sleepers
+            std::atomic<int> num_sleeping;
+            std::mutex sleep_mutex;
+            std::condition_variable sleep_cv;
+            std::atomic<bool> stopping;
+
+            struct ThreadSlot {
+                const Pool *pool = NULL;
+                unsigned int index = 0;
+                uint32_t rng = 0;
+            };
+            static ThreadSlot &thisThread() {
+                static thread_local ThreadSlot slot;
+                return slot;
+            }
+
+            /*
+             The calling thread's deque, or NULL if it doesn't have one here.
+            */
+            Deque *ownDeque() const {
+                const ThreadSlot &slot = thisThread();
+                if (slot.pool == this) return deques[slot.index];
+                if (std::this_thread::get_id() == owner) return deques[0];
+                return NULL;
+            }
+
+            void push(Job *job) {
+                Deque *own = ownDeque();
+                if (own != NULL) {
+                    own->push(job);
+                } else {
+                    std::lock_guard<std::mutex> lock(inbox_mutex);
+                    inbox.push_back(job);
+                    inbox_size.fetch_add(1);
+                }
+                num_queued.fetch_add(1);
+                if (num_sleeping.load() > 0) {
+                    std::lock_guard<std::mutex> lock(sleep_mutex);
+                    sleep_cv.notify_one();
+                }
+            }
+
+            /*
+             Will find a job for the calling thread: its own newest, then the
+             inbox, then the oldest from another thread picked at random.
+            */
+            Job *take() {
+                Deque *own = ownDeque();
+                Job *job = own != NULL ? own->pop() : NULL;
+
+                if (job == NULL && inbox_size.load() > 0) {
+                    std::lock_guard<std::mutex> lock(inbox_mutex);
+                    if (!inbox.empty()) {
+                        job = inbox.front();
+                        inbox.pop_front();
+                        inbox_size.fetch_sub(1);
+                    }
+                }
+
+                if (job == NULL) {
+                    ThreadSlot &slot = thisThread();
+                    slot.rng = slot.rng * 1664525u + 1013904223u;
+                    size_t start = (slot.rng >> 16) % deques.size();
+                    for (size_t k=0; k<deques.size() && job==NULL; k++) {
+                        Deque *victim = deques[(start + k) % deques.size()];
+                        if (victim != own) job = victim->steal();
+                    }
+                }
+
+                if (job != NULL) num_queued.fetch_sub(1);
+                return job;
+            }
+
+            /*
+             Will run a job, count its counter down and release anything that
+             was waiting on the counter.
+            */
+            void execute(Job *job) {
+                try {
+                    job->work();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(job->counter->continuations_mutex);
+                    if (!job->counter->error) job->counter->error = std::current_exception();
+                }
+                Counter *counter = job->counter;
+                delete job;
+
+                // Under the lock so a waiter can't see zero and free the counter while it's still held
+                std::vector<Job*> released;
+                {
+                    std::lock_guard<std::mutex> lock(counter->continuations_mutex);
+                    if (counter->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                        released.swap(counter->continuations);
+                }
+                for (Job *next : released) push(next);
+            }
+
+            /*
+             The loop every worker thread runs: work while there is any, then
+             spin for a moment and sleep until a job is pushed.
+            */
+            void workerLoop(unsigned int index) {
+                TRACE_THREAD_NAME("worker");
+                ThreadSlot &slot = thisThread();
+                slot.pool = this;
+                slot.index = index;
+                slot.rng = index * 2654435761u;
+
+                while (!stopping.load()) {
+                    Job *job = take();
+                    if (job != NULL) {
+                        execute(job);
+                        continue;
+                    }
+
+                    bool found = false;
+                    for (int spin=0; spin<64 && !found; spin++) {
+                        std::this_thread::yield();
+                        found = num_queued.load() > 0;
+                    }
+                    if (found) continue;
+
+                    std::unique_lock<std::mutex> lock(sleep_mutex);
+                    num_sleeping.fetch_add(1);
+                    sleep_cv.wait(lock, [this] { return stopping.load() || num_queued.load() > 0; });
+                    num_sleeping.fetch_sub(1);
+                }
+            }
+
+            /*
+             Gives away the top half of the range as a job until what's left is
+             no bigger than the grain, then runs that. Thieves take the oldest
+             job, which is always the biggest piece still to split.
+            */
+            void splitRange(size_t begin, size_t end, size_t grain,
+                            const std::function<void(size_t, size_t)> &fn, Counter &counter) {
+                while (end - begin > grain) {
+                    size_t mid = begin + (end - begin) / 2;
+                    run([this, mid, end, grain, &fn, &counter] { splitRange(mid, end, grain, fn, counter); },
+                        &counter);
+                    end = mid;
+                }
+                TRACE_SCOPE("threads::Pool chunk");
+                fn(begin, end);
+            }
+
+        public:
+            /*
+             Constructor: Will start the worker threads.
+
+             Inputs:
+                * num_workers <int> => How many threads to start, a negative number
+                                       means one less than the number of cores (the
+                                       calling thread makes up the difference).
+            */
+            Pool(int num_workers=-1) : owner(std::this_thread::get_id()), inbox_size(0), num_queued(0),
+                                       num_sleeping(0), stopping(false) {
+                if (num_workers < 0) {
+                    int cores = std::thread::hardware_concurrency();
+                    num_workers = cores > 1 ? cores - 1 : 0;
+                }
+                for (int i=0; i<=num_workers; i++)
+                    deques.push_back(new Deque());
+                for (int i=0; i<num_workers; i++)
+                    workers.emplace_back(&Pool::workerLoop, this, i + 1);
+            }
+
+            ~Pool() {
+                {
+                    std::lock_guard<std::mutex> lock(sleep_mutex);
+                    stopping.store(true);
+                }
+                sleep_cv.notify_all();
+                for (std::thread &worker : workers)
+                    worker.join();
+                for (Deque *d : deques) {
+                    while (Job *job = d->pop()) delete job;
+                    delete d;
+                }
+                for (Job *job : inbox) delete job;
+            }
+
+            /*
+             How many threads work on a parallelFor (the workers plus the caller).
+            */
+            unsigned int numThreads() const {
+                return workers.size() + 1;
+            }
+
+            /*
+             Will queue a job.
+
+             Inputs:
+                * work <std::function<void()>> => What to run.
+                * counter <Counter *> => Counted up now and down when the job finishes.
+            */
+            void run(std::function<void()> work, Counter *counter) {
+                counter->pending.fetch_add(1, std::memory_order_relaxed);
+                Job *job = new Job();
+                job->work = std::move(work);
+                job->counter = counter;
+                push(job);
+            }
+
+            /*
+             Will queue a job once another counter reaches zero (straight away if
+             it already has).
+
+             Inputs:
+                * dependency <Counter &> => What the job waits for.
+                * work <std::function<void()>> => What to run.
+                * counter <Counter *> => Counted up now and down when the job finishes.
+            */
+            void runAfter(Counter &dependency, std::function<void()> work, Counter *counter) {
+                counter->pending.fetch_add(1, std::memory_order_relaxed);
+                Job *job = new Job();
+                job->work = std::move(work);
+                job->counter = counter;
+                {
+                    std::lock_guard<std::mutex> lock(dependency.continuations_mutex);
+                    if (!dependency.done()) {
+                        dependency.continuations.push_back(job);
+                        return;
+                    }
+                }
+                push(job);
+            }
+
+            /*
+             Will run jobs on the calling thread until the counter reaches zero,
+             then rethrow the first exception any of its jobs threw.
+            */
+            void wait(Counter &counter) {
+                TRACE_SCOPE("threads::Pool::wait");
+                while (!counter.done()) {
+                    Job *job = take();
+                    if (job != NULL)
+                        execute(job);
+                    else
+                        std::this_thread::yield();
+                }
+                // The last job may still be letting go of the counter's lock
+                std::lock_guard<std::mutex> lock(counter.continuations_mutex);
+                if (counter.error) {
+                    std::exception_ptr error = counter.error;
+                    counter.error = NULL;
+                    std::rethrow_exception(error);
+                }
+            }
+
+            /*
+             Will split the range [0, count) into chunks and call fn(begin, end) on
+             each chunk across the pool. Blocks (helping out) until every chunk is
+             done.
+
+             The grain is picked so there are about 8 chunks per thread, enough
+             for the stealing to even out uneven chunks, but never less than
+             min_chunk.
+
+             Inputs:
+                * count <size_t> => The size of the range.
+                * min_chunk <size_t> => Don't make chunks smaller than this.
+                * fn <function> => Called as fn(begin, end) for each chunk.
+            */
+            void parallelFor(size_t count, size_t min_chunk,
+                             const std::function<void(size_t, size_t)> &fn) {
+                if (count == 0) return;
+                size_t target = 8 * numThreads();
+                size_t grain = std::max(std::max(min_chunk, (size_t) 1), (count + target - 1) / target);
+                if (numThreads() == 1 || count <= grain) {
+                    fn(0, count);
+                    return;
+                }
+
+                Counter counter;
+                Counter *c = &counter;
+                run([this, count, grain, &fn, c] { splitRange(0, count, grain, fn, *c); }, c);
+                wait(counter);
+            }
+    };
+
+    /*
+     Will time the same work on pools of 1 up to every core, to show how the
+     job system scales: a parallelFor of independent items, and a chain of
+     fan-out/fan-in stages joined by dependency counters.
+
+     Inputs:
+        * count <size_t> => How many items to process.
+    */
+    void benchmark(size_t count) {
+        unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+        std::vector<float> data(count);
+        const unsigned int stages = 16, jobs_per_stage = 64;
+
+        // A few hundred flops an item, enough that the loop isn't bound by memory
+        auto work = [&](size_t begin, size_t end) {
+            for (size_t i=begin; i<end; i++) {
+                float x = (float) i * 1e-6f;
+                for (int k=0; k<32; k++) x = std::sin(x) * 0.5f + std::cos(x * 1.1f);
+                data[i] = x;
+            }
+        };
+
+        std::cout << "Job system on " << count << " items, best of 5 runs" << std::endl;
+        double base_for = 0.0, base_graph = 0.0;
+        for (unsigned int t=1; t<=cores; t++) {
+            Pool pool(t - 1);
+            double best_for = 1e30, best_graph = 1e30;
+            for (int run=0; run<5; run++) {
+                timing::Stopwatch timer;
+                pool.parallelFor(count, 256, work);
+                best_for = std::min(best_for, timer.seconds());
+
+                // Each stage's jobs only start once the whole previous stage is done
+                timer.reset();
+                std::vector<Counter> done(stages);
+                size_t per_job = (count + stages * jobs_per_stage - 1) / (stages * jobs_per_stage);
+                for (unsigned int s=0; s<stages; s++) {
+                    for (unsigned int j=0; j<jobs_per_stage; j++) {
+                        size_t begin = std::min(count, (s * jobs_per_stage + j) * per_job);
+                        size_t end = std::min(count, begin + per_job);
+                        auto job = [&work, begin, end] { work(begin, end); };
+                        if (s == 0)
+                            pool.run(job, &done[s]);
+                        else
+                            pool.runAfter(done[s - 1], job, &done[s]);
+                    }
+                }
+                pool.wait(done[stages - 1]);
+                best_graph = std::min(best_graph, timer.seconds());
+            }
+            if (t == 1) {
+                base_for = best_for;
+                base_graph = best_graph;
+            }
+            std::cout << "  " << t << " thread" << (t > 1 ? "s" : " ") << "  parallelFor ";
+            std::cout << 1000.0 * best_for << " ms (x" << base_for / best_for << "), ";
+            std::cout << stages << " dependent stages " << 1000.0 * best_graph << " ms (x";
+            std::cout << base_graph / best_graph << ")" << std::endl;
+        }
+    }
+}
+
+#endif
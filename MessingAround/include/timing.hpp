@@ -0,0 +1,129 @@
+#ifndef TIMING_HEADER_GUARD
+#define TIMING_HEADER_GUARD
+
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+namespace timing {
+
+    /*
+     A tiny wall clock stopwatch (in seconds) for timing bits of CPU work.
+    */
+    class Stopwatch {
+        private:
+            std::chrono::steady_clock::time_point start_time;
+
+        public:
+            Stopwatch() { reset(); }
+
+            void reset() {
+                start_time = std::chrono::steady_clock::now();
+            }
+
+            double seconds() const {
+                std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start_time;
+                return dt.count();
+            }
+    };
+
+    /*
+     Turns variable frame times into a whole number of fixed simulation
+     steps, so the simulation behaves the same at any frame rate. Whatever
+     time is left over (less than a step) is carried into the next frame
+     and alpha() says how far the frame is between the last two steps.
+    */
+    class FixedStep {
+        private:
+            double accumulator = 0.0;
+
+        public:
+            double step_seconds;
+            unsigned int max_steps = 8;     // Stops a slow frame from snowballing
+            unsigned long num_dropped = 0;  // Frames that hit max_steps and dropped time
+
+            FixedStep(double step) : step_seconds(step) { }
+
+            /*
+             Will add a frame's worth of time and return how many steps to run.
+            */
+            unsigned int advance(double frame_seconds) {
+                accumulator += frame_seconds;
+                unsigned int steps = 0;
+                // The small slack stops rounding from turning 2 steps into 1 + 3
+                while (accumulator + 1e-9 >= step_seconds) {
+                    accumulator -= step_seconds;
+                    steps++;
+                }
+                if (steps > max_steps) {
+                    steps = max_steps;
+                    num_dropped++;
+                }
+                if (accumulator < 0.0) accumulator = 0.0;
+                return steps;
+            }
+
+            /*
+             How far between the previous and the current step, from 0 to 1.
+            */
+            double alpha() const {
+                return accumulator / step_seconds;
+            }
+    };
+
+    /*
+     Will accumulate the frame times and the CPU time spent submitting draws
+     so the different render modes can be compared.
+    */
+    class FrameStats {
+        public:
+            unsigned long num_frames = 0;
+            double total_frame = 0.0;
+            double total_cpu = 0.0;
+            std::vector<double> frame_times;
+
+            /*
+             Add a single frame.
+
+             Inputs:
+                * frame_seconds <double> => Time between this frame and the last.
+                * cpu_seconds <double> => Time spent on the CPU preparing and submitting the frame.
+            */
+            void add(double frame_seconds, double cpu_seconds) {
+                num_frames++;
+                total_frame += frame_seconds;
+                total_cpu += cpu_seconds;
+                frame_times.push_back(frame_seconds);
+            }
+
+            /*
+             The frame time (in seconds) that p percent of frames were at or under.
+            */
+            double percentile(double p) const {
+                if (frame_times.empty()) return 0.0;
+                std::vector<double> sorted(frame_times);
+                size_t i = (size_t) (p / 100.0 * (sorted.size() - 1) + 0.5);
+                std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+                return sorted[i];
+            }
+
+            /*
+             Will print the averages to stdout.
+            */
+            void print(const std::string &label) const {
+                if (num_frames == 0) return;
+                std::cout << label << ": " << num_frames << " frames, ";
+                std::cout << "avg frame " << 1000.0 * total_frame / num_frames << " ms, ";
+                std::cout << "avg CPU submit " << 1000.0 * total_cpu / num_frames << " ms";
+                std::cout << std::endl;
+                std::cout << "  frame time p50 " << 1000.0 * percentile(50.0) << " ms, p95 ";
+                std::cout << 1000.0 * percentile(95.0) << " ms, p99 " << 1000.0 * percentile(99.0) << " ms, ";
+                std::cout << (total_frame > 0.0 ? num_frames / total_frame : 0.0) << " fps" << std::endl;
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef TRACE_HEADER_GUARD
+#define TRACE_HEADER_GUARD
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+/*
+ A CPU event tracer for seeing start up and frame phases on a timeline.
+
+ Put TRACE_SCOPE("name") at the top of a block to record how long the block
+ takes. Every thread records into its own fixed size ring of events, so
+ recording never locks or allocates: it is two timestamp reads (the TSC on
+ x86, steady_clock elsewhere) and a few stores, and a single relaxed load
+ when tracing is switched off at runtime. Building with -DTRACE_DISABLED
+ removes the macros completely.
+
+ trace::writeChrome() writes everything recorded so far as Chrome trace
+ event JSON, which chrome://tracing and ui.perfetto.dev can both open.
+ Names must be string literals (only the pointer is stored).
+*/
+namespace trace {
+
+    const unsigned int EVENTS_PER_THREAD = 1 << 16;  // Older events are overwritten
+
+    struct Event {
+        const char *name;
+        uint64_t start;     // In ticks, see now()
+        uint64_t end;
+    };
+
+    /*
+     One thread's ring of events. Only that thread writes to it, head is
+     published with release semantics so a reader sees complete events.
+    */
+    struct ThreadBuffer {
+        unsigned int id = 0;
+        std::string name;
+        std::atomic<uint64_t> head;
+        std::vector<Event> events;
+
+        ThreadBuffer() : head(0), events(EVENTS_PER_THREAD) { }
+    };
+
+    std::atomic<bool> enabled(false);
+    std::mutex buffers_mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;  // Kept until exit so dead threads still show up
+
+    /*
+     The raw timestamp. The TSC ticks at a constant rate on anything recent,
+     the rate is measured against steady_clock when the trace is written.
+    */
+    uint64_t inline now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+    const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    const uint64_t start_ticks = now();
+
+    /*
+     The calling thread's buffer, created (the only time a lock is taken)
+     on its first event.
+    */
+    ThreadBuffer &threadBuffer() {
+        thread_local ThreadBuffer *buffer = NULL;
+        if (buffer == NULL) {
+            std::lock_guard<std::mutex> lock(buffers_mutex);
+            buffers.emplace_back(new ThreadBuffer());
+            buffer = buffers.back().get();
+            buffer->id = buffers.size();
+            buffer->name = "thread " + std::to_string(buffer->id);
+        }
+        return *buffer;
+    }
+
+    /*
+     Will give the calling thread a name in the trace (if tracing is on).
+    */
+    void setThreadName(const std::string &name) {
+        if (!enabled.load(std::memory_order_relaxed)) return;
+        ThreadBuffer &buffer = threadBuffer();
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        buffer.name = name;
+    }
+
+    void inline record(const char *name, uint64_t start, uint64_t end) {
+        ThreadBuffer &buffer = threadBuffer();
+        uint64_t head = buffer.head.load(std::memory_order_relaxed);
+        Event &e = buffer.events[head % EVENTS_PER_THREAD];
+        e.name = name;
+        e.start = start;
+        e.end = end;
+        buffer.head.store(head + 1, std::memory_order_release);
+    }
+
+    /*
+     Records the time between its construction and destruction.
+    */
+    class Scope {
+        private:
+            const char *name;
+            uint64_t start;
+
+        public:
+            Scope(const char *n) : name(n), start(0) {
+                if (enabled.load(std::memory_order_relaxed)) start = now();
+            }
+
+            ~Scope() {
+                if (start != 0) record(name, start, now());
+            }
+    };
+
+    /*
+     Will write every thread's events as Chrome trace JSON ("X" complete
+     events with microsecond times plus the thread names). Can be called at
+     any time, events written while it runs might be skipped.
+
+     Inputs:
+        * filepath <std::string> => Where to write the JSON.
+    */
+    void writeChrome(const std::string &filepath) {
+        std::ofstream out(filepath);
+        if (!out.is_open()) {
+            std::cerr << "Failed to open '" << filepath << "' for writing" << std::endl;
+            throw "IOError";
+        }
+
+        // How many microseconds a tick is, from how far both clocks have moved since start up
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start_time;
+        uint64_t elapsed_ticks = now() - start_ticks;
+        double us_per_tick = elapsed_ticks > 0 ? elapsed.count() / elapsed_ticks : 0.0;
+
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        out << std::fixed << std::setprecision(3);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        unsigned long num_events = 0;
+        for (size_t b=0; b<buffers.size(); b++) {
+            ThreadBuffer &buffer = *buffers[b];
+            out << (first ? "" : ",\n");
+            out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer.id;
+            out << ", \"args\": {\"name\": \"" << buffer.name << "\"}}";
+            first = false;
+
+            uint64_t head = buffer.head.load(std::memory_order_acquire);
+            uint64_t begin = head > EVENTS_PER_THREAD ? head - EVENTS_PER_THREAD : 0;
+            std::vector<Event> events(buffer.events.begin(), buffer.events.end());
+
+            // Anything the thread wrapped round onto while we copied is unreliable
+            uint64_t head_after = buffer.head.load(std::memory_order_acquire);
+            if (head_after > begin + EVENTS_PER_THREAD) begin = head_after - EVENTS_PER_THREAD;
+
+            for (uint64_t i=begin; i<head; i++) {
+                const Event &e = events[i % EVENTS_PER_THREAD];
+                out << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer.id;
+                out << ", \"ts\": " << (e.start - start_ticks) * us_per_tick;
+                out << ", \"dur\": " << (e.end - e.start) * us_per_tick << "}";
+                num_events++;
+            }
+        }
+        out << "\n]}\n";
+        std::cout << "trace: " << num_events << " events from " << buffers.size();
+        std::cout << " threads written to " << filepath << std::endl;
+    }
+}
+
+#define TRACE_CONCAT_INNER(a, b) a ## b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifndef TRACE_DISABLED
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) trace::setThreadName(name)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD_NAME(name)
+#endif
+
+#endif
@@ -0,0 +1,487 @@
+#ifndef TRANSFORMS_HEADER_GUARD
+#define TRANSFORMS_HEADER_GUARD
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <immintrin.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <rng.hpp>
+#include <threads.hpp>
+#include <timing.hpp>
+#include <trace.hpp>
+
+
+/*
+ Builds lots of model matrices at once from structure-of-arrays inputs.
+
+ Each matrix is the same as
+    glm::scale(glm::rotate(glm::translate(I, pos), angle, axis), vec3(scale))
+ and is written column-major into a glm::mat4, ready for an instance buffer.
+
+ The SSE and AVX2 paths do 4 and 8 objects per loop iteration and the right
+ one is picked at runtime, big batches are also split across a thread pool.
+*/
+namespace transforms {
+
+    /*
+     Pointers to the structure-of-arrays inputs, each array is `count` long.
+    */
+    struct Batch {
+        const float *pos_x, *pos_y, *pos_z;
+        const float *axis_x, *axis_y, *axis_z;
+        const float *angle;             // Radians, keep within +-8192 for the SIMD sin and cos
+        const float *scale;
+        size_t count = 0;
+    };
+
+    /*
+     Owns the arrays behind a Batch.
+    */
+    struct Arrays {
+        std::vector<float> pos_x, pos_y, pos_z;
+        std::vector<float> axis_x, axis_y, axis_z;
+        std::vector<float> angle;
+        std::vector<float> scale;
+
+        void resize(size_t n) {
+            pos_x.resize(n); pos_y.resize(n); pos_z.resize(n);
+            axis_x.resize(n); axis_y.resize(n); axis_z.resize(n);
+            angle.resize(n, 0.0f);
+            scale.resize(n, 1.0f);
+        }
+
+        size_t size() const { return angle.size(); }
+
+        Batch batch() const {
+            Batch b;
+            b.pos_x = pos_x.data(); b.pos_y = pos_y.data(); b.pos_z = pos_z.data();
+            b.axis_x = axis_x.data(); b.axis_y = axis_y.data(); b.axis_z = axis_z.data();
+            b.angle = angle.data();
+            b.scale = scale.data();
+            b.count = size();
+            return b;
+        }
+    };
+
+    enum Isa {
+        SCALAR,
+        SSE,
+        AVX2
+    };
+
+    std::string isaName(Isa isa) {
+        switch (isa) {
+            case SCALAR: return "scalar";
+            case SSE:    return "sse";
+            case AVX2:   return "avx2";
+        }
+        return "unknown";
+    }
+
+    /*
+     Will find the widest instruction set the CPU we are running on supports.
+    */
+    Isa detectIsa() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return AVX2;
+        if (__builtin_cpu_supports("sse2")) return SSE;
+        return SCALAR;
+    }
+
+
+    /*
+     The reference path, one object at a time with the standard library's sin/cos.
+
+     This does exactly the same floating point operations as glm so the result is
+     bit identical to the glm::translate/rotate/scale chain.
+    */
+    void buildScalar(const Batch &in, size_t begin, size_t end, glm::mat4 *out) {
+        for (size_t i=begin; i<end; i++) {
+            float c = std::cos(in.angle[i]);
+            float s = std::sin(in.angle[i]);
+            glm::vec3 a = glm::normalize(glm::vec3(in.axis_x[i], in.axis_y[i], in.axis_z[i]));
+            glm::vec3 t = (1.0f - c) * a;
+            float sc = in.scale[i];
+
+            glm::mat4 &m = out[i];
+            m[0][0] = (c + t.x * a.x) * sc;
+            m[0][1] = (t.x * a.y + s * a.z) * sc;
+            m[0][2] = (t.x * a.z - s * a.y) * sc;
+            m[0][3] = 0.0f;
+
+            m[1][0] = (t.y * a.x - s * a.z) * sc;
+            m[1][1] = (c + t.y * a.y) * sc;
+            m[1][2] = (t.y * a.z + s * a.x) * sc;
+            m[1][3] = 0.0f;
+
+            m[2][0] = (t.z * a.x + s * a.y) * sc;
+            m[2][1] = (t.z * a.y - s * a.x) * sc;
+            m[2][2] = (c + t.z * a.z) * sc;
+            m[2][3] = 0.0f;
+
+            m[3][0] = in.pos_x[i];
+            m[3][1] = in.pos_y[i];
+            m[3][2] = in.pos_z[i];
+            m[3][3] = 1.0f;
+        }
+    }
+
+
+    /*
+     SSE2 sin and cos of 4 floats at once (the Cephes single precision
+     polynomials). Accurate to a couple of ulp for |x| < 8192.
+    */
+    void sincos4(__m128 x, __m128 &s, __m128 &c) {
+        const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+        __m128 sign_sin = _mm_and_ps(x, sign_mask);
+        x = _mm_andnot_ps(sign_mask, x);
+
+        // Scale by 4/Pi and round to an even octant
+        __m128 y = _mm_mul_ps(x, _mm_set1_ps(1.27323954473516f));
+        __m128i j = _mm_cvttps_epi32(y);
+        j = _mm_add_epi32(j, _mm_set1_epi32(1));
+        j = _mm_and_si128(j, _mm_set1_epi32(~1));
+        y = _mm_cvtepi32_ps(j);
+
+        __m128 swap_sin = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(j, _mm_set1_epi32(4)), 29));
+        __m128 poly_mask = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(j, _mm_set1_epi32(2)),
+                                                            _mm_setzero_si128()));
+        __m128 sign_cos = _mm_castsi128_ps(_mm_slli_epi32(
+                _mm_andnot_si128(_mm_sub_epi32(j, _mm_set1_epi32(2)), _mm_set1_epi32(4)), 29));
+        sign_sin = _mm_xor_ps(sign_sin, swap_sin);
+
+        // Extended precision modular arithmetic: x = ((x - y*DP1) - y*DP2) - y*DP3
+        x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(0.78515625f)));
+        x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(2.4187564849853515625e-4f)));
+        x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(3.77489497744594108e-8f)));
+        __m128 z = _mm_mul_ps(x, x);
+
+        // Cosine polynomial for the first octant
+        __m128 yc = _mm_set1_ps(2.443315711809948e-5f);
+        yc = _mm_add_ps(_mm_mul_ps(yc, z), _mm_set1_ps(-1.388731625493765e-3f));
+        yc = _mm_add_ps(_mm_mul_ps(yc, z), _mm_set1_ps(4.166664568298827e-2f));
+        yc = _mm_mul_ps(_mm_mul_ps(yc, z), z);
+        yc = _mm_sub_ps(yc, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+        yc = _mm_add_ps(yc, _mm_set1_ps(1.0f));
+
+        // Sine polynomial for the first octant
+        __m128 ys = _mm_set1_ps(-1.9515295891e-4f);
+        ys = _mm_add_ps(_mm_mul_ps(ys, z), _mm_set1_ps(8.3321608736e-3f));
+        ys = _mm_add_ps(_mm_mul_ps(ys, z), _mm_set1_ps(-1.6666654611e-1f));
+        ys = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ys, z), x), x);
+
+        // Pick which polynomial gives sin and which gives cos in each octant
+        s = _mm_or_ps(_mm_and_ps(poly_mask, ys), _mm_andnot_ps(poly_mask, yc));
+        c = _mm_or_ps(_mm_and_ps(poly_mask, yc), _mm_andnot_ps(poly_mask, ys));
+        s = _mm_xor_ps(s, sign_sin);
+        c = _mm_xor_ps(c, sign_cos);
+    }
+
+    /*
+     4 objects per iteration with SSE2, any remainder goes through buildScalar.
+    */
+    void buildSSE(const Batch &in, size_t begin, size_t end, glm::mat4 *out) {
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 zero = _mm_setzero_ps();
+        size_t i = begin;
+
+        for (; i + 4 <= end; i += 4) {
+            __m128 ax = _mm_loadu_ps(in.axis_x + i);
+            __m128 ay = _mm_loadu_ps(in.axis_y + i);
+            __m128 az = _mm_loadu_ps(in.axis_z + i);
+            __m128 sc = _mm_loadu_ps(in.scale + i);
+
+            // Normalise the axis the same way glm::normalize does
+            __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, ax), _mm_mul_ps(ay, ay)), _mm_mul_ps(az, az));
+            __m128 inv_len = _mm_div_ps(one, _mm_sqrt_ps(len2));
+            ax = _mm_mul_ps(ax, inv_len);
+            ay = _mm_mul_ps(ay, inv_len);
+            az = _mm_mul_ps(az, inv_len);
+
+            __m128 s, c;
+            sincos4(_mm_loadu_ps(in.angle + i), s, c);
+            __m128 omc = _mm_sub_ps(one, c);
+            __m128 tx = _mm_mul_ps(omc, ax);
+            __m128 ty = _mm_mul_ps(omc, ay);
+            __m128 tz = _mm_mul_ps(omc, az);
+
+            __m128 cols[4][4];
+            cols[0][0] = _mm_mul_ps(_mm_add_ps(c, _mm_mul_ps(tx, ax)), sc);
+            cols[0][1] = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(tx, ay), _mm_mul_ps(s, az)), sc);
+            cols[0][2] = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(tx, az), _mm_mul_ps(s, ay)), sc);
+            cols[0][3] = zero;
+
+            cols[1][0] = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(ty, ax), _mm_mul_ps(s, az)), sc);
+            cols[1][1] = _mm_mul_ps(_mm_add_ps(c, _mm_mul_ps(ty, ay)), sc);
+            cols[1][2] = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(ty, az), _mm_mul_ps(s, ax)), sc);
+            cols[1][3] = zero;
+
+            cols[2][0] = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(tz, ax), _mm_mul_ps(s, ay)), sc);
+            cols[2][1] = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(tz, ay), _mm_mul_ps(s, ax)), sc);
+            cols[2][2] = _mm_mul_ps(_mm_add_ps(c, _mm_mul_ps(tz, az)), sc);
+            cols[2][3] = zero;
+
+            cols[3][0] = _mm_loadu_ps(in.pos_x + i);
+            cols[3][1] = _mm_loadu_ps(in.pos_y + i);
+            cols[3][2] = _mm_loadu_ps(in.pos_z + i);
+            cols[3][3] = one;
+
+            // Transpose from "one component of 4 objects" to "one column of 1 object"
+            float *dst = &out[i][0][0];
+            for (unsigned int col=0; col<4; col++) {
+                _MM_TRANSPOSE4_PS(cols[col][0], cols[col][1], cols[col][2], cols[col][3]);
+                _mm_storeu_ps(dst + 0 * 16 + col * 4, cols[col][0]);
+                _mm_storeu_ps(dst + 1 * 16 + col * 4, cols[col][1]);
+                _mm_storeu_ps(dst + 2 * 16 + col * 4, cols[col][2]);
+                _mm_storeu_ps(dst + 3 * 16 + col * 4, cols[col][3]);
+            }
+        }
+
+        buildScalar(in, i, end, out);
+    }
+
+
+    /*
+     The AVX2 version of sincos4, 8 floats at once.
+    */
+    __attribute__((target("avx2")))
+    void sincos8(__m256 x, __m256 &s, __m256 &c) {
+        const __m256 sign_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000));
+        __m256 sign_sin = _mm256_and_ps(x, sign_mask);
+        x = _mm256_andnot_ps(sign_mask, x);
+
+        __m256 y = _mm256_mul_ps(x, _mm256_set1_ps(1.27323954473516f));
+        __m256i j = _mm256_cvttps_epi32(y);
+        j = _mm256_add_epi32(j, _mm256_set1_epi32(1));
+        j = _mm256_and_si256(j, _mm256_set1_epi32(~1));
+        y = _mm256_cvtepi32_ps(j);
+
+        __m256 swap_sin = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, _mm256_set1_epi32(4)), 29));
+        __m256 poly_mask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(j, _mm256_set1_epi32(2)),
+                                                                  _mm256_setzero_si256()));
+        __m256 sign_cos = _mm256_castsi256_ps(_mm256_slli_epi32(
+                _mm256_andnot_si256(_mm256_sub_epi32(j, _mm256_set1_epi32(2)), _mm256_set1_epi32(4)), 29));
+        sign_sin = _mm256_xor_ps(sign_sin, swap_sin);
+
+        x = _mm256_sub_ps(x, _mm256_mul_ps(y, _mm256_set1_ps(0.78515625f)));
+        x = _mm256_sub_ps(x, _mm256_mul_ps(y, _mm256_set1_ps(2.4187564849853515625e-4f)));
+        x = _mm256_sub_ps(x, _mm256_mul_ps(y, _mm256_set1_ps(3.77489497744594108e-8f)));
+        __m256 z = _mm256_mul_ps(x, x);
+
+        __m256 yc = _mm256_set1_ps(2.443315711809948e-5f);
+        yc = _mm256_add_ps(_mm256_mul_ps(yc, z), _mm256_set1_ps(-1.388731625493765e-3f));
+        yc = _mm256_add_ps(_mm256_mul_ps(yc, z), _mm256_set1_ps(4.166664568298827e-2f));
+        yc = _mm256_mul_ps(_mm256_mul_ps(yc, z), z);
+        yc = _mm256_sub_ps(yc, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+        yc = _mm256_add_ps(yc, _mm256_set1_ps(1.0f));
+
+        __m256 ys = _mm256_set1_ps(-1.9515295891e-4f);
+        ys = _mm256_add_ps(_mm256_mul_ps(ys, z), _mm256_set1_ps(8.3321608736e-3f));
+        ys = _mm256_add_ps(_mm256_mul_ps(ys, z), _mm256_set1_ps(-1.6666654611e-1f));
+        ys = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(ys, z), x), x);
+
+        s = _mm256_blendv_ps(yc, ys, poly_mask);
+        c = _mm256_blendv_ps(ys, yc, poly_mask);
+        s = _mm256_xor_ps(s, sign_sin);
+        c = _mm256_xor_ps(c, sign_cos);
+    }
+
+    /*
+     8 objects per iteration with AVX2, any remainder goes through buildSSE.
+    */
+    __attribute__((target("avx2")))
+    void buildAVX2(const Batch &in, size_t begin, size_t end, glm::mat4 *out) {
+        const __m256 one = _mm256_set1_ps(1.0f);
+        const __m256 zero = _mm256_setzero_ps();
+        size_t i = begin;
+
+        for (; i + 8 <= end; i += 8) {
+            __m256 ax = _mm256_loadu_ps(in.axis_x + i);
+            __m256 ay = _mm256_loadu_ps(in.axis_y + i);
+            __m256 az = _mm256_loadu_ps(in.axis_z + i);
+            __m256 sc = _mm256_loadu_ps(in.scale + i);
+
+            __m256 len2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, ax), _mm256_mul_ps(ay, ay)),
+                                        _mm256_mul_ps(az, az));
+            __m256 inv_len = _mm256_div_ps(one, _mm256_sqrt_ps(len2));
+            ax = _mm256_mul_ps(ax, inv_len);
+            ay = _mm256_mul_ps(ay, inv_len);
+            az = _mm256_mul_ps(az, inv_len);
+
+            __m256 s, c;
+            sincos8(_mm256_loadu_ps(in.angle + i), s, c);
+            __m256 omc = _mm256_sub_ps(one, c);
+            __m256 tx = _mm256_mul_ps(omc, ax);
+            __m256 ty = _mm256_mul_ps(omc, ay);
+            __m256 tz = _mm256_mul_ps(omc, az);
+
+            __m256 cols[4][4];
+            cols[0][0] = _mm256_mul_ps(_mm256_add_ps(c, _mm256_mul_ps(tx, ax)), sc);
+            cols[0][1] = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(tx, ay), _mm256_mul_ps(s, az)), sc);
+            cols[0][2] = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(tx, az), _mm256_mul_ps(s, ay)), sc);
+            cols[0][3] = zero;
+
+            cols[1][0] = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(ty, ax), _mm256_mul_ps(s, az)), sc);
+            cols[1][1] = _mm256_mul_ps(_mm256_add_ps(c, _mm256_mul_ps(ty, ay)), sc);
+            cols[1][2] = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(ty, az), _mm256_mul_ps(s, ax)), sc);
+            cols[1][3] = zero;
+
+            cols[2][0] = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(tz, ax), _mm256_mul_ps(s, ay)), sc);
+            cols[2][1] = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(tz, ay), _mm256_mul_ps(s, ax)), sc);
+            cols[2][2] = _mm256_mul_ps(_mm256_add_ps(c, _mm256_mul_ps(tz, az)), sc);
+            cols[2][3] = zero;
+
+            cols[3][0] = _mm256_loadu_ps(in.pos_x + i);
+            cols[3][1] = _mm256_loadu_ps(in.pos_y + i);
+            cols[3][2] = _mm256_loadu_ps(in.pos_z + i);
+            cols[3][3] = one;
+
+            // 4x8 transpose, each 256 bit result holds one column of objects k and k+4
+            float *dst = &out[i][0][0];
+            for (unsigned int col=0; col<4; col++) {
+                __m256 t0 = _mm256_unpacklo_ps(cols[col][0], cols[col][1]);
+                __m256 t1 = _mm256_unpackhi_ps(cols[col][0], cols[col][1]);
+                __m256 t2 = _mm256_unpacklo_ps(cols[col][2], cols[col][3]);
+                __m256 t3 = _mm256_unpackhi_ps(cols[col][2], cols[col][3]);
+                __m256 o[4];
+                o[0] = _mm256_shuffle_ps(t0, t2, 0x44);
+                o[1] = _mm256_shuffle_ps(t0, t2, 0xEE);
+                o[2] = _mm256_shuffle_ps(t1, t3, 0x44);
+                o[3] = _mm256_shuffle_ps(t1, t3, 0xEE);
+                for (unsigned int k=0; k<4; k++) {
+                    _mm_storeu_ps(dst + k * 16 + col * 4, _mm256_castps256_ps128(o[k]));
+                    _mm_storeu_ps(dst + (k + 4) * 16 + col * 4, _mm256_extractf128_ps(o[k], 1));
+                }
+            }
+        }
+
+        buildSSE(in, i, end, out);
+    }
+
+
+    /*
+     Will build a model matrix for every object in the batch.
+
+     Inputs:
+        * in <const Batch &> => The structure-of-arrays inputs.
+        * out <glm::mat4 *> => Where to write the matrices (in.count of them).
+        * isa <Isa> => Which code path to use, defaults to the best one available.
+        * pool <threads::Pool *> => If given, big batches are split across it.
+    */
+    void build(const Batch &in, glm::mat4 *out, Isa isa=detectIsa(), threads::Pool *pool=NULL) {
+        TRACE_SCOPE("transforms::build");
+        void (*fn)(const Batch&, size_t, size_t, glm::mat4*) = buildScalar;
+        if (isa == SSE)  fn = buildSSE;
+        if (isa == AVX2) fn = buildAVX2;
+
+        if (pool == NULL) {
+            fn(in, 0, in.count, out);
+            return;
+        }
+
+        // Keep the chunks a multiple of 8 so only the final one has a scalar tail
+        const size_t min_chunk = 16384;
+        pool->parallelFor((in.count + 7) / 8, min_chunk / 8, [&](size_t begin, size_t end) {
+            size_t last = end * 8 < in.count ? end * 8 : in.count;
+            fn(in, begin * 8, last, out);
+        });
+    }
+
+    /*
+     The biggest absolute difference between the built matrices and the glm
+     translate/rotate/scale chain.
+    */
+    float maxErrorVsGlm(const Batch &in, const glm::mat4 *built) {
+        float max_err = 0.0f;
+        for (size_t i=0; i<in.count; i++) {
+            glm::mat4 m = glm::translate(glm::mat4(1.0f), glm::vec3(in.pos_x[i], in.pos_y[i], in.pos_z[i]));
+            m = glm::rotate(m, in.angle[i], glm::vec3(in.axis_x[i], in.axis_y[i], in.axis_z[i]));
+            m = glm::scale(m, glm::vec3(in.scale[i]));
+            for (unsigned int c=0; c<4; c++) {
+                for (unsigned int r=0; r<4; r++) {
+                    float err = std::fabs(m[c][r] - built[i][c][r]);
+                    if (err > max_err) max_err = err;
+                }
+            }
+        }
+        return max_err;
+    }
+
+    /*
+     Will time every code path on a batch of random objects and print the
+     matrices built per second (per core for the threaded run) along with
+     the error against glm.
+
+     Inputs:
+        * count <size_t> => How many objects in the batch.
+        * pool <threads::Pool &> => The pool to use for the threaded run.
+    */
+    void benchmark(size_t count, threads::Pool &pool) {
+        Arrays arrays;
+        arrays.resize(count);
+        rng::Xoshiro128 r(1);
+        for (size_t i=0; i<count; i++) {
+            arrays.pos_x[i] = r.uniform(-25.0f, 25.0f);
+            arrays.pos_y[i] = r.uniform(-25.0f, 25.0f);
+            arrays.pos_z[i] = r.uniform(-25.0f, 25.0f);
+            arrays.axis_x[i] = r.uniform(0.01f, 1.01f);
+            arrays.axis_y[i] = r.uniform(0.01f, 1.01f);
+            arrays.axis_z[i] = r.uniform(0.01f, 1.01f);
+            arrays.angle[i] = r.uniform(-100.0f, 100.0f);
+            arrays.scale[i] = r.uniform(0.5f, 1.5f);
+        }
+        Batch batch = arrays.batch();
+        std::vector<glm::mat4> out(count);
+        const unsigned int reps = 10;
+
+        std::cout << "Building " << count << " model matrices, best of " << reps << " runs\n";
+
+        // The plain glm chain as the baseline
+        double best = 1e30;
+        for (unsigned int r=0; r<reps; r++) {
+            timing::Stopwatch timer;
+            for (size_t i=0; i<count; i++) {
+                glm::mat4 m = glm::translate(glm::mat4(1.0f), glm::vec3(batch.pos_x[i], batch.pos_y[i], batch.pos_z[i]));
+                m = glm::rotate(m, batch.angle[i], glm::vec3(batch.axis_x[i], batch.axis_y[i], batch.axis_z[i]));
+                out[i] = glm::scale(m, glm::vec3(batch.scale[i]));
+            }
+            double t = timer.seconds();
+            if (t < best) best = t;
+        }
+        std::cout << "  glm            " << count / best / 1e6 << " M matrices/s per core\n";
+
+        Isa available = detectIsa();
+        for (int isa=SCALAR; isa<=available; isa++) {
+            best = 1e30;
+            for (unsigned int r=0; r<reps; r++) {
+                timing::Stopwatch timer;
+                build(batch, out.data(), (Isa) isa);
+                double t = timer.seconds();
+                if (t < best) best = t;
+            }
+            std::cout << "  " << isaName((Isa) isa);
+            std::cout << std::string(15 - isaName((Isa) isa).size(), ' ');
+            std::cout << count / best / 1e6 << " M matrices/s per core, ";
+            std::cout << "max error vs glm " << maxErrorVsGlm(batch, out.data()) << "\n";
+        }
+
+        best = 1e30;
+        for (unsigned int r=0; r<reps; r++) {
+            timing::Stopwatch timer;
+            build(batch, out.data(), available, &pool);
+            double t = timer.seconds();
+            if (t < best) best = t;
+        }
+        std::cout << "  " << isaName(available) << " x " << pool.numThreads() << " threads ";
+        std::cout << count / best / 1e6 << " M matrices/s, ";
+        std::cout << count / best / 1e6 / pool.numThreads() << " M/s per core" << std::endl;
+    }
+}
+
+#endif
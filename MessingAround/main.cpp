@@ -7,25 +7,59 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 // Own modules
 #include <input.hpp>
 #include <render.hpp>
 #include <files.hpp>
 #include <shaders.hpp>
+#include <options.hpp>
+#include <timing.hpp>
+#include <instancing.hpp>
+#include <threads.hpp>
+#include <transforms.hpp>
+#include <culling.hpp>
+#include <mesh.hpp>
+#include <gl43.hpp>
+#include <gpuculling.hpp>
+#include <textures.hpp>
+#include <renderqueue.hpp>
+#include <framestate.hpp>
+#include <ringbuffer.hpp>
+#include <headless.hpp>
+#include <gpuprofiler.hpp>
+#include <trace.hpp>
+#include <lod.hpp>
+#include <occlusion.hpp>
+#include <softraster.hpp>
+#include <staticbatch.hpp>
+#include <geometrypool.hpp>
+#include <multidraw.hpp>
+#include <capture.hpp>
+#include <camerapath.hpp>
+#include <scene.hpp>
+#include <rng.hpp>
+#include <scenegen.hpp>
+#include <scenefile.hpp>
 #include <cmath>
 
 
 shader::Program ShaderProgram;
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
+void applyResize();
+std::atomic<bool> resizePending(false);
+std::atomic<int> pendingWidth(0), pendingHeight(0);
 
 
 unsigned int SCR_HEIGHT = 1000;
 unsigned int SCR_WIDTH  = 1000;
-const unsigned int numCubes = 10;
+unsigned int numCubes = 10;
 const float backgroundRGBA[4] = {0.0, 0.0, 0.0, 0.0};
-
-std::vector<glm::vec3> cubePositions;
+const double simulationHz = 120.0;
+const double virtualFrameSeconds = 1.0 / 60.0;
 
 //// Init camera at -3z pointing at origin.
 //glm::vec3 cameraPos = glm::vec3(0.0f, 0.0f, 3.0f);
@@ -36,215 +70,1145 @@ std::vector<glm::vec3> cubePositions;
 //glm::vec3 cameraUp = glm::normalize(glm::cross(viewDirection, cameraRight));
 
 
-std::vector<std::vector<float>> randRot;
-int main () {
-    
-    // Allocate random positions for the cubes
-    cubePositions.resize(numCubes);
-    randRot.resize(numCubes);
-    for (unsigned int i=0; i<numCubes; i++) {
-        double x = 50 * (-0.5 + (rand() / (double) RAND_MAX));
-        double y = 50 * (-0.5 + (rand() / (double) RAND_MAX));
-        double z = 50 * (-0.5 + (rand() / (double) RAND_MAX));
-        cubePositions[i] = glm::vec3(x, y, z);
-        randRot[i].resize(3);
-        randRot[i][0] = 10.0f * rand() / RAND_MAX;
-        randRot[i][1] = 10.0f * rand() / RAND_MAX;
-        randRot[i][2] = 10.0f * rand() / RAND_MAX;
+int main (int argc, char **argv) {
+
+    // Read the command line options
+    options::Options Opts = options::parse(argc, argv);
+    numCubes = Opts.num_cubes;
+    SCR_WIDTH = Opts.width;
+    SCR_HEIGHT = Opts.height;
+    trace::enabled.store(!Opts.trace_file.empty());
+    TRACE_THREAD_NAME("main");
+
+    // Worker threads for the big per object loops
+    threads::Pool Workers;
+
+    if (Opts.bench == "transforms") {
+        transforms::benchmark(1 << 20, Workers);
+        return 0;
+    }
+    if (Opts.bench == "jobs") {
+        threads::benchmark(1 << 20);
+        return 0;
+    }
+    if (Opts.bench == "bvh") {
+        culling::benchmark(1 << 20);
+        return 0;
+    }
+    if (Opts.bench == "entities") {
+        scene::benchmark(1 << 20);
+        return 0;
+    }
+
+    const std::string materialFiles[4] = {"img/shrekface.png", "img/container.jpg",
+                                          "img/wall.jpg", "img/awesomeface.png"};
+
+    // Scatter the cubes from the seed, each spinning about its own axis
+    scene::Store Scene;
+    {
+        auto start = std::chrono::steady_clock::now();
+        scenegen::Params gen;
+        gen.count = numCubes;
+        gen.seed = Opts.seed;
+        gen.distribution = scenegen::distributionFromName(Opts.distribution);
+        gen.num_meshes = Opts.num_shapes > 0 ? Opts.num_shapes : 1;
+        gen.num_materials = Opts.num_materials;
+        scenegen::generate(Scene, gen, Workers);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "scene: " << numCubes << " cubes, " << Opts.distribution << ", seed " << Opts.seed
+                  << ", generated in " << ms << " ms" << std::endl;
+    }
+
+    // Or write them out, frozen where they are a second in
+    if (!Opts.save_scene_file.empty()) {
+        scenefile::Contents contents;
+        contents.instances.resize(Scene.size());
+        for (size_t i=0; i<Scene.size(); i++) {
+            scenefile::Instance &inst = contents.instances[i];
+            float half = 0.5f * Scene.speed[i];
+            inst.position = Scene.position(i);
+            inst.scale = Scene.scale[i];
+            inst.rotation = glm::vec4(sinf(half) * glm::normalize(Scene.axis(i)), cosf(half));
+            inst.mesh = Scene.mesh[i];
+            inst.material = Scene.material[i];
+        }
+        for (unsigned int s=0; s<std::max(Opts.num_shapes, 1u); s++) {
+            contents.meshes.push_back(Opts.num_shapes > 0 ? "shape" + std::to_string(s) : "cube");
+            contents.mesh_radii.push_back(0.5f * sqrtf(3.0f));
+        }
+        contents.textures.assign(materialFiles, materialFiles + Opts.num_materials);
+        size_t bytes = scenefile::write(Opts.save_scene_file, contents);
+        std::cout << "scene: wrote " << Scene.size() << " instances to '" << Opts.save_scene_file;
+        std::cout << "' (" << bytes << " bytes)" << std::endl;
+        return 0;
+    }
+
+    // A scene file is mapped rather than read, nothing is looked at per instance
+    scenefile::File SceneFile;
+    if (!Opts.scene_file.empty()) {
+        auto start = std::chrono::steady_clock::now();
+        SceneFile.open(Opts.scene_file);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "scene: mapped " << SceneFile.numInstances() << " instances in " << SceneFile.numChunks();
+        std::cout << " chunks from '" << Opts.scene_file << "' (" << SceneFile.numBytes() << " bytes) in ";
+        std::cout << ms << " ms" << std::endl;
+    }
+
+    // And the ones that never move, cycling through the materials
+    std::vector<staticbatch::Instance> staticCubes(Opts.num_static);
+    rng::Xoshiro128 StaticRng(Opts.seed, scenegen::STATIC_STREAM);
+    for (unsigned int i=0; i<Opts.num_static; i++) {
+        glm::vec3 position, axis;
+        position.x = StaticRng.uniform(-25.0f, 25.0f);
+        position.y = StaticRng.uniform(-25.0f, 25.0f);
+        position.z = StaticRng.uniform(-25.0f, 25.0f);
+        axis.x = StaticRng.uniform(0.1f, 1.1f);
+        axis.y = StaticRng.uniform(0.1f, 1.1f);
+        axis.z = StaticRng.uniform(0.1f, 1.1f);
+        float angle = StaticRng.uniform(0.0f, 10.0f);
+        staticCubes[i].model = glm::rotate(glm::translate(glm::mat4(1.0f), position), angle, axis);
+        staticCubes[i].material = i % Opts.num_materials;
     }
     
 
-    // Read the vertices array
+    // The vertices array (read on the job system once the context is up)
     IO::IntArrayFile Elements;
-    Elements.read("./data/elements.arr");
     IO::FloatArrayFile Vertices;
-    Vertices.read("./data/vertices.arr");
+
+    // A scripted flythrough replaces the keyboard camera
+    camerapath::Path CameraPath;
+    camerapath::SegmentStats PathStats;
+    bool playingPath = !Opts.path_file.empty();
+    if (playingPath)
+        CameraPath.load(Opts.path_file);
+
+    // Input recorded from an earlier run replaces the keyboard and mouse
+    input::Poller InputPoller;
+    input::Log InputLog;
+    input::Replay InputReplay;
+    bool replaying = !Opts.replay_file.empty();
+    bool recording = !Opts.record_file.empty();
+    if (replaying) {
+        InputLog.load(Opts.replay_file);
+        InputReplay.start(InputLog);
+    }
 
     /*
      Init methods -initialise GLAD and GLFW and check everything is linked properly.
     */
-    // Check GLFW is initialised correctly
-    if (!glfwInit()) {
-        std::cerr << "GLFW not configured correctly!" << std::endl;
-        return -1;
+    // GPU culling needs compute shaders from 4.3 and multi-draw needs indirect draws
+    bool needsGL43 = Opts.cull == options::CULL_GPU || Opts.multidraw;
+    // The software renderer only needs GL to show its frames in a window
+    bool software = Opts.renderer == options::RENDERER_SOFT;
+    bool useGL = !(software && Opts.headless);
+    GLFWwindow* window = NULL;
+    headless::Context HeadlessContext;
+    GLADloadproc loadProc = (GLADloadproc)glfwGetProcAddress;
+
+    if (Opts.headless && !software) {
+        // No window at all, just a GL context from EGL
+        HeadlessContext.create(needsGL43 ? 4 : 3, 3);
+        loadProc = (GLADloadproc)headless::getProcAddress;
     }
 
-    // Create the context for the GLFW window
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    else if (!Opts.headless) {
+        // Check GLFW is initialised correctly
+        if (!glfwInit()) {
+            std::cerr << "GLFW not configured correctly!" << std::endl;
+            return -1;
+        }
 
-    // Create the window
-    GLFWwindow* window = glfwCreateWindow(SCR_HEIGHT, SCR_WIDTH, "Playing With Shrek", NULL, NULL);
-    if (window == NULL) {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
-    } glfwMakeContextCurrent(window);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+        // Create the context for the GLFW window
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, needsGL43 ? 4 : 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+        // Create the window
+        window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "Playing With Shrek", NULL, NULL);
+        if (window == NULL) {
+            std::cout << "Failed to create GLFW window" << std::endl;
+            glfwTerminate();
+            return -1;
+        } glfwMakeContextCurrent(window);
+        glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+        InputPoller.attach(window);
+
+        // Benchmarks shouldn't be capped at the refresh rate
+        if (Opts.bench == "frames")
+            glfwSwapInterval(0);
+    }
 
 
     // Check Glad is initialised correctly
-    //  This must be after the glfwMakeContextCurrent is called.
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
+    //  This must be after the context has been made current.
+    if (useGL && !gladLoadGLLoader(loadProc)) {
         std::cout << "Failed to initialise GLAD" << std::endl;
         return -1;
     }
+    if (needsGL43 && !gl43::load(loadProc)) {
+        if (!Opts.headless) glfwTerminate();
+        return -1;
+    }
+
+    // Read the arrays and decode the material images on the workers while
+    // this thread sets GL up, only the texture uploads have to wait for them
+    std::vector<textures::Image> materialImages(Opts.num_materials);
+    std::vector<softraster::Texture> softMaterials(software ? Opts.num_materials : 0);
+    threads::Counter Loading;
+    Workers.run([&] { Elements.read("./data/elements.arr"); }, &Loading);
+    Workers.run([&] { Vertices.read("./data/vertices.arr"); }, &Loading);
+    for (unsigned int m=0; m<Opts.num_materials; m++) {
+        if (software)
+            Workers.run([&, m] { softMaterials[m] = softraster::loadTexture(materialFiles[m]); }, &Loading);
+        else
+            Workers.run([&, m] { materialImages[m] = textures::decode(materialFiles[m]); }, &Loading);
+    }
+
+    // Without a window everything is drawn into an off screen framebuffer
+    headless::Framebuffer Target;
+    if (Opts.headless && !software)
+        Target.create(SCR_WIDTH, SCR_HEIGHT);
+
+    // Or everything is drawn by the software rasteriser
+    softraster::Renderer SoftRenderer;
+    softraster::Presenter SoftPresenter;
+    softraster::StatsAccumulator SoftStats;
+    if (software)
+        SoftRenderer.create(SCR_WIDTH, SCR_HEIGHT);
+
+    // Every frame can be read back and written out without waiting for it
+    capture::Capturer Capture;
+    if (!Opts.dump_dir.empty())
+        Capture.create(SCR_WIDTH, SCR_HEIGHT, capture::formatFromName(Opts.dump_format), Opts.dump_dir, !software);
     
 
     /*
      OpenGL Stuff -Creating a triangle and rendering
     */
-    // Create the OpenGL canvas and make it resize when the window is resized
-    glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
-
-    // Compile the vertex/fragment shader and create the shader program.
-    // Create shaders
-    shader::SingleShader VertexShader("./src/vertexShader.vert", GL_VERTEX_SHADER); 
-    shader::SingleShader FragmentShader("./src/fragmentShader.frag", GL_FRAGMENT_SHADER); 
-    shader::SingleShader Shaders[2] = {VertexShader, FragmentShader};
-
-    // Create program
-    ShaderProgram.addShaders(Shaders, 2);
-
-    // Create texture Shrek
-    unsigned int textureShrek;
-    int width, height, nrChannels;
-    unsigned char *data;
-    glGenTextures(1, &textureShrek);
-    glBindTexture(GL_TEXTURE_2D, textureShrek);
-    // Set some parameters to tell OpenGL how the texture should be used.
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    std::string tex_filepath = "img/shrekface.png";
-    stbi_set_flip_vertically_on_load(true);
-    data = stbi_load(tex_filepath.c_str(), &width, &height, &nrChannels, 0);
-    if (data) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+    if (!software) {
+        // Create the OpenGL canvas and make it resize when the window is resized
+        glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
+
+        // Compile the vertex/fragment shader and create the shader program.
+        // Create shaders
+        std::string vertex_filepath = "./src/vertexShader.vert";
+        if (Opts.mode == options::INSTANCED)
+            vertex_filepath = "./src/instancedShader.vert";
+        else if (Opts.mode == options::GPU_ANIMATED && Opts.cull == options::CULL_GPU)
+            vertex_filepath = "./src/culledShader.vert";
+        else if (Opts.mode == options::GPU_ANIMATED)
+            vertex_filepath = "./src/animatedShader.vert";
+        shader::SingleShader VertexShader(vertex_filepath, GL_VERTEX_SHADER); 
+        shader::SingleShader FragmentShader("./src/fragmentShader.frag", GL_FRAGMENT_SHADER); 
+        shader::SingleShader Shaders[2] = {VertexShader, FragmentShader};
+
+        // Create program
+        ShaderProgram.addShaders(Shaders, 2);
+    }
+
+    // The materials the cubes cycle through (only Shrek unless --materials is given)
+    Workers.wait(Loading);
+    unsigned int textureShrek = 0;
+    std::vector<unsigned int> materials;
+    if (!software) {
+        for (unsigned int m=0; m<Opts.num_materials; m++)
+            materials.push_back(textures::upload(materialImages[m]));
+    }
+    if (!software)
+        textureShrek = materials[0];
+
+
+    unsigned int VBO_handle = 0, VAO_handle = 0, EBO_handle = 0;
+    if (!software) {
+        // Create the buffers (vertex buffer, vertex array and element buffer)
+        glGenVertexArrays(1, &VAO_handle);
+        glGenBuffers(1, &VBO_handle);
+        glGenBuffers(1, &EBO_handle);
+        glEnable(GL_DEPTH_TEST);
+
+        // Do the OpenGL infrastructure stuff
+        glBindVertexArray(VAO_handle);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO_handle);
+
+        glBufferData(GL_ARRAY_BUFFER, Vertices.size, Vertices.data, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO_handle);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, Elements.size, Elements.data, GL_STATIC_DRAW);
+
+        // Tell OpenGL where to look for the positions
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+
+        //// Tell OpenGL where to look for the colors
+        //glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE, 8 * sizeof(float), (void*)(3* sizeof(float)));
+        //glEnableVertexAttribArray(1);
+        // Tell OpenGL where to look for the texture
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_TRUE, 5 * sizeof(float), (void*)(3* sizeof(float)));
+        glEnableVertexAttribArray(1);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+
+    // Create the per-instance model matrix buffer (only used when instancing)
+    instancing::InstanceBuffer Instances;
+    ringbuffer::Ring InstanceRing;
+
+    // With --lod the cubes are swapped for finely tessellated rounded ones with generated levels of detail
+    lod::Chain CubeLods;
+    mesh::GLMesh LodMesh;
+    lod::Selector LodSelector;
+    lod::StatsAccumulator LodStats;
+    std::vector<unsigned int> allCubes;
+    std::vector<glm::mat4> lodModels;
+    if (Opts.lod > 0) {
+        mesh::Mesh rounded = mesh::tessellate(mesh::fromArrayFile(Vertices), Opts.lod);
+        mesh::spherify(rounded, 0.6f, 0.5f);
+        CubeLods = lod::buildChain(rounded);
+        lod::printChain(CubeLods);
+        if (!software)
+            LodMesh.create(CubeLods.mesh);
+        LodSelector.threshold_pixels = Opts.lod_error;
+
+        allCubes.resize(numCubes);
+        for (unsigned int i=0; i<numCubes; i++)
+            allCubes[i] = i;
+        lodModels.resize(numCubes);
+    }
+
+    if (Opts.mode == options::INSTANCED && !software) {
+        Instances.create(Opts.lod > 0 ? LodMesh.VAO_handle : VAO_handle, numCubes);
+        if (Opts.upload == options::UPLOAD_RING) {
+            bool storage = gl43::loadBufferStorage(loadProc);
+            InstanceRing.create(numCubes * sizeof(glm::mat4), storage);
+        }
+    }
+
+    // Or upload the static animation parameters once and let the GPU rotate the cubes
+    instancing::AnimatedInstanceBuffer AnimatedInstances;
+    if (Opts.mode == options::GPU_ANIMATED) {
+        std::vector<instancing::AnimatedInstance> params(numCubes);
+        for (unsigned int i=0; i<numCubes; i++) {
+            params[i].position = Scene.position(i);
+            params[i].axis = Scene.axis(i);
+            params[i].speed = Scene.speed[i];
+        }
+        if (Opts.cull != options::CULL_GPU)
+            AnimatedInstances.create(VAO_handle, params.data(), numCubes);
+    }
+
+    // Or hand the instances to the compute shader culler, which needs an indexed cube
+    mesh::GLMesh IndexedCube;
+    gpuculling::Culler GpuCuller;
+    shader::Program CullProgram;
+    if (Opts.cull == options::CULL_GPU) {
+        IndexedCube.create(mesh::fromArrayFile(Vertices));
+
+        std::vector<gpuculling::Instance> instances(numCubes);
+        for (unsigned int i=0; i<numCubes; i++) {
+            instances[i].position_radius = glm::vec4(Scene.centre[i], Scene.radius[i]);
+            instances[i].axis_speed = glm::vec4(Scene.axis(i), Scene.speed[i]);
+            instances[i].mesh = 0;
+        }
+        std::vector<gpuculling::MeshRange> meshes(1);
+        meshes[0].num_indices = IndexedCube.num_indices;
+        meshes[0].first_index = 0;
+        meshes[0].base_vertex = 0;
+        GpuCuller.create(IndexedCube.VAO_handle, instances, meshes);
+
+        shader::SingleShader CullShader("./src/cullInstances.comp", GL_COMPUTE_SHADER);
+        CullProgram.addShaders(&CullShader, 1);
+    }
+
+    // Build a BVH over the cubes' bounding spheres for frustum culling
+    culling::BVH CubeBVH;
+    culling::StatsAccumulator CullStats;
+    std::vector<unsigned int> visible;
+    std::vector<glm::mat4> visibleModels;
+    if (Opts.cull == options::CULL_CPU) {
+        CubeBVH.build(Scene.centre, Scene.radius);
+        visibleModels.resize(numCubes);
+    }
+
+    // And a small software depth buffer of the nearest cubes to cull the ones they hide
+    occlusion::Culler Occluder;
+    occlusion::StatsAccumulator OcclusionStats;
+    if (Opts.occlusion)
+        Occluder.create(256, 256 * SCR_HEIGHT / SCR_WIDTH, mesh::fromArrayFile(Vertices));
+
+    // Merge the static cubes into a few big chunks, drawn with their own (model = identity) program
+    staticbatch::Batch StaticBatch;
+    staticbatch::StatsAccumulator StaticStats;
+    shader::Program StaticProgram;
+    if (Opts.num_static > 0) {
+        StaticBatch.build(Vertices, staticCubes);
+        if (!software) {
+            StaticBatch.upload();
+            shader::SingleShader StaticVertexShader("./src/vertexShader.vert", GL_VERTEX_SHADER);
+            shader::SingleShader StaticFragmentShader("./src/fragmentShader.frag", GL_FRAGMENT_SHADER);
+            shader::SingleShader StaticShaders[2] = {StaticVertexShader, StaticFragmentShader};
+            StaticProgram.addShaders(StaticShaders, 2);
+            StaticProgram.use();
+            StaticProgram.set("textureShrek", 0);
+            StaticProgram.set("model", glm::mat4(1.0f));
+        }
+    }
+
+    // With --shapes the per-draw cubes cycle through meshes of different detail and roundness,
+    // each in buffers of its own or all sub-allocated from one pool
+    std::vector<mesh::Mesh> shapes(Opts.num_shapes);
+    std::vector<unsigned int> shapeDetail(Opts.num_shapes);
+    std::vector<mesh::GLMesh> shapeMeshes(Opts.num_shapes);
+    std::vector<unsigned int> shapeHandles(Opts.num_shapes);
+    geometrypool::Pool GeometryPool;
+    mesh::Mesh indexedCube = mesh::fromArrayFile(Vertices);
+    auto makeShape = [&](unsigned int s) {
+        mesh::Mesh m = mesh::tessellate(indexedCube, shapeDetail[s]);
+        mesh::spherify(m, 0.6f, s / 8.0f);
+        return m;
+    };
+    auto uploadShape = [&](unsigned int s) {
+        if (Opts.geometry == options::GEOMETRY_POOL)
+            shapeHandles[s] = GeometryPool.add(shapes[s]);
+        else
+            shapeMeshes[s].create(shapes[s]);
+    };
+    if (Opts.num_shapes > 0) {
+        unsigned int numVertices = 0, numIndices = 0;
+        for (unsigned int s=0; s<Opts.num_shapes; s++) {
+            shapeDetail[s] = s + 1;
+            shapes[s] = makeShape(s);
+            numVertices += shapes[s].numVertices();
+            numIndices += shapes[s].numIndices();
+        }
+        if (!software) {
+            // Room for twice the starting shapes, it grows if it has to
+            if (Opts.geometry == options::GEOMETRY_POOL)
+                GeometryPool.create(indexedCube.stride, 2 * numVertices, 2 * numIndices);
+            for (unsigned int s=0; s<Opts.num_shapes; s++)
+                uploadShape(s);
+        }
+    }
+
+    /*
+     Will rebuild a shape at the other of its two levels of detail, handing
+     its old buffers (or pool ranges) back.
+    */
+    auto reshape = [&](unsigned int s) {
+        shapeDetail[s] = shapeDetail[s] == s + 1 ? 2 * (s + 1) : s + 1;
+        shapes[s] = makeShape(s);
+        if (software) return;
+        if (Opts.geometry == options::GEOMETRY_POOL)
+            GeometryPool.remove(shapeHandles[s]);
+        else
+            shapeMeshes[s].destroy();
+        uploadShape(s);
+    };
+    unsigned int framesSinceReshape = 0, numReshapes = 0;
+
+    // The mapped scene file's instances go to the GPU as they are, its meshes
+    // are named after the built in ones and its textures are image files
+    scenefile::Layer SceneLayer;
+    scenefile::StatsAccumulator SceneLayerStats;
+    shader::Program SceneProgram;
+    if (SceneFile.isOpen()) {
+        std::vector<mesh::Mesh> sceneMeshes;
+        for (const std::string &name : SceneFile.meshes) {
+            unsigned int s = 0;
+            if (name == "cube")
+                sceneMeshes.push_back(indexedCube);
+            else if (sscanf(name.c_str(), "shape%u", &s) == 1 && s < 8) {
+                sceneMeshes.push_back(mesh::tessellate(indexedCube, s + 1));
+                mesh::spherify(sceneMeshes.back(), 0.6f, s / 8.0f);
+            } else {
+                std::cerr << "Unknown mesh '" << name << "' in the scene file" << std::endl;
+                throw "SceneFileError";
+            }
+        }
+        std::vector<unsigned int> sceneTextures;
+        for (const std::string &name : SceneFile.textures)
+            sceneTextures.push_back(textures::load(name));
+        SceneLayer.create(SceneFile, sceneMeshes, sceneTextures);
+
+        shader::SingleShader SceneVertexShader("./src/sceneShader.vert", GL_VERTEX_SHADER);
+        shader::SingleShader SceneFragmentShader("./src/fragmentShader.frag", GL_FRAGMENT_SHADER);
+        shader::SingleShader SceneShaders[2] = {SceneVertexShader, SceneFragmentShader};
+        SceneProgram.addShaders(SceneShaders, 2);
+        SceneProgram.use();
+        SceneProgram.set("textureShrek", 0);
+    }
+
+    // Or batch them into a few indirect multi-draws, taking the model matrix from an instance attribute
+    multidraw::Batcher MultiDraw;
+    multidraw::StatsAccumulator MultiDrawStats;
+    shader::Program MultiDrawProgram;
+    if (Opts.multidraw) {
+        MultiDraw.create(GeometryPool.VAO_handle, numCubes);
+        shader::SingleShader MultiDrawVertexShader("./src/instancedShader.vert", GL_VERTEX_SHADER);
+        shader::SingleShader MultiDrawFragmentShader("./src/fragmentShader.frag", GL_FRAGMENT_SHADER);
+        shader::SingleShader MultiDrawShaders[2] = {MultiDrawVertexShader, MultiDrawFragmentShader};
+        MultiDrawProgram.addShaders(MultiDrawShaders, 2);
+        MultiDrawProgram.use();
+        MultiDrawProgram.set("textureShrek", 0);
+    }
+
+    /*
+     Will point a per-draw item at one of the shapes.
+    */
+    auto shapeDraw = [&](unsigned int s, renderqueue::DrawItem &item) {
+        item.indexed = true;
+        if (Opts.geometry == options::GEOMETRY_POOL) {
+            const geometrypool::MeshRange &r = GeometryPool.ranges[shapeHandles[s]];
+            item.VAO_handle = GeometryPool.VAO_handle;
+            item.first = r.first_index;
+            item.num_vertices = r.num_indices;
+            item.base_vertex = r.base_vertex;
+        } else {
+            item.VAO_handle = shapeMeshes[s].VAO_handle;
+            item.first = 0;
+            item.num_vertices = shapeMeshes[s].num_indices;
+            item.base_vertex = 0;
+        }
+    };
+
+    // Timer queries around the passes of each frame
+    gpuprofiler::Profiler GpuProfiler;
+    GpuProfiler.enabled = Opts.gpu_timers;
+
+    // The sort-key render queue for the per draw path
+    renderqueue::Queue Queue;
+    renderqueue::StatsAccumulator QueueStats;
+
+
+    if (software) {
+        ShaderProgram.projection = shader::perspective((float) SCR_WIDTH, (float) SCR_HEIGHT);
     } else {
-        std::cerr << "Failed to load texture: '" << tex_filepath << "' " << std::endl;
-        throw "IOError";
-    }
-    stbi_image_free(data);
-
-
-    // Create the buffers (vertex buffer, vertex array and element buffer)
-    unsigned int VBO_handle, VAO_handle, EBO_handle;
-    glGenVertexArrays(1, &VAO_handle);
-    glGenBuffers(1, &VBO_handle);
-    glGenBuffers(1, &EBO_handle);
-    glEnable(GL_DEPTH_TEST);
-
-    // Do the OpenGL infrastructure stuff
-    glBindVertexArray(VAO_handle);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO_handle);
-
-    glBufferData(GL_ARRAY_BUFFER, Vertices.size, Vertices.data, GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO_handle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, Elements.size, Elements.data, GL_STATIC_DRAW);
-
-    // Tell OpenGL where to look for the positions
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-
-    //// Tell OpenGL where to look for the colors
-    //glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE, 8 * sizeof(float), (void*)(3* sizeof(float)));
-    //glEnableVertexAttribArray(1);
-    // Tell OpenGL where to look for the texture
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_TRUE, 5 * sizeof(float), (void*)(3* sizeof(float)));
-    glEnableVertexAttribArray(1);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
-
-    // Create the struct to hold the directions
-    input::Directions Pos_input;
-    input::Directions Pos;
-    Pos.y = 0.0f; Pos.x = 0.0f; Pos.z = -3.0f;
-    Pos_input.y = 0.0f; Pos_input.x = 0.0f; Pos_input.z = 0.0f;
-
-	// Start the Shader Program
-	ShaderProgram.use();
-    ShaderProgram.set("textureShrek", 0);
-
-    // Set program variables
-	ShaderProgram.setPerspective((float) SCR_WIDTH, (float) SCR_HEIGHT);
-
-    float deltaTime = 0.0f;
-    float lastTime = 0.0f;
-    while(!glfwWindowShouldClose(window)) {
-        float currTime = glfwGetTime();
-        deltaTime = currTime - lastTime;
-
-        // Process mouse and keyboard events
-        input::processInput(window, Pos_input);
-        Pos.x = Pos.x + 4*(Pos_input.x * deltaTime);
-        Pos.y = Pos.y + 4*(Pos_input.y * deltaTime);
-        Pos.z = Pos.z + 4*(Pos_input.z * deltaTime);
-        
+        // Start the Shader Program
+        ShaderProgram.use();
+        ShaderProgram.set("textureShrek", 0);
+
+        // Set program variables
+        ShaderProgram.setPerspective((float) SCR_WIDTH, (float) SCR_HEIGHT);
+    }
+
+    /*
+     Will move the simulation on by one fixed step.
+    */
+    auto simulate = [&](framestate::SimState &state, const input::Directions &dirs, double stepSeconds) {
+        state.camera += 4.0f * glm::vec3(dirs.x, dirs.y, dirs.z) * (float) stepSeconds;
+        state.camera.z += 0.25f * dirs.dolly;
+        state.yaw += 1.5f * dirs.yaw * (float) stepSeconds - 0.005f * dirs.look_x;
+        state.pitch = glm::clamp(state.pitch - 0.005f * dirs.look_y, -1.5f, 1.5f);
+        state.time += stepSeconds;
+    };
+
+    /*
+     Will work out everything needed to draw a simulation state (the camera
+     and the cube matrices) into a snapshot.
+    */
+    auto prepare = [&](framestate::Snapshot &snap, const framestate::SimState &state) {
+        TRACE_SCOPE("prepare");
+        float time = (float) state.time;
+
         // create transformations
-        glm::mat4 view = glm::mat4(1.0f);
-        view = glm::translate(view, glm::vec3(Pos.x, Pos.y, Pos.z));
+        if (playingPath)
+            snap.view = CameraPath.view(state.time);
+        else
+            snap.view = glm::rotate(glm::rotate(glm::mat4(1.0f), -state.pitch, glm::vec3(1.0f, 0.0f, 0.0f)),
+                                    -state.yaw, glm::vec3(0.0f, 1.0f, 0.0f)) *
+                        glm::translate(glm::mat4(1.0f), state.camera);
+        snap.time = time;
 
         //glm::vec3 direction;
         //direction.x = cos(glm::radians(yaw));
         //direction.z = sin(glm::radians(yaw));
         //cameraFront = glm::normalize(direction);
 
+        if (Opts.mode == options::INSTANCED) {
+            // Build all the model matrices in one go
+            snap.models.resize(numCubes);
+            Scene.animate(time, Workers);
+            transforms::build(Scene.transformBatch(), snap.models.data(), transforms::detectIsa(), &Workers);
+        }
+    };
+
+    /*
+     The model matrix of cube i, for the modes that don't build them all up front.
+    */
+    auto cubeModel = [&](unsigned int i, float time) {
+        glm::mat4 model = glm::mat4(1.0f);
+        model = glm::translate(model, Scene.position(i));
+        model = glm::rotate(model, time * Scene.speed[i], Scene.axis(i));
+        return model;
+    };
+
+    /*
+     Will draw a snapshot with the software rasteriser (the cubes have already been culled).
+    */
+    auto renderSoftware = [&](const framestate::Snapshot &snap) {
+        TRACE_SCOPE("renderSoftware");
+        glm::mat4 viewProj = ShaderProgram.projection * snap.view;
+        SoftRenderer.beginFrame(backgroundRGBA);
+
+        if (Opts.lod > 0) {
+            const mesh::Mesh &m = CubeLods.mesh;
+            for (size_t l=0; l<LodSelector.buckets.size(); l++) {
+                const lod::Level &level = CubeLods.levels[l];
+                for (size_t j=0; j<LodSelector.buckets[l].size(); j++) {
+                    unsigned int i = LodSelector.buckets[l][j];
+                    SoftRenderer.drawElements(m.vertices.data(), m.stride, &m.indices[level.first_index],
+                                              level.num_indices, viewProj * snap.models[i], softMaterials[0]);
+                }
+            }
+        } else {
+            // The same vertex array that the GL path uploads
+            unsigned int numDraws = Opts.cull == options::CULL_CPU ? visible.size() : numCubes;
+            for (unsigned int j=0; j<numDraws; j++) {
+                unsigned int i = Opts.cull == options::CULL_CPU ? visible[j] : j;
+                if (Opts.num_shapes > 0) {
+                    const mesh::Mesh &m = shapes[Scene.mesh[i]];
+                    SoftRenderer.drawElements(m.vertices.data(), m.stride, m.indices.data(), m.numIndices(),
+                                              viewProj * cubeModel(i, snap.time),
+                                              softMaterials[Scene.material[i] % softMaterials.size()]);
+                } else if (Opts.mode == options::INSTANCED) {
+                    SoftRenderer.drawArrays(Vertices.data, Vertices.num_arr_elem, 0, Vertices.num_vertices,
+                                            viewProj * snap.models[i], softMaterials[0]);
+                } else {
+                    SoftRenderer.drawArrays(Vertices.data, Vertices.num_arr_elem, 0, Vertices.num_vertices,
+                                            viewProj * cubeModel(i, snap.time),
+                                            softMaterials[Scene.material[i] % softMaterials.size()]);
+                }
+            }
+        }
+
+        if (Opts.num_static > 0) {
+            const mesh::Mesh &m = StaticBatch.merged;
+            StaticBatch.forEachRun([&](unsigned int material, unsigned int first_index, unsigned int num_indices) {
+                SoftRenderer.drawElements(m.vertices.data(), m.stride, &m.indices[first_index], num_indices,
+                                          viewProj, softMaterials[material % softMaterials.size()]);
+            });
+            StaticStats.add(StaticBatch.stats);
+        }
+
+        SoftRenderer.endFrame(Workers);
+        SoftStats.add(SoftRenderer.stats);
+    };
+
+    /*
+     Will draw a snapshot (needs the GL context to be current).
+    */
+    auto renderFrame = [&](const framestate::Snapshot &snap) {
+        TRACE_SCOPE("renderFrame");
+        if (resizePending.exchange(false)) {
+            if (software) {
+                // Only the software framebuffer and the projection change size
+                SCR_WIDTH = pendingWidth.load();
+                SCR_HEIGHT = pendingHeight.load();
+                ShaderProgram.projection = shader::perspective((float) SCR_WIDTH, (float) SCR_HEIGHT);
+                SoftRenderer.create(SCR_WIDTH, SCR_HEIGHT);
+            } else {
+                applyResize();
+            }
+            if (!Opts.dump_dir.empty())
+                Capture.resize(SCR_WIDTH, SCR_HEIGHT);
+        }
+        if (Opts.reshape > 0 && ++framesSinceReshape == Opts.reshape) {
+            reshape(numReshapes++ % Opts.num_shapes);
+            framesSinceReshape = 0;
+        }
+
+        const glm::mat4 &view = snap.view;
+
+        if (Opts.cull == options::CULL_CPU) {
+            culling::Frustum frustum = culling::extractFrustum(ShaderProgram.projection * view);
+            CubeBVH.cull(frustum, visible, &Workers);
+            CullStats.add(CubeBVH.stats);
+            if (Opts.num_static > 0)
+                StaticBatch.cull(frustum);
+            if (SceneFile.isOpen())
+                SceneLayer.cull(frustum);
+        }
+        if (Opts.occlusion) {
+            // Before any GL call so it overlaps with the GPU finishing the last frame
+            Occluder.cull(ShaderProgram.projection * view, snap.models.data(), Scene.centre,
+                          0.5f * sqrtf(3.0f), visible, Workers);
+            OcclusionStats.add(Occluder.stats);
+        }
+        if (Opts.lod > 0) {
+            // Pick a level for every cube
+            const std::vector<unsigned int> &drawn = Opts.cull == options::CULL_CPU ? visible : allCubes;
+            float pixelsPerUnit = ShaderProgram.projection[1][1] * SCR_HEIGHT / 2.0f;
+            LodSelector.select(CubeLods, Scene.centre, drawn, view, pixelsPerUnit);
+            LodStats.add(CubeLods, LodSelector);
+        }
+
+        if (software) {
+            renderSoftware(snap);
+            return;
+        }
+
         // retrieve the matrix uniform locations
 		ShaderProgram.set("view", view);
 
+        GpuProfiler.beginFrame();
+        GpuProfiler.begin("clear");
         render::drawFrame(backgroundRGBA);
+        GpuProfiler.end();
 
+        GpuProfiler.begin("cubes");
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, textureShrek);
 
         glBindVertexArray(VAO_handle);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO_handle);
 
-        for (unsigned int i=0; i<numCubes; i++) {
+        if (Opts.mode == options::INSTANCED && Opts.lod > 0) {
+            // Upload the matrices grouped by level and draw each level once
+            unsigned int numModels = 0;
+            for (size_t l=0; l<LodSelector.buckets.size(); l++)
+                for (size_t j=0; j<LodSelector.buckets[l].size(); j++)
+                    lodModels[numModels++] = snap.models[LodSelector.buckets[l][j]];
+
+            if (Opts.upload == options::UPLOAD_RING) {
+                InstanceRing.beginFrame();
+                Instances.uploadRing(InstanceRing, lodModels.data(), numModels);
+            } else {
+                Instances.upload(lodModels.data(), numModels);
+            }
+
+            unsigned int first = 0;
+            for (size_t l=0; l<LodSelector.buckets.size(); l++) {
+                unsigned int n = LodSelector.buckets[l].size();
+                if (n == 0) continue;
+                const lod::Level &level = CubeLods.levels[l];
+                Instances.drawElementsRange(level.num_indices, level.first_index, first, n);
+                first += n;
+            }
+
+            if (Opts.upload == options::UPLOAD_RING)
+                InstanceRing.endFrame();
+        }
+
+        else if (Opts.mode == options::INSTANCED) {
+            // Upload the model matrices in one go and draw once
+            const glm::mat4 *models = snap.models.data();
+            unsigned int numModels = numCubes;
+            if (Opts.cull == options::CULL_CPU) {
+                // Only upload the cubes that survived culling
+                for (unsigned int i=0; i<visible.size(); i++)
+                    visibleModels[i] = snap.models[visible[i]];
+                models = visibleModels.data();
+                numModels = visible.size();
+            }
+
+            if (Opts.upload == options::UPLOAD_RING) {
+                InstanceRing.beginFrame();
+                Instances.uploadRing(InstanceRing, models, numModels);
+                glBindVertexArray(VAO_handle);
+                Instances.draw(0, 36);
+                InstanceRing.endFrame();
+            } else {
+                Instances.upload(models, numModels);
+                Instances.draw(0, 36);
+            }
+        }
+
+        else if (Opts.mode == options::GPU_ANIMATED) {
+            // All the per cube work happens in the vertex shader
+            if (Opts.cull == options::CULL_GPU) {
+                // Visibility is worked out and consumed on the GPU
+                GpuProfiler.begin("cull");
+                GpuCuller.cull(CullProgram, culling::extractFrustum(ShaderProgram.projection * view));
+                GpuProfiler.end();
+                ShaderProgram.use();
+                ShaderProgram.set("time", snap.time);
+                GpuCuller.draw();
+            } else {
+                ShaderProgram.set("time", snap.time);
+                AnimatedInstances.draw(0, 36);
+            }
+        }
 
-            
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, cubePositions[i]);
-            float time = glfwGetTime();
-            model = glm::rotate(model, (float) time * randRot[i][0],
-                    glm::vec3(randRot[i][0], randRot[i][1], randRot[i][2]));
-            //else
-            //    model = glm::rotate(model, (20*i) + Pos.y, glm::vec3(1, 0.3, 0.5));
-		    ShaderProgram.set("model", model);
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+        else if (Opts.multidraw) {
+            // One call per material for every cube
+            unsigned int numDraws = Opts.cull == options::CULL_CPU ? visible.size() : numCubes;
+            MultiDraw.clear();
+            for (unsigned int j=0; j<numDraws; j++) {
+                unsigned int i = Opts.cull == options::CULL_CPU ? visible[j] : j;
+                MultiDraw.add(Scene.material[i] % materials.size(), shapeHandles[Scene.mesh[i]],
+                              cubeModel(i, snap.time));
+            }
+            MultiDrawProgram.use();
+            MultiDrawProgram.set("proj", ShaderProgram.projection);
+            MultiDrawProgram.set("view", view);
+            MultiDraw.submit(GeometryPool, materials);
+            MultiDrawStats.add(MultiDraw.stats);
+            ShaderProgram.use();
+        }
+
+        else {
+            unsigned int numDraws = Opts.cull == options::CULL_CPU ? visible.size() : numCubes;
+            unsigned int boundVAO = VAO_handle;
+            if (Opts.queue) Queue.clear();
+            for (unsigned int j=0; j<numDraws; j++) {
+                unsigned int i = Opts.cull == options::CULL_CPU ? visible[j] : j;
+
+                glm::mat4 model = cubeModel(i, snap.time);
+                //else
+                //    model = glm::rotate(model, (20*i) + Pos.y, glm::vec3(1, 0.3, 0.5));
+                unsigned int texture = materials[Scene.material[i] % materials.size()];
+                renderqueue::DrawItem item = {&ShaderProgram, texture, VAO_handle, 0, 36, model};
+                if (Opts.num_shapes > 0)
+                    shapeDraw(Scene.mesh[i], item);
+
+                if (Opts.queue) {
+                    Queue.add(item, -(view * glm::vec4(Scene.centre[i], 1.0f)).z);
+                    continue;
+                }
+
+                if (materials.size() > 1)
+                    glBindTexture(GL_TEXTURE_2D, texture);
+                if (item.VAO_handle != boundVAO) {
+                    glBindVertexArray(item.VAO_handle);
+                    boundVAO = item.VAO_handle;
+                }
+                ShaderProgram.set("model", model);
+                renderqueue::issue(item);
+            }
+
+            if (Opts.queue) {
+                Queue.submit();
+                QueueStats.add(Queue.stats);
+            }
         }
         //glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        GpuProfiler.end();
+
+        if (Opts.num_static > 0) {
+            // Already in world space, a handful of draws for all of them
+            GpuProfiler.begin("static");
+            StaticProgram.use();
+            StaticProgram.set("proj", ShaderProgram.projection);
+            StaticProgram.set("view", view);
+            glActiveTexture(GL_TEXTURE0);
+            StaticBatch.draw(materials);
+            StaticStats.add(StaticBatch.stats);
+            ShaderProgram.use();
+            GpuProfiler.end();
+        }
+
+        if (SceneFile.isOpen()) {
+            GpuProfiler.begin("scene file");
+            SceneProgram.use();
+            SceneProgram.set("proj", ShaderProgram.projection);
+            SceneProgram.set("view", view);
+            glActiveTexture(GL_TEXTURE0);
+            SceneLayer.draw();
+            SceneLayerStats.add(SceneLayer.stats);
+            ShaderProgram.use();
+            GpuProfiler.end();
+        }
+        GpuProfiler.endFrame();
+    };
+
+    timing::FrameStats Stats;
+
+    if (!Opts.threaded) {
+        /*
+         Input, simulation and drawing all in lockstep on this thread. The
+         simulation only ever moves in fixed steps and each frame draws a
+         blend of the last two, so it runs the same at any frame rate.
+
+         Headless runs and frame benchmarks use a virtual clock that moves
+         exactly 1/60 s a frame (however long the frame really took), so
+         every run simulates and draws exactly the same frames.
+
+         The input goes through as events applied at the start of a step,
+         so --record can log which step each one landed on and --replay can
+         put it back on the same one.
+        */
+        bool virtualClock = Opts.headless || Opts.bench == "frames";
+        framestate::Snapshot snapshot;
+        framestate::SimState prevState, currState;
+        timing::FixedStep Clock(1.0 / simulationHz);
+        timing::Stopwatch frameTimer;
+        double lastTime = virtualClock ? 0.0 : glfwGetTime();
+        unsigned int frame = 0;
+        input::State InputState;
+        std::vector<input::Event> newEvents;
+        unsigned long step = 0;
+        while ((Opts.frames == 0 || frame < Opts.frames) && (Opts.headless || !glfwWindowShouldClose(window)) &&
+               (!playingPath || snapshot.time < CameraPath.duration()) &&
+               (!replaying || !InputReplay.finished(step))) {
+            double currTime = virtualClock ? frame * virtualFrameSeconds : glfwGetTime();
+            timing::Stopwatch cpuTimer;
+
+            // Process mouse and keyboard events (still polled when replaying, so escape works)
+            if (!Opts.headless)
+                InputPoller.poll(window, newEvents);
+            if (replaying)
+                newEvents.clear();
+
+            {
+                TRACE_SCOPE("simulate");
+                for (unsigned int steps=Clock.advance(currTime - lastTime); steps>0; steps--) {
+                    if (replaying && InputReplay.finished(step)) break;
+                    step++;
+
+                    // New input lands on the first step after it was polled
+                    if (replaying)
+                        InputReplay.feed(step, InputState);
+                    for (input::Event &e : newEvents) {
+                        e.step = step;
+                        InputState.apply(e);
+                        if (recording) InputLog.events.push_back(e);
+                    }
+                    newEvents.clear();
+
+                    prevState = currState;
+                    simulate(currState, InputState.directions(), Clock.step_seconds);
+                    InputState.endStep();
+                }
+            }
+            prepare(snapshot, framestate::interpolate(prevState, currState, Clock.alpha()));
+            renderFrame(snapshot);
+            double cpuSeconds = cpuTimer.seconds();
+
+            if (!Opts.dump_dir.empty()) {
+                // Before the swap, while the back buffer still has the frame
+                if (software)
+                    Capture.capture(SoftRenderer.target.colour.data(), SoftRenderer.target.stride,
+                                    SoftRenderer.target.width, SoftRenderer.target.height);
+                else
+                    Capture.capture();
+            }
+            if (Opts.headless) {
+                // The capture's fences keep the GPU from falling too far behind when dumping
+                if (!software && Opts.dump_dir.empty()) {
+                    TRACE_SCOPE("glFinish");
+                    glFinish(); // Stands in for the swap so the GPU can't fall behind
+                }
+            } else {
+                TRACE_SCOPE("swap");
+                if (software)
+                    SoftPresenter.present(SoftRenderer.target);
+                glfwSwapBuffers(window); // Swap the 2D image front and back buffers
+                glfwPollEvents(); // Check for any mouse or keyboard events
+            }
+
+            double frameSeconds = frameTimer.seconds();
+            Stats.add(frameSeconds, cpuSeconds);
+            if (playingPath)
+                PathStats.add(CameraPath, snapshot.time, frameSeconds, cpuSeconds);
+            frameTimer.reset();
+            lastTime = currTime;
+            frame++;
+        }
+        if (Clock.num_dropped > 0)
+            std::cout << "simulation: fell behind and dropped time on " << Clock.num_dropped << " frames" << std::endl;
+        if (recording) {
+            InputLog.save(Opts.record_file, step);
+            std::cout << "input: recorded " << InputLog.events.size() - 1 << " events over " << step;
+            std::cout << " steps to '" << Opts.record_file << "' (" << InputLog.num_bytes << " bytes)" << std::endl;
+        }
+        if (replaying)
+            std::cout << "input: replayed " << InputLog.events.size() - 1 << " events over " << step << " steps" << std::endl;
+    }
 
+    else {
+        /*
+         This thread handles the window events (GLFW needs that on the main
+         thread), a simulation thread turns the latest input into snapshots
+         and a render thread (which owns the GL context) draws the latest
+         snapshot. Triple buffers between them mean nobody waits on anybody.
+        */
+        framestate::TripleBuffer<input::Directions> InputBuffer;
+        framestate::TripleBuffer<framestate::Snapshot> SnapshotBuffer;
+        for (unsigned int i=0; i<3; i++)
+            SnapshotBuffer.slot(i).models.reserve(Opts.mode == options::INSTANCED ? numCubes : 0);
+        std::atomic<bool> running(true);
+        std::atomic<unsigned long> simSteps(0);
 
-        glfwSwapBuffers(window); // Swap the 2D image front and back buffers
-        glfwPollEvents(); // Check for any mouse or keyboard events
+        glfwMakeContextCurrent(NULL);
 
-        lastTime = currTime;
+        std::thread simThread([&] {
+            TRACE_THREAD_NAME("simulation");
+            const double stepSeconds = 1.0 / simulationHz;
+            std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+            input::Directions dirs;
+            framestate::SimState state;
+            unsigned long step = 0;
+            while (running.load()) {
+                InputBuffer.update();
+                dirs = InputBuffer.readBuffer();
+
+                // Same fixed step as the single threaded loop, it's the sleep that keeps it in real time
+                simulate(state, dirs, stepSeconds);
+                framestate::Snapshot &snap = SnapshotBuffer.writeBuffer();
+                snap.step = ++step;
+                prepare(snap, state);
+                SnapshotBuffer.publish();
+                simSteps.store(step);
+
+                next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(stepSeconds));
+                std::this_thread::sleep_until(next);
+            }
+        });
+
+        std::thread renderThread([&] {
+            TRACE_THREAD_NAME("render");
+            glfwMakeContextCurrent(window);
+
+            // Wait for the first snapshot
+            while (running.load() && !SnapshotBuffer.update())
+                std::this_thread::yield();
+
+            // A frame runs from the end of one swap to the end of the next, as in the lockstep loop
+            timing::Stopwatch frameTimer;
+            while (running.load()) {
+                timing::Stopwatch cpuTimer;
+
+                // Draw the newest snapshot, or the last one again if the simulation is behind
+                SnapshotBuffer.update();
+                renderFrame(SnapshotBuffer.readBuffer());
+                double cpuSeconds = cpuTimer.seconds();
+
+                if (!Opts.dump_dir.empty())
+                    Capture.capture();
+                {
+                    TRACE_SCOPE("swap");
+                    glfwSwapBuffers(window);
+                }
+                double drawnTime = SnapshotBuffer.readBuffer().time;
+                double frameSeconds = frameTimer.seconds();
+                Stats.add(frameSeconds, cpuSeconds);
+                if (playingPath)
+                    PathStats.add(CameraPath, drawnTime, frameSeconds, cpuSeconds);
+                frameTimer.reset();
+
+                if ((Opts.frames != 0 && Stats.num_frames >= Opts.frames) ||
+                    (playingPath && drawnTime >= CameraPath.duration())) {
+                    glfwSetWindowShouldClose(window, true);
+                    break;
+                }
+            }
+
+            glfwMakeContextCurrent(NULL);
+        });
+
+        while (!glfwWindowShouldClose(window)) {
+            glfwWaitEventsTimeout(0.005);
+            input::processInput(window, InputBuffer.writeBuffer());
+            InputBuffer.publish();
+        }
+
+        running.store(false);
+        simThread.join();
+        renderThread.join();
+        glfwMakeContextCurrent(window);
+        std::cout << "simulation: " << simSteps.load() << " steps" << std::endl;
     }
+    if (!Opts.dump_dir.empty())
+        Capture.finish();
+    Stats.print(options::modeName(Opts.mode));
+    PathStats.print(CameraPath);
+    Capture.print();
+    CullStats.print();
+    OcclusionStats.print();
+    SoftStats.print();
+    StaticStats.print();
+    SceneLayerStats.print();
+    QueueStats.print();
+    MultiDrawStats.print();
+    GpuProfiler.print();
+    LodStats.print();
+    if (Opts.num_shapes > 0 && Opts.geometry == options::GEOMETRY_POOL && !software)
+        GeometryPool.print();
+    if (!Opts.trace_file.empty())
+        trace::writeChrome(Opts.trace_file);
+    if (Opts.upload == options::UPLOAD_RING) {
+        std::cout << "ring: " << (InstanceRing.persistent ? "persistent" : "unsynchronised map");
+        std::cout << ", " << InstanceRing.num_stalls << " stalls, " << InstanceRing.num_orphans;
+        std::cout << " orphans" << std::endl;
+    }
+    if (Opts.cull == options::CULL_GPU)
+        std::cout << "gpu cull: " << GpuCuller.readVisibleCount() << " / " << numCubes
+                  << " visible in the last frame" << std::endl;
 
 
     /*
      Finalise -deallocate and tidy up memory
     */
+    if (software) {
+        SoftPresenter.destroy();
+        if (!Opts.headless)
+            glfwTerminate();
+        return 0;
+    }
     glDeleteVertexArrays(1, &VAO_handle);
     glDeleteBuffers(1, &VBO_handle);
+    if (Opts.mode == options::INSTANCED)
+        Instances.destroy();
+    if (Opts.upload == options::UPLOAD_RING)
+        InstanceRing.destroy();
+    if (Opts.lod > 0)
+        LodMesh.destroy();
+    if (Opts.mode == options::GPU_ANIMATED && Opts.cull != options::CULL_GPU)
+        AnimatedInstances.destroy();
+    if (Opts.cull == options::CULL_GPU) {
+        GpuCuller.destroy();
+        IndexedCube.destroy();
+        glDeleteProgram(CullProgram.handle);
+    }
+    if (Opts.multidraw) {
+        MultiDraw.destroy();
+        glDeleteProgram(MultiDrawProgram.handle);
+    }
+    if (Opts.num_shapes > 0 && Opts.geometry == options::GEOMETRY_POOL)
+        GeometryPool.destroy();
+    for (unsigned int s=0; s<Opts.num_shapes && Opts.geometry == options::GEOMETRY_SEPARATE; s++)
+        shapeMeshes[s].destroy();
+    if (Opts.num_static > 0) {
+        StaticBatch.destroy();
+        glDeleteProgram(StaticProgram.handle);
+    }
+    if (SceneFile.isOpen()) {
+        SceneLayer.destroy();
+        glDeleteProgram(SceneProgram.handle);
+    }
+    GpuProfiler.destroy();
+    Capture.destroy();
     glDeleteProgram(ShaderProgram.handle);
-    glfwTerminate();
+    if (Opts.headless) {
+        Target.destroy();
+        HeadlessContext.destroy();
+    } else {
+        glfwTerminate();
+    }
 
     return 0;
 }
 
 
 
+/*
+ The callback runs on the main thread, which might not own the GL context, so
+ it only records the new size and the renderer applies it on its next frame.
+*/
 void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
+    pendingWidth.store(width);
+    pendingHeight.store(height);
+    resizePending.store(true);
+}
+
+void applyResize() {
+    int width = pendingWidth.load();
+    int height = pendingHeight.load();
+    SCR_WIDTH = width;
+    SCR_HEIGHT = height;
     glViewport(0, 0, width, height);
     glScissor(0, 0, width, height);
 
+    ShaderProgram.use();
     ShaderProgram.setPerspective((float) width, (float) height);
 }
@@ -0,0 +1,39 @@
+#version 430 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aTexCoord;
+layout (location = 2) in uint aInstance;
+
+struct Instance {
+    vec4 positionRadius;
+    vec4 axisSpeed;
+    uint mesh;
+};
+
+layout (std430, binding = 0) readonly buffer Instances { Instance instances[]; };
+
+out vec2 texCoord;
+
+uniform mat4 view;
+uniform mat4 proj;
+uniform float time;
+
+// Same matrix glm::rotate builds (rotation by angle about a normalised axis)
+mat3 rotation(float angle, vec3 axis)
+{
+    vec3 a = normalize(axis);
+    float c = cos(angle);
+    float s = sin(angle);
+    vec3 t = (1.0 - c) * a;
+
+    return mat3(c + t.x * a.x,       t.x * a.y + s * a.z, t.x * a.z - s * a.y,
+                t.y * a.x - s * a.z, c + t.y * a.y,       t.y * a.z + s * a.x,
+                t.z * a.x + s * a.y, t.z * a.y - s * a.x, c + t.z * a.z);
+}
+
+void main()
+{
+    Instance inst = instances[aInstance];
+    vec3 worldPos = inst.positionRadius.xyz + rotation(time * inst.axisSpeed.w, inst.axisSpeed.xyz) * aPos;
+    gl_Position = proj * view * vec4(worldPos, 1.0);
+    texCoord = vec2(aTexCoord.x, aTexCoord.y);
+}
@@ -0,0 +1,23 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aTexCoord;
+layout (location = 2) in vec4 aPositionScale;
+layout (location = 3) in vec4 aRotation;
+
+out vec2 texCoord;
+
+uniform mat4 view;
+uniform mat4 proj;
+
+// Rotate by a unit quaternion (x, y, z, w)
+vec3 rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main()
+{
+    vec3 worldPos = aPositionScale.xyz + rotate(aRotation, aPositionScale.w * aPos);
+    gl_Position = proj * view * vec4(worldPos, 1.0);
+    texCoord = vec2(aTexCoord.x, aTexCoord.y);
+}